@@ -162,9 +162,18 @@ struct yscene {
     // trace
     ytrace::trace_params trace_params;
     bool trace_save_progressive = false;
+    std::string trace_checkpoint;
+    float trace_checkpoint_interval = 600;
+    std::string trace_partial;
+    bool trace_resume = false;
+    bool trace_denoise = false;
+    ytrace::denoise_params trace_denoise_params;
     int trace_block_size = 32;
     int trace_batch_size = 16;
     int trace_nthreads = 0;
+    std::string trace_texture_cache;
+    int trace_texture_cache_memory = 256;
+    bool trace_texture_compression = false;
     ytrace::scene* trace_scene = nullptr;
 
     // interactive trace
@@ -201,7 +210,9 @@ inline bool load_scene(
     auto ext = yu::path::get_extension(filename);
     if (ext == ".obj") {
         auto err = std::string();
-        scn->oscn = yobj::load_scene(filename, true, true, true, true, &err);
+        // with a texture cache, textures are loaded one at a time later
+        scn->oscn = yobj::load_scene(filename, scn->trace_texture_cache.empty(),
+            true, true, true, &err);
         if (!scn->oscn) {
             yu::logging::log_error("cannot load scene %s", filename.c_str());
             return false;
@@ -1669,7 +1680,8 @@ void draw_widgets(ygui::window* win) {
         std::vector<std::pair<std::string, ytrace::rng_type>>{
             {"uniform", ytrace::rng_type::uniform},
             {"stratified", ytrace::rng_type::stratified},
-            {"cmjs", ytrace::rng_type::cmjs}};
+            {"cmjs", ytrace::rng_type::cmjs},
+            {"sobol", ytrace::rng_type::sobol}};
     static auto stype_names =
         std::vector<std::pair<std::string, ytrace::shader_type>>{
             {"eye", ytrace::shader_type::eyelight},
@@ -1716,6 +1728,11 @@ void draw_widgets(ygui::window* win) {
             if (ygui::combo_widget(
                     win, "filter type", &scn->trace_params.ftype, ftype_names))
                 scn->scene_updated = true;
+            if (ygui::checkbox_widget(win, "denoise", &scn->trace_denoise) &&
+                scn->trace_denoise && !scn->trace_params.aux_buffers) {
+                scn->trace_params.aux_buffers = true;
+                scn->scene_updated = true;
+            }
         }
         if (scn->oscn) {
             auto camera_names =
@@ -1783,7 +1800,8 @@ void parse_cmdline(yscene* scene, int argc, char** argv, const char* name,
         std::vector<std::pair<std::string, ytrace::rng_type>>{
             {"uniform", ytrace::rng_type::uniform},
             {"stratified", ytrace::rng_type::stratified},
-            {"cmjs", ytrace::rng_type::cmjs}};
+            {"cmjs", ytrace::rng_type::cmjs},
+            {"sobol", ytrace::rng_type::sobol}};
     static auto ftype_names =
         std::vector<std::pair<std::string, ytrace::filter_type>>{
             {"box", ytrace::filter_type::box},
@@ -1828,12 +1846,34 @@ void parse_cmdline(yscene* scene, int argc, char** argv, const char* name,
         scene->trace_params.camera_id = 0;
         scene->trace_save_progressive = parse_flag(
             parser, "--save-progressive", "", "save progressive images");
+        scene->trace_checkpoint = parse_opts(
+            parser, "--checkpoint", "", "checkpoint filename", "");
+        scene->trace_checkpoint_interval = parse_optf(parser,
+            "--checkpoint-interval", "", "seconds between checkpoints", 600);
+        scene->trace_resume =
+            parse_flag(parser, "--resume", "", "resume from the checkpoint");
+        scene->trace_partial = parse_opts(parser, "--partial", "",
+            "partial filename, to merge with ytracemerge", "");
+        auto crop_x = parse_opti(parser, "--crop-x", "", "crop window x", 0);
+        auto crop_y = parse_opti(parser, "--crop-y", "", "crop window y", 0);
+        auto crop_width = parse_opti(
+            parser, "--crop-width", "", "crop window width (0 for all)", 0);
+        auto crop_height = parse_opti(
+            parser, "--crop-height", "", "crop window height (0 for all)", 0);
+        scene->trace_params.crop = {
+            {crop_x, crop_y}, {crop_x + crop_width, crop_y + crop_height}};
+        scene->trace_params.sample_start =
+            parse_opti(parser, "--sample-start", "", "first sample", 0);
+        scene->trace_params.sample_end = parse_opti(
+            parser, "--sample-end", "", "end sample (0 for all)", 0);
         scene->trace_params.rtype = parse_opte(parser, "--random", "",
             "random type", ytrace::rng_type::stratified, rtype_names);
         scene->trace_params.ftype = parse_opte(parser, "--filter", "",
             "filter type", ytrace::filter_type::box, ftype_names);
         scene->trace_params.stype = parse_opte(parser, "--shader", "-S",
             "path estimator type", ytrace::shader_type::pathtrace, stype_names);
+        scene->trace_params.wavefront = parse_flag(
+            parser, "--wavefront", "", "trace paths in wavefront order");
         scene->trace_params.envmap_invisible =
             parse_flag(parser, "--envmap-invisible", "", "envmap invisible");
         scene->trace_nthreads = parse_opti(
@@ -1846,8 +1886,48 @@ void parse_cmdline(yscene* scene, int argc, char** argv, const char* name,
             parse_opti(parser, "--samples", "-s", "image samples", 256);
         scene->trace_params.aux_buffers =
             parse_flag(parser, "--aux-buffers", "", "saves additional buffers");
+        scene->trace_params.aux_half = parse_flag(
+            parser, "--aux-half", "", "stores additional buffers as halfs");
+        scene->trace_denoise =
+            parse_flag(parser, "--denoise", "", "denoise the traced image");
+        if (scene->trace_denoise) scene->trace_params.aux_buffers = true;
         scene->trace_params.parallel =
             !parse_flag(parser, "--no-parallel", "", "so not run in parallel");
+        scene->trace_params.adaptive_error = parse_optf(parser,
+            "--adaptive-error", "", "adaptive sampling error [0 for none]", 0);
+        scene->trace_params.adaptive_min_samples = parse_opti(parser,
+            "--adaptive-min-samples", "", "adaptive sampling min samples", 16);
+        scene->trace_params.adaptive_budget = parse_opti(parser,
+            "--adaptive-budget", "", "adaptive sampling average samples", 0);
+        scene->trace_params.hit_cache_samples = parse_opti(parser,
+            "--hit-cache", "", "camera hits cached per pixel [0 for none]", 0);
+        scene->trace_params.guiding =
+            parse_flag(parser, "--guiding", "", "learn a path guide");
+        scene->trace_params.guiding_memory = parse_opti(parser,
+            "--guiding-memory", "", "path guide memory cap in megabytes", 64);
+        scene->trace_params.light_candidates =
+            parse_opti(parser, "--light-candidates", "",
+                "light samples resampled per camera hit", 1);
+        scene->trace_params.light_reuse = parse_flag(
+            parser, "--light-reuse", "", "reuse light samples across pixels");
+        scene->trace_params.radiance_cache = parse_flag(
+            parser, "--radiance-cache", "", "end paths into a radiance cache");
+        scene->trace_params.radiance_cache_samples =
+            parse_opti(parser, "--radiance-cache-samples", "",
+                "samples that fill the radiance cache", 16);
+        scene->trace_params.radiance_cache_cell =
+            parse_optf(parser, "--radiance-cache-cell", "",
+                "radiance cache cell size relative to the scene", 0.01f);
+        scene->trace_params.radiance_cache_memory =
+            parse_opti(parser, "--radiance-cache-memory", "",
+                "radiance cache memory cap in megabytes", 64);
+        scene->trace_texture_cache = parse_opts(parser, "--texture-cache", "",
+            "directory of tiled textures paged in on demand", "");
+        scene->trace_texture_cache_memory =
+            parse_opti(parser, "--texture-cache-memory", "",
+                "texture cache memory cap in megabytes", 256);
+        scene->trace_texture_compression = parse_flag(parser,
+            "--texture-compression", "", "block compress ldr textures");
     }
 
     // render
@@ -68,9 +68,16 @@ void draw_image(ygui::window* win) {
     yglu::clear_buffers(scn->background);
 
     // update texture
-    auto& img = ytrace::get_traced_image(scn->trace_state);
-    yglu::update_texture(scn->trace_texture_id, img.width(), img.height(), 4,
-        (float*)img.data(), false);
+    if (scn->trace_denoise) {
+        auto img = ytrace::get_denoised_image(
+            scn->trace_state, scn->trace_denoise_params);
+        yglu::update_texture(scn->trace_texture_id, img.width(), img.height(),
+            4, (float*)img.data(), false);
+    } else {
+        auto& img = ytrace::get_traced_image(scn->trace_state);
+        yglu::update_texture(scn->trace_texture_id, img.width(), img.height(),
+            4, (float*)img.data(), false);
+    }
 
     // draw image
     auto window_size = ygui::get_window_size(win);
@@ -153,8 +160,10 @@ std::vector<ym::vec4i> make_trace_blocks(int w, int h, int bs) {
 void render_offline(yscene* scn) {
     // render
     log_info("starting renderer");
-    for (auto cur_sample = 0; cur_sample < scn->trace_params.nsamples;
-         cur_sample += scn->trace_batch_size) {
+    auto checkpoint_time = std::chrono::steady_clock::now();
+    while (ytrace::get_cur_sample(scn->trace_state) <
+           scn->trace_params.nsamples) {
+        auto cur_sample = ytrace::get_cur_sample(scn->trace_state);
         if (scn->trace_save_progressive && cur_sample) {
             auto imfilename = yu::path::get_dirname(scn->imfilename) +
                               yu::path::get_basename(scn->imfilename) +
@@ -166,15 +175,51 @@ void render_offline(yscene* scn) {
         }
         log_info(
             "rendering sample %4d/%d", cur_sample, scn->trace_params.nsamples);
-        ytrace::trace_next_samples(scn->trace_state, scn->trace_batch_size);
+        if (!ytrace::trace_next_samples(
+                scn->trace_state, scn->trace_batch_size))
+            break;
+        auto now = std::chrono::steady_clock::now();
+        if (scn->trace_checkpoint != "" &&
+            std::chrono::duration<float>(now - checkpoint_time).count() >=
+                scn->trace_checkpoint_interval) {
+            log_info("saving checkpoint %s", scn->trace_checkpoint.c_str());
+            ytrace::save_checkpoint(scn->trace_state, scn->trace_checkpoint);
+            checkpoint_time = now;
+        }
     }
     log_info("rendering done");
 
+    // save checkpoint, to continue with more samples
+    if (scn->trace_checkpoint != "") {
+        log_info("saving checkpoint %s", scn->trace_checkpoint.c_str());
+        ytrace::save_checkpoint(scn->trace_state, scn->trace_checkpoint);
+    }
+
+    // save partial, to merge with the other parts of the image
+    if (scn->trace_partial != "") {
+        log_info("saving partial %s", scn->trace_partial.c_str());
+        if (!ytrace::save_partial(scn->trace_state, scn->trace_partial))
+            yu::logging::log_error(
+                "cannot save partial %s", scn->trace_partial.c_str());
+    }
+
     // save image
     log_info("saving image %s", scn->imfilename.c_str());
     save_image(scn->imfilename, ytrace::get_traced_image(scn->trace_state),
         scn->exposure, scn->tonemap, scn->gamma);
 
+    // save denoised image
+    if (scn->trace_denoise) {
+        auto denoised = yu::path::get_dirname(scn->imfilename) +
+                        yu::path::get_basename(scn->imfilename) + ".denoised" +
+                        yu::path::get_extension(scn->imfilename);
+        log_info("saving denoised image %s", denoised.c_str());
+        save_image(denoised,
+            ytrace::get_denoised_image(
+                scn->trace_state, scn->trace_denoise_params),
+            scn->exposure, scn->tonemap, scn->gamma);
+    }
+
     // save additional buffers
     if (scn->trace_params.aux_buffers) {
         log_info("saving additional buffers for %s", scn->imfilename.c_str());
@@ -197,7 +242,42 @@ void render_offline(yscene* scn) {
 // TRACE SCENE
 // ---------------------------------------------------------------------------
 
-ytrace::scene* make_trace_scene(const yobj::scene* scene, const ycamera* cam) {
+//
+// Adds a texture paged from a tiled file in the texture cache directory,
+// converting it the first time. Pixels already in memory are converted
+// directly, otherwise the image is loaded from filename just for this.
+//
+int add_cached_texture(ytrace::scene* trace_scene, const std::string& cachedir,
+    const std::string& filename, const ym::image4b& ldr, const ym::image4f& hdr,
+    bool srgb) {
+    auto tiledname = filename;
+    for (auto& c : tiledname)
+        if (c == '/' || c == '\\' || c == ':') c = '_';
+    tiledname = cachedir + "/" + tiledname + ".ytx";
+    auto tid = ytrace::add_tiled_texture(trace_scene, tiledname);
+    if (tid >= 0) return tid;
+    log_info("converting texture %s", filename.c_str());
+    auto ok = false;
+    if (ldr) {
+        ok = ytrace::save_tiled_texture(tiledname, &ldr, srgb);
+    } else if (hdr) {
+        ok = ytrace::save_tiled_texture(tiledname, &hdr);
+    } else if (yimg::is_hdr_filename(filename)) {
+        auto img = yimg::load_image4f(filename);
+        ok = img && ytrace::save_tiled_texture(tiledname, &img);
+    } else {
+        auto img = yimg::load_image4b(filename);
+        ok = img && ytrace::save_tiled_texture(tiledname, &img, srgb);
+    }
+    if (ok) tid = ytrace::add_tiled_texture(trace_scene, tiledname);
+    if (tid < 0)
+        yu::logging::log_error("cannot cache texture %s", filename.c_str());
+    return tid;
+}
+
+ytrace::scene* make_trace_scene(const yobj::scene* scene, const ycamera* cam,
+    const std::string& filename, const std::string& texture_cache,
+    bool compress_textures) {
     auto trace_scene = ytrace::make_scene();
 
     ytrace::add_camera(trace_scene, cam->frame, cam->yfov, cam->aspect,
@@ -207,10 +287,23 @@ ytrace::scene* make_trace_scene(const yobj::scene* scene, const ycamera* cam) {
             cam->aspect, cam->aperture, cam->focus);
     }
 
+    // normal maps hold data, not sRGB colors
+    auto data_textures = std::map<yobj::texture*, bool>();
+    for (auto mat : scene->materials)
+        if (mat->norm_txt) data_textures[mat->norm_txt] = true;
+
     auto texture_map = std::map<yobj::texture*, int>{{nullptr, -1}};
     for (auto txt : scene->textures) {
-        if (txt->ldr) {
-            texture_map[txt] = ytrace::add_texture(trace_scene, &txt->ldr);
+        auto srgb = !data_textures.count(txt);
+        if (!texture_cache.empty()) {
+            auto path = yu::path::get_dirname(filename) + txt->path;
+            for (auto& c : path)
+                if (c == '\\') c = '/';
+            texture_map[txt] = add_cached_texture(
+                trace_scene, texture_cache, path, txt->ldr, txt->hdr, srgb);
+        } else if (txt->ldr) {
+            texture_map[txt] = ytrace::add_texture(
+                trace_scene, &txt->ldr, compress_textures, srgb);
         } else if (txt->hdr) {
             texture_map[txt] = ytrace::add_texture(trace_scene, &txt->hdr);
         } else {
@@ -304,8 +397,9 @@ ytrace::scene* make_trace_scene(const yobj::scene* scene, const ycamera* cam) {
     return trace_scene;
 }
 
-ytrace::scene* make_trace_scene(
-    const ygltf::scene_group* scenes, const ycamera* cam) {
+ytrace::scene* make_trace_scene(const ygltf::scene_group* scenes,
+    const ycamera* cam, const std::string& filename,
+    const std::string& texture_cache, bool compress_textures) {
     auto trace_scene = ytrace::make_scene();
 
     ytrace::add_camera(trace_scene, cam->frame, cam->yfov, cam->aspect,
@@ -317,10 +411,25 @@ ytrace::scene* make_trace_scene(
             cam->cam->focus);
     }
 
+    // normal maps hold data, not sRGB colors
+    auto data_textures = std::map<ygltf::texture*, bool>();
+    for (auto mat : scenes->materials)
+        if (mat->normal_txt) data_textures[mat->normal_txt] = true;
+
     auto texture_map = std::map<ygltf::texture*, int>{{nullptr, -1}};
     for (auto txt : scenes->textures) {
-        if (txt->ldr) {
-            texture_map[txt] = ytrace::add_texture(trace_scene, &txt->ldr);
+        auto srgb = !data_textures.count(txt);
+        if (!texture_cache.empty()) {
+            // embedded images are named after the scene
+            auto tid = std::to_string(texture_map.size() - 1);
+            auto path = (txt->path.empty()) ?
+                            filename + "_" + tid :
+                            yu::path::get_dirname(filename) + txt->path;
+            texture_map[txt] = add_cached_texture(
+                trace_scene, texture_cache, path, txt->ldr, txt->hdr, srgb);
+        } else if (txt->ldr) {
+            texture_map[txt] = ytrace::add_texture(
+                trace_scene, &txt->ldr, compress_textures, srgb);
         } else if (txt->hdr) {
             texture_map[txt] = ytrace::add_texture(trace_scene, &txt->hdr);
         } else {
@@ -423,9 +532,24 @@ int main(int argc, char* argv[]) {
 
     // build trace scene
     log_info("setting up tracer");
-    scn->trace_scene = (scn->oscn) ?
-                           make_trace_scene(scn->oscn, scn->view_cam) :
-                           make_trace_scene(scn->gscn, scn->view_cam);
+    scn->trace_scene =
+        (scn->oscn) ? make_trace_scene(scn->oscn, scn->view_cam, scn->filename,
+                          scn->trace_texture_cache,
+                          scn->trace_texture_compression) :
+                      make_trace_scene(scn->gscn, scn->view_cam, scn->filename,
+                          scn->trace_texture_cache,
+                          scn->trace_texture_compression);
+    if (!scn->trace_texture_cache.empty()) {
+        ytrace::set_texture_cache_memory(
+            scn->trace_scene, scn->trace_texture_cache_memory);
+        // gltf images were loaded eagerly and are now paged from the cache
+        if (scn->gscn) {
+            for (auto txt : scn->gscn->textures) {
+                txt->ldr = {};
+                txt->hdr = {};
+            }
+        }
+    }
     // build bvh
     log_info("building bvh");
     ytrace::init_intersection(scn->trace_scene);
@@ -441,6 +565,12 @@ int main(int argc, char* argv[]) {
     scn->trace_params.height = height;
     scn->trace_state = ytrace::make_state();
     ytrace::init_state(scn->trace_state, scn->trace_scene, scn->trace_params);
+    if (scn->trace_resume && scn->trace_checkpoint != "") {
+        log_info("resuming from checkpoint %s", scn->trace_checkpoint.c_str());
+        if (!ytrace::load_checkpoint(scn->trace_state, scn->trace_scene,
+                scn->trace_params, scn->trace_checkpoint))
+            log_info("cannot resume from checkpoint, starting over");
+    }
     scn->trace_blocks = make_trace_blocks(width, height, scn->trace_block_size);
 
 #ifndef YOCTO_NO_OPENGL
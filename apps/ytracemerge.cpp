@@ -0,0 +1,76 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2017 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "../yocto/yocto_img.h"
+#include "../yocto/yocto_math.h"
+#include "../yocto/yocto_trace.h"
+#include "../yocto/yocto_utils.h"
+
+using yu::logging::log_fatal;
+using yu::logging::log_info;
+
+int main(int argc, char* argv[]) {
+    static auto tmtype_names =
+        std::vector<std::pair<std::string, ym::tonemap_type>>{
+            {"none", ym::tonemap_type::none}, {"srgb", ym::tonemap_type::srgb},
+            {"gamma", ym::tonemap_type::gamma},
+            {"filmic", ym::tonemap_type::filmic}};
+
+    // command line params
+    auto parser = yu::cmdline::make_parser(
+        argc, argv, "ytracemerge", "merges partial renders of ytrace");
+    auto output =
+        parse_opts(parser, "--output", "-o", "output image filename", "", true);
+    auto exposure = parse_optf(parser, "--exposure", "-e", "hdr exposure", 0);
+    auto gamma = parse_optf(parser, "--gamma", "-g", "hdr gamma", 2.2f);
+    auto tonemap = parse_opte(parser, "--tonemap", "-t", "hdr tonemap",
+        ym::tonemap_type::srgb, tmtype_names);
+    auto filenames = parse_argas(
+        parser, "partials", "partial filenames", {}, -1, true);
+    check_parser(parser);
+
+    // merge partials
+    log_info("merging %d partials", (int)filenames.size());
+    auto img = ym::image4f();
+    if (!ytrace::merge_partials(filenames, img))
+        log_fatal("cannot merge partials");
+
+    // save image
+    log_info("saving image %s", output.c_str());
+    if (yimg::is_hdr_filename(output)) {
+        if (!yimg::save_image4f(output, img))
+            log_fatal("cannot save image %s", output.c_str());
+    } else {
+        auto ldr = ym::tonemap_image(img, tonemap, exposure, gamma);
+        if (!yimg::save_image4b(output, ldr))
+            log_fatal("cannot save image %s", output.c_str());
+    }
+
+    // done
+    return 0;
+}
@@ -616,10 +616,12 @@ void get_ray_log(int& nrays, int& nbbox_inters, int& npoint_inters,
 // traversal, we will speed up computation significantly while simplifying
 // the code; note in fact that all subsequence farthest iterations will be
 // rejected in the tmax tests
+// - Hits are passed to the filter, and rejected ones are skipped without
+// shortening the ray, so traversal continues from where it is
 //
-template <typename Isec>
+template <typename Isec, typename Filter>
 intersection_point intersect_bvh(const bvh_tree* bvh, const ym::ray3f& ray_,
-    bool early_exit, const Isec& intersect_elem) {
+    bool early_exit, const Isec& intersect_elem, const Filter& filter) {
     // node stack
     int node_stack[64];
     auto node_cur = 0;
@@ -669,7 +671,8 @@ intersection_point intersect_bvh(const bvh_tree* bvh, const ym::ray3f& ray_,
             for (auto i = 0; i < node.count; i++) {
                 auto idx = bvh->sorted_prim[node.start + i];
                 auto pp = intersection_point();
-                if ((pp = intersect_elem(idx, ray, early_exit))) {
+                if ((pp = intersect_elem(idx, ray, early_exit)) &&
+                    filter(pp)) {
                     if (early_exit) return pp;
                     pt = pp;
                     ray.tmax = pt.dist;
@@ -682,13 +685,32 @@ intersection_point intersect_bvh(const bvh_tree* bvh, const ym::ray3f& ray_,
 }
 
 //
-// Shape intersection
+// Intersect ray with a bvh accepting all hits.
+//
+template <typename Isec>
+intersection_point intersect_bvh(const bvh_tree* bvh, const ym::ray3f& ray,
+    bool early_exit, const Isec& intersect_elem) {
+    return intersect_bvh(bvh, ray, early_exit, intersect_elem,
+        [](const intersection_point&) { return true; });
+}
+
+//
+// Shape intersection. Hits are completed with the shape and instance ids
+// before being passed to the filter.
 //
-intersection_point intersect_shape(
-    const shape* shp, const ym::ray3f& ray, bool early_exit) {
+template <typename Filter>
+intersection_point intersect_shape(const shape* shp, const ym::ray3f& ray,
+    bool early_exit, int iid, const Filter& filter_) {
     // initialize point
     auto pt = intersection_point();
 
+    // complete hits before filtering
+    auto filter = [shp, iid, &filter_](intersection_point& pt) {
+        pt.sid = shp->sid;
+        pt.iid = iid;
+        return filter_(pt);
+    };
+
     // switch over shape type
     if (shp->triangle) {
         pt = intersect_bvh(shp->bvh, ray, early_exit,
@@ -701,7 +723,8 @@ intersection_point intersect_shape(
                 pt.euv = {pt.euv.x, pt.euv.y, pt.euv.z, 0};
                 pt.eid = eid;
                 return pt;
-            });
+            },
+            filter);
     } else if (shp->line) {
         assert(shp->radius);
         pt = intersect_bvh(shp->bvh, ray, early_exit,
@@ -715,7 +738,8 @@ intersection_point intersect_shape(
                 pt.euv = {pt.euv.x, pt.euv.y, 0, 0};
                 pt.eid = eid;
                 return pt;
-            });
+            },
+            filter);
     } else if (shp->point) {
         assert(shp->radius);
         pt = intersect_bvh(shp->bvh, ray, early_exit,
@@ -728,7 +752,8 @@ intersection_point intersect_shape(
                 pt.euv = {1, 0, 0, 0};
                 pt.eid = eid;
                 return pt;
-            });
+            },
+            filter);
     } else if (shp->tetra) {
         pt = intersect_bvh(shp->bvh, ray, early_exit,
             [shp](int eid, const ym::ray3f& ray, bool early_exit) {
@@ -740,7 +765,8 @@ intersection_point intersect_shape(
                     return intersection_point{};
                 pt.eid = eid;
                 return pt;
-            });
+            },
+            filter);
     } else {
         assert(shp->radius);
         pt = intersect_bvh(shp->bvh, ray, early_exit,
@@ -752,34 +778,52 @@ intersection_point intersect_shape(
                 pt.euv = {1, 0, 0, 0};
                 pt.eid = eid;
                 return pt;
-            });
+            },
+            filter);
     }
-    if (pt.eid >= 0) pt.sid = shp->sid;
     return pt;
 }
 
 //
 // Instance intersection
 //
-intersection_point intersect_instance(
-    const instance* ist, const ym::ray3f& ray, bool early_exit) {
-    auto pt = intersect_shape(
-        ist->shp, ym::transform_ray(ist->xform_inv, ray), early_exit);
-    if (pt.eid >= 0) pt.iid = ist->iid;
-    return pt;
+template <typename Filter>
+intersection_point intersect_instance(const instance* ist,
+    const ym::ray3f& ray, bool early_exit, const Filter& filter) {
+    return intersect_shape(ist->shp, ym::transform_ray(ist->xform_inv, ray),
+        early_exit, ist->iid, filter);
 }
 
 //
 // Scene intersection
 //
-intersection_point intersect_scene(
-    const scene* scn, const ym::ray3f& ray, bool early_exit) {
+template <typename Filter>
+intersection_point intersect_scene(const scene* scn, const ym::ray3f& ray,
+    bool early_exit, const Filter& filter) {
     return intersect_bvh(scn->bvh, ray, early_exit,
-        [scn](int eid, const ym::ray3f& ray, bool early_exit) {
-            return intersect_instance(scn->instances[eid], ray, early_exit);
+        [scn, &filter](int eid, const ym::ray3f& ray, bool early_exit) {
+            return intersect_instance(
+                scn->instances[eid], ray, early_exit, filter);
         });
 }
 
+//
+// Scene intersection
+//
+intersection_point intersect_scene(
+    const scene* scn, const ym::ray3f& ray, bool early_exit) {
+    return intersect_scene(scn, ray, early_exit,
+        [](const intersection_point&) { return true; });
+}
+
+//
+// Scene intersection with an any-hit filter
+//
+intersection_point intersect_scene(const scene* scn, const ym::ray3f& ray,
+    bool early_exit, const intersect_filter& filter) {
+    return intersect_scene<intersect_filter>(scn, ray, early_exit, filter);
+}
+
 // -----------------------------------------------------------------------------
 // BVH CLOSEST ELEMENT LOOKUP
 // -----------------------------------------------------------------------------
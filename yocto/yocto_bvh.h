@@ -36,6 +36,7 @@
 ///     - use early_exit=false if you only need to know whether there is a hit
 ///     - for points and lines, a radius is required
 ///     - for triangle and tetrahedra, the radius is ignored
+///     - pass a filter to skip hits, e.g. on transparent surfaces
 /// 6. perform point overlap tests with `overlap_point()` to if a point overlaps
 ///       with an element within a maximum distance
 ///     - use early_exit as above
@@ -51,6 +52,7 @@
 ///
 /// ## History
 ///
+/// - v 0.20: any-hit filter for ray-scene intersection
 /// - v 0.19: switch to matrices for transforms
 /// - v 0.18: faster internal intersection
 /// - v 0.17: removal of SAH build option (better use embree instead)
@@ -350,6 +352,29 @@ struct intersection_point {
 intersection_point intersect_scene(
     const scene* scn, const ym::ray3f& ray, bool early_exit);
 
+///
+/// Any-hit filter called on each candidate hit during traversal, with
+/// instance, shape and element ids set. Return true to accept the hit,
+/// false to ignore it and continue the traversal.
+///
+using intersect_filter = std::function<bool(const intersection_point& pt)>;
+
+///
+/// Intersect the scene with a ray, passing candidate hits to a filter.
+/// Rejected hits do not restart the traversal, so with early_exit the filter
+/// sees every hit along the ray until one is accepted, in no given order.
+///
+/// - Parameters:
+///     - scn: scene to intersect
+///     - ray: ray
+///     - early_exit: whether to stop at the first accepted hit
+///     - filter: any-hit filter
+/// - Returns:
+///     - intersection point
+///
+intersection_point intersect_scene(const scene* scn, const ym::ray3f& ray,
+    bool early_exit, const intersect_filter& filter);
+
 ///
 /// Intersect the scene with a ray. Find any interstion if early_exit, otherwise
 /// find first intersection.
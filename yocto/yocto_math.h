@@ -34,6 +34,7 @@
 ///
 /// ## History
 ///
+/// - v 0.24: alias tables for discrete distributions
 /// - v 0.23: more camera navigation
 /// - v 0.22: removed image lookup with arbitrary channels
 /// - v 0.21: added more functions
@@ -3293,6 +3294,92 @@ inline int sample_index(float r, int size) {
 /// pdf for index with uniform distribution
 inline float sample_index_pdf(int size) { return 1.0f / size; }
 
+///
+/// Builds an alias table for sampling a discrete distribution in constant
+/// time, using Vose's method. Weights do not need to be normalized, and
+/// can be passed in prob to build the table in place.
+///
+/// Parameters:
+/// - num: number of elements
+/// - weights: element weights
+///
+/// Out Parameters:
+/// - prob: probability of keeping each element instead of its alias
+/// - alias: alias of each element
+///
+/// Returns:
+/// - sum of the weights
+///
+inline float make_alias_table(
+    int num, const float* weights, float* prob, int* alias) {
+    auto total = 0.0;
+    for (auto i = 0; i < num; i++) total += weights[i];
+    if (total <= 0) {
+        for (auto i = 0; i < num; i++) prob[i] = 1;
+        for (auto i = 0; i < num; i++) alias[i] = i;
+        return 0;
+    }
+    auto small = std::vector<int>(), large = std::vector<int>();
+    for (auto i = 0; i < num; i++) {
+        prob[i] = (float)(weights[i] * num / total);
+        if (prob[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back(), l = large.back();
+        small.pop_back();
+        large.pop_back();
+        alias[s] = l;
+        prob[l] = (prob[l] + prob[s]) - 1;
+        if (prob[l] < 1)
+            small.push_back(l);
+        else
+            large.push_back(l);
+    }
+    // leftovers are one up to numerical precision
+    for (auto l : large) {
+        prob[l] = 1;
+        alias[l] = l;
+    }
+    for (auto s : small) {
+        prob[s] = 1;
+        alias[s] = s;
+    }
+    return (float)total;
+}
+
+///
+/// Builds an alias table for sampling a discrete distribution.
+/// Wrapper to the above function.
+///
+inline float make_alias_table(const std::vector<float>& weights,
+    std::vector<float>& prob, std::vector<int>& alias) {
+    prob.resize(weights.size());
+    alias.resize(weights.size());
+    return make_alias_table(
+        (int)weights.size(), weights.data(), prob.data(), alias.data());
+}
+
+///
+/// Pick an element from an alias table.
+///
+inline int sample_alias_table(
+    int num, const float* prob, const int* alias, float r) {
+    auto x = r * num;
+    auto i = clamp((int)x, 0, num - 1);
+    return (x - i < prob[i]) ? i : alias[i];
+}
+
+///
+/// Pick an element from an alias table.
+///
+inline int sample_alias_table(
+    const std::vector<float>& prob, const std::vector<int>& alias, float r) {
+    return sample_alias_table((int)prob.size(), prob.data(), alias.data(), r);
+}
+
 // -----------------------------------------------------------------------------
 // HASHING
 // -----------------------------------------------------------------------------
@@ -3936,6 +4023,47 @@ inline std::pair<int, vec3f> sample_triangles(
     return sample_triangles((int)cdf.size(), cdf.data(), re, ruv);
 }
 
+///
+/// Compute an alias table for sampling lines uniformly. Returns the total
+/// length.
+///
+inline float sample_lines_alias(int nlines, const vec2i* lines,
+    const vec3f* pos, float* prob, int* alias) {
+    for (auto i = 0; i < nlines; i++)
+        prob[i] = length(pos[lines[i].x] - pos[lines[i].y]);
+    return make_alias_table(nlines, prob, prob, alias);
+}
+
+///
+/// Pick a point on lines from an alias table
+///
+inline std::pair<int, vec2f> sample_lines(
+    int nlines, const float* prob, const int* alias, float re, float ruv) {
+    return {sample_alias_table(nlines, prob, alias, re), {1 - ruv, ruv}};
+}
+
+///
+/// Compute an alias table for sampling triangle meshes uniformly. Returns
+/// the total area.
+///
+inline float sample_triangles_alias(int ntriangles, const vec3i* triangles,
+    const vec3f* pos, float* prob, int* alias) {
+    for (auto i = 0; i < ntriangles; i++)
+        prob[i] = triangle_area(
+            pos[triangles[i].x], pos[triangles[i].y], pos[triangles[i].z]);
+    return make_alias_table(ntriangles, prob, prob, alias);
+}
+
+///
+/// Pick a point on a triangle mesh from an alias table
+///
+inline std::pair<int, vec3f> sample_triangles(int ntriangles,
+    const float* prob, const int* alias, float re, const vec2f& ruv) {
+    auto eid = sample_alias_table(ntriangles, prob, alias, re);
+    return {
+        eid, {sqrt(ruv.x) * (1 - ruv.y), 1 - sqrt(ruv.x), ruv.y * sqrt(ruv.x)}};
+}
+
 ///
 /// Samples a set of points over a triangle mesh uniformly. The rng function
 /// takes the point index and returns vec3f numbers uniform directibuted in
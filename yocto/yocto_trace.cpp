@@ -34,13 +34,19 @@
 
 #include "yocto_utils.h"
 
+#include <atomic>
+#include <chrono>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 //
 // BUG: gltf normalization
 // BUG: check recursive pathtraced environment map
 // BUG: check __sample_brdf at if (rnl >= wd && rnl < wd + ws) {
-// TODO: add envmap sampling and maybe use discreet ditributions
 // TODO: check fresnel
 //
 
@@ -71,13 +77,150 @@ struct camera {
 };
 
 //
-// Texture
+// Texture level stored in 4x4 tiles, with texels in Morton order within each
+// tile, so that the four texels of a bilinear lookup mostly share a tile.
+// Rows and columns are padded to whole tiles.
+//
+template <typename T>
+struct tiled_image {
+    int width = 0;          // width
+    int height = 0;         // height
+    int ntiles = 0;         // number of tiles along x
+    std::vector<T> pixels;  // pixels, tile after tile
+
+    // constructors
+    tiled_image() {}
+    tiled_image(int w, int h)
+        : width{w}
+        , height{h}
+        , ntiles{(w + 3) / 4}
+        , pixels((size_t)ntiles * ((h + 3) / 4) * 16) {}
+
+    // element access
+    T& operator[](const ym::vec2i& ij) { return pixels[index(ij)]; }
+    const T& operator[](const ym::vec2i& ij) const {
+        return pixels[index(ij)];
+    }
+
+    // index of a texel, interleaving the two low bits of x and y
+    size_t index(const ym::vec2i& ij) const {
+        auto x = ij.x & 3, y = ij.y & 3;
+        auto tile = (size_t)(ij.y >> 2) * ntiles + (ij.x >> 2);
+        return tile * 16 +
+               ((x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2));
+    }
+};
+
+//
+// Texture level compressed in blocks, one for each 4x4 tile, as one or two
+// 64-bit words per block. Texels are in scanline order within a block.
+//
+struct block_image {
+    int width = 0;                 // width
+    int height = 0;                // height
+    int ntiles = 0;                // number of tiles along x
+    int nwords = 1;                // words per block
+    std::vector<uint64_t> blocks;  // blocks
+
+    // constructors
+    block_image() {}
+    block_image(int w, int h, int nw)
+        : width{w}
+        , height{h}
+        , ntiles{(w + 3) / 4}
+        , nwords{nw}
+        , blocks((size_t)ntiles * ((h + 3) / 4) * nw) {}
+
+    // first word of the block of a texel
+    const uint64_t* block(const ym::vec2i& ij) const {
+        return blocks.data() +
+               ((size_t)(ij.y >> 2) * ntiles + (ij.x >> 2)) * nwords;
+    }
+};
+
+//
+// Storage of ldr texture levels. Gray textures keep one channel. The block
+// compressed formats follow BC1 for opaque color, BC4 for gray and BC3 for
+// color with alpha.
+//
+enum struct ldr_format { rgba, gray, bc1, bc3, bc4 };
+
+//
+// Size of the square pages in which tiled texture files are stored and read.
+// Each page is a tiled image, padded with zeros at the level borders.
+//
+const int texture_page_size = 64;
+
+//
+// Texture page. Only the image of the file format is set.
+//
+struct texture_page {
+    tiled_image<ym::vec4f> hdr;  // hdr pixels
+    tiled_image<ym::vec4b> ldr;  // ldr pixels
+    size_t bytes = 0;            // size of the pixels in bytes
+};
+
+//
+// Cache of the pages of paged textures, shared by the textures of a scene.
+// Pages are kept in least recently used order and the oldest are evicted
+// when over budget. Lookups go through per-thread caches first.
+//
+struct texture_cache {
+    using page_ptr = std::shared_ptr<const texture_page>;
+    using lru_list = std::list<uint64_t>;
+
+    size_t budget = (size_t)256 << 20;  // memory budget in bytes
+    size_t bytes = 0;                   // memory used by the pages
+    lru_list lru;                       // page keys, most recent first
+    std::unordered_map<uint64_t, std::pair<page_ptr, lru_list::iterator>>
+        pages;         // pages by key
+    std::mutex mutex;  // guards the members above
+};
+
+//
+// Tiled texture file, read on demand. The pages of all levels are stored
+// one after the other, row by row, after the header.
+//
+struct texture_file {
+    FILE* file = nullptr;            // open file
+    std::mutex mutex;                // serializes reads
+    uint64_t id = 0;                 // unique id, in the page keys
+    bool ldr = false;                // whether pixels are ldr
+    bool srgb = false;               // whether ldr pixels are sRGB colors
+    std::vector<ym::vec2i> sizes;    // size of each level
+    std::vector<ym::vec2i> npages;   // pages of each level
+    std::vector<uint64_t> offsets;   // file offset of each level
+    texture_cache* cache = nullptr;  // scene page cache
+
+    // destructor
+    ~texture_file() {
+        if (file) fclose(file);
+    }
+};
+
+//
+// Texture. Pixels are copied in a tiled layout at each mip level, with the
+// full resolution image at level 0. Paged textures keep no pixels and read
+// them from a tiled file instead.
 //
 struct texture {
-    int width = 0;                   // width
-    int height = 0;                  // height
-    const ym::vec4f* hdr = nullptr;  // hdr pixel values;
-    const ym::vec4b* ldr = nullptr;  // ldr pixel values
+    int width = 0;   // width
+    int height = 0;  // height
+
+    std::vector<tiled_image<ym::vec4f>> hdr;  // hdr pixel values per level
+    std::vector<tiled_image<ym::vec4b>> ldr;  // ldr pixel values per level
+
+    ldr_format format = ldr_format::rgba;    // storage of ldr levels
+    bool srgb = true;                        // whether ldr pixels are sRGB
+    std::vector<tiled_image<uint8_t>> gray;  // gray pixel values per level
+    std::vector<block_image> blocks;         // compressed levels
+
+    texture_file* file = nullptr;  // tiled file for paged textures
+
+    // destructor
+    ~texture() {
+        if (file) delete file;
+    }
 };
 
 //
@@ -180,18 +323,19 @@ struct material {
     // conservative test for opacity
     bool is_opaque() const {
         switch (rtype) {
-            case reflectance_type::none: return false;
-            case reflectance_type::matte: return matte.op != 1 || matte.op_txt;
+            case reflectance_type::none: return true;
+            case reflectance_type::matte: return matte.op == 1 && !matte.op_txt;
             case reflectance_type::microfacet:
-                return microfacet.op != 1 || microfacet.op_txt ||
-                       microfacet.kt != ym::zero3f || microfacet.kt_txt;
+                return microfacet.op == 1 && !microfacet.op_txt &&
+                       microfacet.kt == ym::zero3f && !microfacet.kt_txt;
             case reflectance_type::gltf_metallic_roughness:
-                return metalrough.op != 1 || metalrough.kb_txt;
+                return metalrough.op == 1 && !metalrough.kb_txt;
             case reflectance_type::gltf_specular_glossiness:
-                return specgloss.op != 1 || specgloss.kd_txt;
+                return specgloss.op == 1 && !specgloss.kd_txt;
             case reflectance_type::thin_glass:
-                return microfacet.kt != ym::zero3f || microfacet.kt_txt;
+                return thin_glass.kt == ym::zero3f && !thin_glass.kt_txt;
         }
+        return true;
     }
 };
 
@@ -215,8 +359,9 @@ struct shape {
     const ym::vec4f* tangsp = nullptr;    // vertex data
 
     // sampling data
-    std::vector<float> cdf;  // for shape, cdf of shape elements for sampling
-    float area = 0;          // for shape, shape area
+    std::vector<float> prob;  // for shape, alias table of elements for sampling
+    std::vector<int> alias;   // for shape, alias table of elements for sampling
+    float area = 0;           // for shape, shape area
 };
 
 //
@@ -226,6 +371,9 @@ struct instance {
     ym::frame3f frame = ym::identity_frame3f;  // local-to-world rigid transform
     material* mat = nullptr;                   // material
     shape* shp = nullptr;                      // shape
+
+    // sampling data
+    int light_node = -1;  // leaf of the light tree, if emissive
 };
 
 //
@@ -235,6 +383,11 @@ struct environment {
     ym::frame3f frame = ym::identity_frame3f;  // local-to-world rigid transform
     ym::vec3f ke = ym::zero3f;                 // emission
     texture* ke_txt = nullptr;                 // emission texture
+
+    // sampling data
+    std::vector<float> pdf;   // for env textures, probability of each texel
+    std::vector<float> prob;  // for env textures, alias table of texels
+    std::vector<int> alias;   // for env textures, alias table of texels
 };
 
 //
@@ -246,6 +399,32 @@ struct light {
     environment* env = nullptr;  // environment
 };
 
+//
+// Bounds used to estimate the contribution of a set of shape lights:
+// world bounding box, cone of emitting normals and total power. Emitters
+// are diffuse, so they emit only within 90 degrees from the normals.
+// This is only used internally.
+//
+struct light_bounds {
+    ym::bbox3f bbox = ym::invalid_bbox3f;  // world bounds
+    ym::vec3f axis = ym::zero3f;           // normals cone axis
+    float cos_theta_o = -1;                // normals cone spread (cosine)
+    float power = 0;                       // estimated emitted power
+};
+
+//
+// Node of the light tree. Leaves hold one shape light each. Environments are
+// not part of the tree, since they are not bounded.
+// This is only used internally.
+//
+struct light_node {
+    light_bounds bounds;  // bounds of all lights in the subtree
+    int left = -1;        // left child [internal nodes]
+    int right = -1;       // right child [internal nodes]
+    int parent = -1;      // parent node
+    int lid = -1;         // light index [leaf nodes]
+};
+
 //
 // Scene
 //
@@ -265,6 +444,9 @@ struct scene {
     std::vector<material*> materials;        // materials
     std::vector<texture*> textures;          // textures
 
+    // pages of paged textures
+    texture_cache texture_pages;
+
     // default material
     material* default_material = nullptr;
 
@@ -294,8 +476,13 @@ struct scene {
     }
 
     // [private] light sources
-    std::vector<light*> lights;        // lights [private]
-    bool shadow_transmission = false;  // wheter to test transmission
+    std::vector<light*> lights;          // lights [private]
+    std::vector<light*> env_lights;      // environment lights [private]
+    std::vector<light_node> light_tree;  // shape lights selection [private]
+    bool shadow_transmission = false;    // wheter to test transmission
+
+    // [private] incremented when geometry changes, to invalidate cached hits
+    unsigned geometry_version = 0;
 };
 
 //
@@ -339,6 +526,399 @@ int add_camera(scene* scn, const ym::frame3f& frame, float yfov, float aspect,
     return (int)scn->cameras.size() - 1;
 }
 
+//
+// Tables converting bytes to floats, with and without sRGB decoding. They
+// replace a pow per channel in ldr texture lookups.
+//
+struct byte_tables {
+    float srgb[256];    // srgb to linear
+    float linear[256];  // linear
+};
+
+//
+// Tables above, initialized on first use.
+//
+static const byte_tables& get_byte_tables() {
+    static const auto tables = []() {
+        auto tables = byte_tables();
+        for (auto i = 0; i < 256; i++) {
+            tables.linear[i] = ym::byte_to_float((ym::byte)i);
+            tables.srgb[i] = std::pow(tables.linear[i], 2.2f);
+        }
+        return tables;
+    }();
+    return tables;
+}
+
+//
+// Decodes an ldr texel with a table for the color. Alpha is always linear.
+//
+static inline ym::vec4f decode_texel(
+    const ym::vec4b& v, const float* lut, const float* alpha_lut) {
+    return {lut[v.x], lut[v.y], lut[v.z], alpha_lut[v.w]};
+}
+
+//
+// Copies pixels in scanline order to a tiled image.
+//
+template <typename T>
+static tiled_image<T> make_tiled_image(int width, int height, const T* pixels) {
+    auto img = tiled_image<T>(width, height);
+    for (auto j = 0; j < height; j++)
+        for (auto i = 0; i < width; i++) img[{i, j}] = pixels[j * width + i];
+    return img;
+}
+
+//
+// Copies the texture pixels and builds the mipmap chain, halving the size at
+// each level. Each texel is the box-filtered average of the texels it covers
+// in the previous level, with fractional weights for odd sizes. Ldr levels
+// of sRGB textures are averaged in linear space, and those of data textures,
+// like normal maps, as stored.
+//
+static void init_texture_levels(
+    texture* txt, const ym::vec4f* hdr, const ym::vec4b* ldr, bool srgb) {
+    txt->hdr.clear();
+    txt->ldr.clear();
+    txt->format = ldr_format::rgba;
+    txt->srgb = srgb;
+    txt->gray.clear();
+    txt->blocks.clear();
+    if (txt->file) delete txt->file;
+    txt->file = nullptr;
+    if (ldr) {
+        txt->ldr.push_back(make_tiled_image(txt->width, txt->height, ldr));
+    } else {
+        txt->hdr.push_back(make_tiled_image(txt->width, txt->height, hdr));
+    }
+    auto& tables = get_byte_tables();
+    auto lut = (srgb) ? tables.srgb : tables.linear;
+    auto prev = ym::image4f();
+    auto wh = ym::vec2i{txt->width, txt->height};
+    auto lookup = [txt, hdr, ldr, lut, &tables, &prev](const ym::vec2i& ij) {
+        if (!prev.empty()) return prev[ij];
+        auto idx = ij.y * txt->width + ij.x;
+        if (ldr) return decode_texel(ldr[idx], lut, tables.linear);
+        return hdr[idx];
+    };
+    while (wh.x > 1 || wh.y > 1) {
+        auto nwh = ym::vec2i{std::max(1, wh.x / 2), std::max(1, wh.y / 2)};
+        auto scale = ym::vec2f{(float)wh.x / nwh.x, (float)wh.y / nwh.y};
+        auto mip = ym::image4f(nwh.x, nwh.y);
+        for (auto j = 0; j < nwh.y; j++) {
+            for (auto i = 0; i < nwh.x; i++) {
+                auto x0 = i * scale.x, x1 = (i + 1) * scale.x;
+                auto y0 = j * scale.y, y1 = (j + 1) * scale.y;
+                auto c = ym::zero4f;
+                for (auto y = (int)y0; y < std::min((int)std::ceil(y1), wh.y);
+                     y++) {
+                    auto wy = std::min(y1, y + 1.0f) - std::max(y0, (float)y);
+                    for (auto x = (int)x0;
+                         x < std::min((int)std::ceil(x1), wh.x); x++) {
+                        auto wx =
+                            std::min(x1, x + 1.0f) - std::max(x0, (float)x);
+                        c += lookup({x, y}) * (wx * wy);
+                    }
+                }
+                mip[{i, j}] = c / (scale.x * scale.y);
+            }
+        }
+        if (ldr) {
+            auto lmip = ym::image4b(nwh.x, nwh.y);
+            auto g = (srgb) ? 1 / 2.2f : 1.0f;
+            for (auto j = 0; j < nwh.y; j++)
+                for (auto i = 0; i < nwh.x; i++)
+                    lmip[{i, j}] = ym::float_to_byte(
+                        ym::vec4f{std::pow(mip[{i, j}].x, g),
+                            std::pow(mip[{i, j}].y, g),
+                            std::pow(mip[{i, j}].z, g), mip[{i, j}].w});
+            txt->ldr.push_back(make_tiled_image(nwh.x, nwh.y, lmip.data()));
+        } else {
+            txt->hdr.push_back(make_tiled_image(nwh.x, nwh.y, mip.data()));
+        }
+        prev = mip;
+        wh = nwh;
+    }
+}
+
+//
+// Expands a 5:6:5 color to bytes.
+//
+static inline ym::vec3i unpack_565(uint64_t c) {
+    auto r = (int)(c >> 11) & 31, g = (int)(c >> 5) & 63, b = (int)c & 31;
+    return {(r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2)};
+}
+
+//
+// Decodes texel i of a BC1 block, with two 5:6:5 endpoints in the low 32
+// bits followed by 2-bit indices. Only the four color mode is used.
+//
+static inline ym::vec4b decode_bc1(uint64_t blk, int i, ym::byte alpha) {
+    auto c0 = unpack_565(blk), c1 = unpack_565(blk >> 16);
+    auto idx = (int)(blk >> (32 + 2 * i)) & 3;
+    auto w0 = (idx == 0) ? 3 : (idx == 1) ? 0 : (idx == 2) ? 2 : 1;
+    return {(ym::byte)((c0.x * w0 + c1.x * (3 - w0) + 1) / 3),
+        (ym::byte)((c0.y * w0 + c1.y * (3 - w0) + 1) / 3),
+        (ym::byte)((c0.z * w0 + c1.z * (3 - w0) + 1) / 3), alpha};
+}
+
+//
+// Decodes texel i of a BC4 block, with two 8-bit endpoints in the low 16
+// bits followed by 3-bit indices. Only the eight value mode is used.
+//
+static inline ym::byte decode_bc4(uint64_t blk, int i) {
+    auto a0 = (int)blk & 255, a1 = (int)(blk >> 8) & 255;
+    auto idx = (int)(blk >> (16 + 3 * i)) & 7;
+    if (idx < 2) return (ym::byte)((idx) ? a1 : a0);
+    return (ym::byte)((a0 * (8 - idx) + a1 * (idx - 1) + 3) / 7);
+}
+
+//
+// Encodes 16 values in a BC4 block, with the range as endpoints and the
+// nearest value for each texel.
+//
+static uint64_t encode_bc4(const ym::byte* values) {
+    auto a0 = 0, a1 = 255;
+    for (auto i = 0; i < 16; i++) {
+        a0 = std::max(a0, (int)values[i]);
+        a1 = std::min(a1, (int)values[i]);
+    }
+    auto blk = (uint64_t)a0 | ((uint64_t)a1 << 8);
+    if (a0 == a1) return blk;
+    int palette[8];
+    for (auto idx = 0; idx < 8; idx++)
+        palette[idx] = decode_bc4(blk | ((uint64_t)idx << 16), 0);
+    for (auto i = 0; i < 16; i++) {
+        auto best = (uint64_t)0;
+        auto best_err = 256;
+        for (auto idx = (uint64_t)0; idx < 8; idx++) {
+            auto err = std::abs(palette[idx] - (int)values[i]);
+            if (err < best_err) {
+                best = idx;
+                best_err = err;
+            }
+        }
+        blk |= best << (16 + 3 * i);
+    }
+    return blk;
+}
+
+//
+// Packs a color in 5:6:5, rounding to the nearest value.
+//
+static inline uint64_t pack_565(const ym::vec3f& c) {
+    auto q = [](float v, int n) {
+        return (uint64_t)ym::clamp((int)(v * n / 255 + 0.5f), 0, n);
+    };
+    return (q(c.x, 31) << 11) | (q(c.y, 63) << 5) | q(c.z, 31);
+}
+
+//
+// Makes a BC1 block from two packed endpoints, taking for each texel the
+// nearest of the four interpolated colors. Returns the squared error.
+//
+static int assign_bc1(uint64_t c0, uint64_t c1, const ym::vec4b* texels,
+    uint64_t& blk) {
+    if (c0 < c1) std::swap(c0, c1);
+    blk = c0 | (c1 << 16);
+    if (c0 == c1) {
+        auto c = decode_bc1(blk, 0, 255);
+        auto err = 0;
+        for (auto i = 0; i < 16; i++)
+            for (auto k = 0; k < 3; k++)
+                err += (c[k] - texels[i][k]) * (c[k] - texels[i][k]);
+        return err;
+    }
+    ym::vec4b palette[4];
+    for (auto idx = (uint64_t)0; idx < 4; idx++)
+        palette[idx] = decode_bc1(blk | (idx << 32), 0, 255);
+    auto total = 0;
+    for (auto i = 0; i < 16; i++) {
+        auto best = (uint64_t)0;
+        auto best_err = INT32_MAX;
+        for (auto idx = (uint64_t)0; idx < 4; idx++) {
+            auto err = 0;
+            for (auto k = 0; k < 3; k++)
+                err += (palette[idx][k] - texels[i][k]) *
+                       (palette[idx][k] - texels[i][k]);
+            if (err < best_err) {
+                best = idx;
+                best_err = err;
+            }
+        }
+        blk |= best << (32 + 2 * i);
+        total += best_err;
+    }
+    return total;
+}
+
+//
+// Pairs of 5-bit and 6-bit endpoints whose 2/3 interpolation best matches
+// each byte value, to encode blocks of a single color more precisely than
+// by rounding to 5:6:5.
+//
+struct bc1_single_color_tables {
+    ym::vec2i pair5[256];  // 5-bit endpoints
+    ym::vec2i pair6[256];  // 6-bit endpoints
+
+    bc1_single_color_tables() {
+        auto fill = [](ym::vec2i* pairs, int bits) {
+            auto n = 1 << bits;
+            for (auto v = 0; v < 256; v++) {
+                auto best_err = 256;
+                for (auto e0 = 0; e0 < n; e0++) {
+                    for (auto e1 = 0; e1 < n; e1++) {
+                        auto x0 = (e0 << (8 - bits)) | (e0 >> (2 * bits - 8));
+                        auto x1 = (e1 << (8 - bits)) | (e1 >> (2 * bits - 8));
+                        auto err = std::abs((x0 * 2 + x1 + 1) / 3 - v);
+                        if (err < best_err) {
+                            pairs[v] = {e0, e1};
+                            best_err = err;
+                        }
+                    }
+                }
+            }
+        };
+        fill(pair5, 5);
+        fill(pair6, 6);
+    }
+};
+
+//
+// Encodes 16 colors in a BC1 block. Endpoints start at the extreme colors
+// along the principal axis of the block, found by power iteration, and are
+// then refit by least squares to the chosen interpolation weights.
+//
+static uint64_t encode_bc1(const ym::vec4b* texels) {
+    auto color = [texels](int i) {
+        return ym::vec3f{
+            (float)texels[i].x, (float)texels[i].y, (float)texels[i].z};
+    };
+
+    // single color
+    auto single = true;
+    for (auto i = 1; i < 16; i++)
+        single = single && texels[i].x == texels[0].x &&
+                 texels[i].y == texels[0].y && texels[i].z == texels[0].z;
+    if (single) {
+        static const auto tables = bc1_single_color_tables();
+        auto r = tables.pair5[texels[0].x], g = tables.pair6[texels[0].y],
+             b = tables.pair5[texels[0].z];
+        auto blk = (uint64_t)0;
+        assign_bc1((uint64_t)((r.x << 11) | (g.x << 5) | b.x),
+            (uint64_t)((r.y << 11) | (g.y << 5) | b.y), texels, blk);
+        return blk;
+    }
+
+    auto mean = ym::zero3f;
+    for (auto i = 0; i < 16; i++) mean += color(i) / 16.0f;
+    auto cov = ym::mat3f{ym::zero3f, ym::zero3f, ym::zero3f};
+    for (auto i = 0; i < 16; i++) {
+        auto d = color(i) - mean;
+        cov.x += d * d.x;
+        cov.y += d * d.y;
+        cov.z += d * d.z;
+    }
+    auto axis = ym::vec3f{1, 1, 1};
+    for (auto k = 0; k < 4; k++) {
+        axis = cov * axis;
+        auto len = ym::length(axis);
+        axis = (len > 0) ? axis / len : ym::vec3f{1, 1, 1};
+    }
+    auto imin = 0, imax = 0;
+    auto pmin = FLT_MAX, pmax = -FLT_MAX;
+    for (auto i = 0; i < 16; i++) {
+        auto p = ym::dot(color(i), axis);
+        if (p < pmin) pmin = p, imin = i;
+        if (p > pmax) pmax = p, imax = i;
+    }
+    auto blk = (uint64_t)0;
+    auto err = assign_bc1(
+        pack_565(color(imax)), pack_565(color(imin)), texels, blk);
+
+    // refit endpoints to the weights of the chosen colors
+    const float weights[4] = {1, 0, 2 / 3.0f, 1 / 3.0f};
+    auto a00 = 0.0f, a01 = 0.0f, a11 = 0.0f;
+    auto b0 = ym::zero3f, b1 = ym::zero3f;
+    for (auto i = 0; i < 16; i++) {
+        auto w = weights[(blk >> (32 + 2 * i)) & 3];
+        a00 += w * w;
+        a01 += w * (1 - w);
+        a11 += (1 - w) * (1 - w);
+        b0 += color(i) * w;
+        b1 += color(i) * (1 - w);
+    }
+    auto det = a00 * a11 - a01 * a01;
+    if (det <= 0) return blk;
+    auto refit = (uint64_t)0;
+    auto refit_err = assign_bc1(pack_565((b0 * a11 - b1 * a01) / det),
+        pack_565((b1 * a00 - b0 * a01) / det), texels, refit);
+    return (refit_err < err) ? refit : blk;
+}
+
+//
+// Stores the ldr levels of a texture more compactly. Gray opaque textures
+// keep a single channel; with compression, levels are block compressed
+// instead, with BC4 for gray, BC1 for opaque color and BC3 otherwise.
+// Blocks at the borders repeat the edge texels.
+//
+static void pack_texture_levels(texture* txt, bool compress) {
+    if (txt->ldr.empty()) return;
+    auto gray = true, opaque = true;
+    for (auto& img : txt->ldr) {
+        for (auto j = 0; j < img.height; j++) {
+            for (auto i = 0; i < img.width; i++) {
+                auto v = img[{i, j}];
+                gray = gray && v.x == v.y && v.x == v.z;
+                opaque = opaque && v.w == 255;
+            }
+        }
+    }
+    if (!compress && !(gray && opaque)) return;
+    if (!compress) {
+        txt->format = ldr_format::gray;
+        for (auto& img : txt->ldr) {
+            auto gimg = tiled_image<uint8_t>(img.width, img.height);
+            for (auto k = (size_t)0; k < img.pixels.size(); k++)
+                gimg.pixels[k] = img.pixels[k].x;
+            txt->gray.push_back(std::move(gimg));
+        }
+    } else {
+        txt->format = (gray && opaque) ?
+                          ldr_format::bc4 :
+                          (opaque) ? ldr_format::bc1 : ldr_format::bc3;
+        for (auto& img : txt->ldr) {
+            auto bimg = block_image(img.width, img.height,
+                (txt->format == ldr_format::bc3) ? 2 : 1);
+            for (auto tj = 0; tj < (img.height + 3) / 4; tj++) {
+                for (auto ti = 0; ti < bimg.ntiles; ti++) {
+                    ym::vec4b texels[16];
+                    ym::byte values[16];
+                    for (auto k = 0; k < 16; k++) {
+                        texels[k] =
+                            img[{std::min(ti * 4 + k % 4, img.width - 1),
+                                std::min(tj * 4 + k / 4, img.height - 1)}];
+                        values[k] = (txt->format == ldr_format::bc4) ?
+                                        texels[k].x :
+                                        texels[k].w;
+                    }
+                    auto blk = bimg.blocks.data() +
+                               ((size_t)tj * bimg.ntiles + ti) * bimg.nwords;
+                    if (txt->format == ldr_format::bc4) {
+                        blk[0] = encode_bc4(values);
+                    } else {
+                        blk[0] = encode_bc1(texels);
+                        if (bimg.nwords > 1) blk[1] = encode_bc4(values);
+                    }
+                }
+            }
+            txt->blocks.push_back(std::move(bimg));
+        }
+    }
+    txt->ldr.clear();
+    txt->ldr.shrink_to_fit();
+}
+
 //
 // Public API. See above.
 //
@@ -346,19 +926,18 @@ void set_texture(
     scene* scn, int tid, int width, int height, const ym::vec4f* hdr) {
     scn->textures[tid]->width = width;
     scn->textures[tid]->height = height;
-    scn->textures[tid]->hdr = hdr;
-    scn->textures[tid]->ldr = nullptr;
+    init_texture_levels(scn->textures[tid], hdr, nullptr, false);
 }
 
 //
 // Public API. See above.
 //
-void set_texture(
-    scene* scn, int tid, int width, int height, const ym::vec4b* ldr) {
+void set_texture(scene* scn, int tid, int width, int height,
+    const ym::vec4b* ldr, bool compress, bool srgb) {
     scn->textures[tid]->width = width;
     scn->textures[tid]->height = height;
-    scn->textures[tid]->hdr = nullptr;
-    scn->textures[tid]->ldr = ldr;
+    init_texture_levels(scn->textures[tid], nullptr, ldr, srgb);
+    pack_texture_levels(scn->textures[tid], compress);
 }
 
 //
@@ -373,12 +952,169 @@ int add_texture(scene* scn, int width, int height, const ym::vec4f* hdr) {
 //
 // Public API. See above.
 //
-int add_texture(scene* scn, int width, int height, const ym::vec4b* ldr) {
+int add_texture(scene* scn, int width, int height, const ym::vec4b* ldr,
+    bool compress, bool srgb) {
     scn->textures.push_back(new texture());
-    set_texture(scn, (int)scn->textures.size() - 1, width, height, ldr);
+    set_texture(scn, (int)scn->textures.size() - 1, width, height, ldr,
+        compress, srgb);
+    return (int)scn->textures.size() - 1;
+}
+
+//
+// Tiled texture file header.
+//
+static const char texture_file_magic[8] = {'y', 't', 'r', 'a', 'c', 'e', 't',
+    'x'};
+static const int texture_file_version = 1;
+
+//
+// Writes the levels of a texture as pages to a tiled file.
+//
+template <typename T>
+static bool write_texture_pages(
+    FILE* f, const std::vector<tiled_image<T>>& levels) {
+    auto ps = texture_page_size;
+    auto page = tiled_image<T>(ps, ps);
+    for (auto& img : levels) {
+        for (auto pj = 0; pj < (img.height + ps - 1) / ps; pj++) {
+            for (auto pi = 0; pi < (img.width + ps - 1) / ps; pi++) {
+                for (auto j = 0; j < ps; j++) {
+                    for (auto i = 0; i < ps; i++) {
+                        auto ij = ym::vec2i{pi * ps + i, pj * ps + j};
+                        page[{i, j}] = (ij.x < img.width && ij.y < img.height) ?
+                                           img[ij] :
+                                           T{};
+                    }
+                }
+                if (fwrite(page.pixels.data(), sizeof(T), page.pixels.size(),
+                        f) != page.pixels.size())
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+//
+// Builds the mipmaps of a texture and saves them in a tiled file. The file
+// is written under a temporary name and then renamed. The last header value
+// marks ldr data textures, whose mipmaps are not averaged as sRGB.
+//
+static bool save_tiled_texture(const std::string& filename, int width,
+    int height, const ym::vec4f* hdr, const ym::vec4b* ldr, bool srgb) {
+    auto txt = texture();
+    txt.width = width;
+    txt.height = height;
+    init_texture_levels(&txt, hdr, ldr, srgb);
+    auto sizes = std::vector<ym::vec2i>();
+    for (auto& img : txt.hdr) sizes.push_back({img.width, img.height});
+    for (auto& img : txt.ldr) sizes.push_back({img.width, img.height});
+    int header[5] = {texture_file_version, (ldr) ? 1 : 0, texture_page_size,
+        (int)sizes.size(), (ldr && !srgb) ? 1 : 0};
+    auto tmpname = filename + ".tmp";
+    auto f = fopen(tmpname.c_str(), "wb");
+    if (!f) return false;
+    auto ok = fwrite(texture_file_magic, 1, 8, f) == 8 &&
+              fwrite(header, sizeof(int), 5, f) == 5 &&
+              fwrite(sizes.data(), sizeof(ym::vec2i), sizes.size(), f) ==
+                  sizes.size();
+    if (ok) ok = (ldr) ? write_texture_pages(f, txt.ldr) :
+                         write_texture_pages(f, txt.hdr);
+    ok = !fclose(f) && ok;
+#ifdef _WIN32
+    if (ok) remove(filename.c_str());
+#endif
+    if (ok) ok = !rename(tmpname.c_str(), filename.c_str());
+    if (!ok) remove(tmpname.c_str());
+    return ok;
+}
+
+//
+// Public API. See above.
+//
+bool save_tiled_texture(const std::string& filename, int width, int height,
+    const ym::vec4f* hdr) {
+    return save_tiled_texture(filename, width, height, hdr, nullptr, false);
+}
+
+//
+// Public API. See above.
+//
+bool save_tiled_texture(const std::string& filename, int width, int height,
+    const ym::vec4b* ldr, bool srgb) {
+    return save_tiled_texture(filename, width, height, nullptr, ldr, srgb);
+}
+
+//
+// Opens a tiled texture file and reads its header.
+//
+static texture_file* open_tiled_texture(const std::string& filename) {
+    static std::atomic<uint64_t> next_id{1};
+    auto f = fopen(filename.c_str(), "rb");
+    if (!f) return nullptr;
+    auto tf = new texture_file();
+    tf->file = f;
+    char magic[8];
+    int header[5];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, texture_file_magic, 8) ||
+        fread(header, sizeof(int), 5, f) != 5 ||
+        header[0] != texture_file_version ||
+        header[2] != texture_page_size || header[3] < 1 || header[3] > 32) {
+        delete tf;
+        return nullptr;
+    }
+    tf->ldr = header[1];
+    tf->srgb = tf->ldr && !header[4];
+    tf->sizes.resize(header[3]);
+    if (fread(tf->sizes.data(), sizeof(ym::vec2i), tf->sizes.size(), f) !=
+        tf->sizes.size()) {
+        delete tf;
+        return nullptr;
+    }
+    auto ps = texture_page_size;
+    auto page_bytes =
+        (uint64_t)ps * ps * ((tf->ldr) ? sizeof(ym::vec4b) : sizeof(ym::vec4f));
+    auto offset = (uint64_t)(8 + sizeof(header) +
+                             tf->sizes.size() * sizeof(ym::vec2i));
+    for (auto wh : tf->sizes) {
+        if (wh.x < 1 || wh.y < 1) {
+            delete tf;
+            return nullptr;
+        }
+        auto np = ym::vec2i{(wh.x + ps - 1) / ps, (wh.y + ps - 1) / ps};
+        tf->npages.push_back(np);
+        tf->offsets.push_back(offset);
+        offset += (uint64_t)np.x * np.y * page_bytes;
+    }
+    tf->id = next_id++;
+    return tf;
+}
+
+//
+// Public API. See above.
+//
+int add_tiled_texture(scene* scn, const std::string& filename) {
+    auto tf = open_tiled_texture(filename);
+    if (!tf) return -1;
+    tf->cache = &scn->texture_pages;
+    auto txt = new texture();
+    txt->width = tf->sizes[0].x;
+    txt->height = tf->sizes[0].y;
+    txt->srgb = tf->srgb;
+    txt->file = tf;
+    scn->textures.push_back(txt);
     return (int)scn->textures.size() - 1;
 }
 
+//
+// Public API. See above.
+//
+void set_texture_cache_memory(scene* scn, int megabytes) {
+    auto cache = &scn->texture_pages;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->budget = (size_t)std::max(megabytes, 1) << 20;
+}
+
 //
 // Public API. See above.
 //
@@ -434,7 +1170,7 @@ void set_material_microfacet(scene* scn, int mid, const ym::vec3f& kd,
     scn->materials[mid]->microfacet.rs_txt =
         (rs_txt >= 0) ? scn->textures[rs_txt] : nullptr;
     scn->materials[mid]->microfacet.op_txt =
-        (op_txt >= 0) ? scn->textures[rs_txt] : nullptr;
+        (op_txt >= 0) ? scn->textures[op_txt] : nullptr;
     scn->materials[mid]->microfacet.use_phong = use_phong;
 }
 
@@ -522,6 +1258,7 @@ void set_instance(
     scn->instances[iid]->shp = scn->shapes[sid];
     scn->instances[iid]->mat =
         (mid < 0) ? scn->default_material : scn->materials[mid];
+    scn->geometry_version++;
 }
 
 //
@@ -631,10 +1368,15 @@ int add_line_shape(scene* scn, int nlines, const ym::vec2i* lines, int nverts,
 //
 // Sets the intersection callbacks
 //
-void set_intersection_callbacks(scene* scn, intersect_first_cb intersect_first,
-    intersect_any_cb intersect_any) {
+void set_intersection_callbacks(scene* scn, void* ctx,
+    intersect_first_cb intersect_first, intersect_any_cb intersect_any) {
+#ifndef YTRACE_NO_BVH
+    // custom intersection replaces the internal bvh
+    if (scn->intersect_bvh) ybvh::free_scene(scn->intersect_bvh);
+#endif
     scn->intersect_first = intersect_first;
     scn->intersect_any = intersect_any;
+    scn->geometry_version++;
 }
 
 //
@@ -667,6 +1409,7 @@ void specular_fresnel_from_ks(
 //
 void init_intersection(scene* scn) {
 #ifndef YTRACE_NO_BVH
+    if (scn->intersect_bvh) ybvh::free_scene(scn->intersect_bvh);
     scn->intersect_bvh = ybvh::make_scene();
     auto shape_map = std::map<shape*, int>();
     for (auto shp : scn->shapes) {
@@ -689,21 +1432,190 @@ void init_intersection(scene* scn) {
         ybvh::add_instance(scn->intersect_bvh, ist->frame, shape_map[ist->shp]);
     }
     ybvh::build_scene_bvh(scn->intersect_bvh);
-    set_intersection_callbacks(scn,
-        [scn](const ym::ray3f& ray) {
-            auto isec = ybvh::intersect_scene(scn->intersect_bvh, ray, false);
-            auto ipt = ytrace::intersect_point();
-            ipt.dist = isec.dist;
-            ipt.iid = isec.iid;
-            ipt.sid = isec.sid;
-            ipt.eid = isec.eid;
-            ipt.euv = {isec.euv.x, isec.euv.y, isec.euv.z};
-            return ipt;
-        },
-        [scn](const ym::ray3f& ray) {
-            return (bool)ybvh::intersect_scene(scn->intersect_bvh, ray, true);
-        });
+    // the internal bvh is called directly in intersect_scene()
+    scn->intersect_first = nullptr;
+    scn->intersect_any = nullptr;
 #endif
+    scn->geometry_version++;
+}
+
+//
+// Grab a texture value. See below.
+//
+static inline ym::vec4f lookup_texture(
+    const texture* txt, const ym::vec2i& ij, bool srgb);
+
+//
+// Luminance of a linear RGB color.
+//
+static inline float luminance(const ym::vec3f& c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+//
+// Computes the distribution for importance sampling an environment texture.
+// Each texel is weighted by the largest luminance of the pixels it
+// interpolates, so that the pdf is never zero where the bilinear lookup is
+// not, and by the solid angle it subtends. Rows are weighted in parallel.
+//
+static void init_environment_sampling(environment* env) {
+    env->pdf.clear();
+    env->prob.clear();
+    env->alias.clear();
+    auto txt = env->ke_txt;
+    if (!txt) return;
+    auto w = txt->width, h = txt->height;
+    env->pdf.resize(w * h);
+    yu::concurrent::parallel_for(h, [env, txt, w, h](int j) {
+        auto sin_theta = std::sin((j + 0.5f) * ym::pif / h);
+        for (auto i = 0; i < w; i++) {
+            auto lum = 0.0f;
+            for (auto dj = 0; dj < 2; dj++) {
+                for (auto di = 0; di < 2; di++) {
+                    auto ij = ym::vec2i{(i + di) % w, (j + dj) % h};
+                    auto ke = env->ke * lookup_texture(txt, ij, true).xyz();
+                    lum = ym::max(lum, luminance(ke));
+                }
+            }
+            env->pdf[j * w + i] = lum * sin_theta;
+        }
+    });
+    auto total = ym::make_alias_table(env->pdf, env->prob, env->alias);
+    // fall back to uniform sampling for black textures
+    if (total <= 0) {
+        env->pdf.clear();
+        env->prob.clear();
+        env->alias.clear();
+        return;
+    }
+    for (auto& p : env->pdf) p /= total;
+}
+
+//
+// Computes the alias table for sampling a shape uniformly by area.
+//
+static void init_shape_sampling(shape* shp) {
+    if (shp->points) {
+        shp->area = shp->nelems;
+    } else if (shp->lines) {
+        shp->prob.resize(shp->nelems);
+        shp->alias.resize(shp->nelems);
+        shp->area = ym::sample_lines_alias(shp->nelems, shp->lines, shp->pos,
+            shp->prob.data(), shp->alias.data());
+    } else if (shp->triangles) {
+        shp->prob.resize(shp->nelems);
+        shp->alias.resize(shp->nelems);
+        shp->area = ym::sample_triangles_alias(shp->nelems, shp->triangles,
+            shp->pos, shp->prob.data(), shp->alias.data());
+    }
+}
+
+//
+// Bounds of a shape light. Cones are computed from vertex normals, and are
+// widened to the whole sphere for emitters that are not one-sided.
+//
+static light_bounds make_light_bounds(const instance* ist) {
+    auto shp = ist->shp;
+    auto mat = ist->mat;
+    auto lb = light_bounds();
+    for (auto i = 0; i < shp->nverts; i++)
+        lb.bbox += ym::transform_point(ist->frame, shp->pos[i]);
+    if (shp->triangles) {
+        lb.power = ym::pif * luminance(mat->ke) * shp->area;
+        if (!shp->norm || mat->double_sided || mat->norm_txt) return lb;
+        auto axis = ym::zero3f;
+        for (auto i = 0; i < shp->nverts; i++)
+            axis += ym::normalize(shp->norm[i]);
+        if (ym::length(axis) < 1e-3f * shp->nverts) return lb;
+        axis = ym::normalize(axis);
+        auto cos_theta_o = 1.0f;
+        for (auto i = 0; i < shp->nverts; i++)
+            cos_theta_o = std::min(
+                cos_theta_o, ym::dot(axis, ym::normalize(shp->norm[i])));
+        lb.axis = ym::transform_direction(ist->frame, axis);
+        lb.cos_theta_o = cos_theta_o;
+    } else {
+        // points and lines emit in all directions
+        lb.power = 4 * ym::pif * luminance(mat->ke) * shp->area;
+    }
+    return lb;
+}
+
+//
+// Union of light bounds. The normals cones are merged as in Conty and Kulla,
+// "Importance Sampling of Many Lights with Adaptive Tree Splitting".
+//
+static light_bounds union_bounds(const light_bounds& a, const light_bounds& b) {
+    auto lb = light_bounds();
+    lb.bbox = a.bbox;
+    lb.bbox += b.bbox;
+    lb.power = a.power + b.power;
+    if (a.cos_theta_o <= -1 || b.cos_theta_o <= -1) return lb;
+    auto theta_a = std::acos(ym::clamp(a.cos_theta_o, -1.0f, 1.0f));
+    auto theta_b = std::acos(ym::clamp(b.cos_theta_o, -1.0f, 1.0f));
+    auto theta_d = std::acos(ym::clamp(ym::dot(a.axis, b.axis), -1.0f, 1.0f));
+    if (std::min(theta_d + theta_b, ym::pif) <= theta_a) {
+        lb.axis = a.axis;
+        lb.cos_theta_o = a.cos_theta_o;
+        return lb;
+    }
+    if (std::min(theta_d + theta_a, ym::pif) <= theta_b) {
+        lb.axis = b.axis;
+        lb.cos_theta_o = b.cos_theta_o;
+        return lb;
+    }
+    auto theta_o = (theta_a + theta_d + theta_b) / 2;
+    if (theta_o >= ym::pif) return lb;
+    auto wr = ym::cross(a.axis, b.axis);
+    if (ym::length(wr) == 0) return lb;
+    wr = ym::normalize(wr);
+    // rotate a.axis towards b.axis around wr
+    auto theta_r = theta_o - theta_a;
+    lb.axis = ym::normalize(a.axis * std::cos(theta_r) +
+                            ym::cross(wr, a.axis) * std::sin(theta_r));
+    lb.cos_theta_o = std::cos(theta_o);
+    return lb;
+}
+
+//
+// Build the light tree recursively, splitting the leaves in [start,end) at
+// the median centroid along the largest axis. Returns the node index.
+//
+static int build_light_tree(std::vector<light_node>& tree,
+    std::vector<light_node>& leaves, int start, int end) {
+    if (end - start == 1) {
+        tree.push_back(leaves[start]);
+        return (int)tree.size() - 1;
+    }
+
+    // split axis
+    auto cbbox = ym::invalid_bbox3f;
+    for (auto i = start; i < end; i++)
+        cbbox += ym::center(leaves[i].bounds.bbox);
+    auto csize = ym::diagonal(cbbox);
+    auto axis = 0;
+    if (csize.y > csize.x && csize.y >= csize.z) axis = 1;
+    if (csize.z > csize.x && csize.z > csize.y) axis = 2;
+
+    // median split
+    auto mid = (start + end) / 2;
+    std::nth_element(leaves.begin() + start, leaves.begin() + mid,
+        leaves.begin() + end, [axis](const light_node& a, const light_node& b) {
+            return ym::center(a.bounds.bbox)[axis] <
+                   ym::center(b.bounds.bbox)[axis];
+        });
+
+    // build children
+    auto nid = (int)tree.size();
+    tree.push_back({});
+    auto left = build_light_tree(tree, leaves, start, mid);
+    auto right = build_light_tree(tree, leaves, mid, end);
+    tree[nid].left = left;
+    tree[nid].right = right;
+    tree[nid].bounds = union_bounds(tree[left].bounds, tree[right].bounds);
+    tree[left].parent = nid;
+    tree[right].parent = nid;
+    return nid;
 }
 
 //
@@ -713,72 +1625,282 @@ void init_lights(scene* scn) {
     // clear old lights
     for (auto lgt : scn->lights) delete lgt;
     scn->lights.clear();
+    scn->env_lights.clear();
+    scn->light_tree.clear();
     scn->shadow_transmission = false;
     for (auto shp : scn->shapes) {
         shp->area = 0;
-        shp->cdf.clear();
+        shp->prob.clear();
+        shp->alias.clear();
     }
 
+    auto light_shapes = std::vector<shape*>();
+    auto light_nelems = 0;
     for (auto ist : scn->instances) {
+        ist->light_node = -1;
         if (!ist->mat->is_opaque()) scn->shadow_transmission = true;
         if (ist->mat->ke == ym::zero3f) continue;
         auto lgt = new light();
         lgt->ist = ist;
-        auto shp = ist->shp;
-        if (shp->cdf.empty()) {
-            shp->cdf.resize(shp->nelems);
-            if (shp->points) {
-                shp->cdf.resize(shp->nelems);
-                for (auto i = 0; i < shp->nelems; i++) ist->shp->cdf[i] = i + 1;
-            } else if (ist->shp->lines) {
-                ym::sample_lines_cdf(
-                    shp->nelems, shp->lines, shp->pos, shp->cdf.data());
-            } else if (shp->triangles) {
-                ym::sample_triangles_cdf(
-                    shp->nelems, shp->triangles, shp->pos, shp->cdf.data());
-            }
-            shp->area = ist->shp->cdf.back();
+        if (std::find(light_shapes.begin(), light_shapes.end(), ist->shp) ==
+            light_shapes.end()) {
+            light_shapes.push_back(ist->shp);
+            light_nelems += ist->shp->nelems;
         }
         scn->lights.push_back(lgt);
     }
 
+    // shape sampling tables, in parallel over shapes for large scenes
+    if (light_shapes.size() > 1 && light_nelems > 65536) {
+        yu::concurrent::parallel_for(
+            (int)light_shapes.size(), [&light_shapes](int idx) {
+                init_shape_sampling(light_shapes[idx]);
+            });
+    } else {
+        for (auto shp : light_shapes) init_shape_sampling(shp);
+    }
+
     for (auto env : scn->environments) {
+        env->pdf.clear();
+        env->prob.clear();
+        env->alias.clear();
         if (env->ke == ym::zero3f) continue;
         auto lgt = new light();
         lgt->env = env;
+        init_environment_sampling(env);
         scn->lights.push_back(lgt);
+        scn->env_lights.push_back(lgt);
     }
-}
 
-// -----------------------------------------------------------------------------
-// RANDOM NUMBER GENERATION
-// -----------------------------------------------------------------------------
+    // build the selection tree over shape lights
+    auto leaves = std::vector<light_node>();
+    for (auto lid = 0; lid < (int)scn->lights.size(); lid++) {
+        auto ist = scn->lights[lid]->ist;
+        if (!ist) continue;
+        auto leaf = light_node();
+        leaf.bounds = make_light_bounds(ist);
+        leaf.lid = lid;
+        leaves.push_back(leaf);
+    }
+    if (leaves.empty()) return;
+    scn->light_tree.reserve(2 * leaves.size() - 1);
+    build_light_tree(scn->light_tree, leaves, 0, (int)leaves.size());
+    for (auto nid = 0; nid < (int)scn->light_tree.size(); nid++) {
+        auto lid = scn->light_tree[nid].lid;
+        if (lid >= 0) scn->lights[lid]->ist->light_node = nid;
+    }
+}
 
 //
-// Random number smp. Handles random number generation for stratified
-// sampling and correlated multi-jittered sampling.
+// Recomputes the bounds of the light tree leaf nid and of its ancestors.
+//
+static void update_light_node(scene* scn, int nid) {
+    auto& tree = scn->light_tree;
+    tree[nid].bounds = make_light_bounds(scn->lights[tree[nid].lid]->ist);
+    for (auto pid = tree[nid].parent; pid >= 0; pid = tree[pid].parent) {
+        tree[pid].bounds = union_bounds(
+            tree[tree[pid].left].bounds, tree[tree[pid].right].bounds);
+    }
+}
+
+//
+// Move an instance. Public API, see above.
+//
+void set_instance_frame(scene* scn, int iid, const ym::frame3f& frame) {
+    auto ist = scn->instances[iid];
+    ist->frame = frame;
+#ifndef YTRACE_NO_BVH
+    if (scn->intersect_bvh) {
+        ybvh::set_instance_frame(scn->intersect_bvh, iid, frame);
+        ybvh::refit_scene_bvh(scn->intersect_bvh);
+    }
+#endif
+    scn->geometry_version++;
+    if (ist->light_node >= 0) update_light_node(scn, ist->light_node);
+}
+
+//
+// Update a shape after editing its vertices. Public API, see above.
+//
+void update_shape_positions(scene* scn, int sid) {
+    auto shp = scn->shapes[sid];
+#ifndef YTRACE_NO_BVH
+    if (scn->intersect_bvh) {
+        ybvh::refit_shape_bvh(scn->intersect_bvh, sid);
+        ybvh::refit_scene_bvh(scn->intersect_bvh);
+    }
+#endif
+    scn->geometry_version++;
+    auto sampled = false;
+    for (auto ist : scn->instances) {
+        if (ist->shp != shp || ist->light_node < 0) continue;
+        if (!sampled) init_shape_sampling(shp);
+        sampled = true;
+        update_light_node(scn, ist->light_node);
+    }
+}
+
+//
+// Update lights after editing a material. Public API, see above.
+//
+void update_material(scene* scn, int mid) {
+    auto mat = scn->materials[mid];
+    scn->shadow_transmission = false;
+    for (auto ist : scn->instances) {
+        if (!ist->mat->is_opaque()) scn->shadow_transmission = true;
+        if (ist->mat != mat) continue;
+        if ((ist->light_node >= 0) != (mat->ke != ym::zero3f)) {
+            init_lights(scn);
+            return;
+        }
+    }
+    for (auto ist : scn->instances) {
+        if (ist->mat == mat && ist->light_node >= 0)
+            update_light_node(scn, ist->light_node);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// RANDOM NUMBER GENERATION
+// -----------------------------------------------------------------------------
+
+//
+// Random number smp. Handles random number generation for stratified
+// sampling, correlated multi-jittered sampling and Sobol sequences.
 //
 struct sampler {
     ym::rng_pcg32 rng;  // rnumber number state
     int i, j;           // pixel coordinates
     int s, d;           // sample and dimension indices
     int ns, ns2;        // number of samples and its square root
-    rng_type rtype;     // random number type
+    int set;            // stratified set index
+};
+
+//
+// Direction numbers of the first two dimensions of the Sobol sequence, that
+// together form a (0,2)-sequence. The first dimension is kept for reference.
+//
+static const uint32_t sobol_directions[2][32] = {
+    {
+        0x80000000, 0x40000000, 0x20000000, 0x10000000,
+        0x08000000, 0x04000000, 0x02000000, 0x01000000,
+        0x00800000, 0x00400000, 0x00200000, 0x00100000,
+        0x00080000, 0x00040000, 0x00020000, 0x00010000,
+        0x00008000, 0x00004000, 0x00002000, 0x00001000,
+        0x00000800, 0x00000400, 0x00000200, 0x00000100,
+        0x00000080, 0x00000040, 0x00000020, 0x00000010,
+        0x00000008, 0x00000004, 0x00000002, 0x00000001,
+    },
+    {
+        0x80000000, 0xc0000000, 0xa0000000, 0xf0000000,
+        0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+        0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000,
+        0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+        0x80008000, 0xc000c000, 0xa000a000, 0xf000f000,
+        0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+        0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0,
+        0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff,
+    },
 };
 
+//
+// Tables of the second Sobol dimension, xoring the direction numbers selected
+// by each byte of the index. The first dimension is the bit reversal of the
+// index.
+//
+struct sobol_tables {
+    uint32_t bytes[4][256];
+};
+
+//
+// Gets the Sobol tables, computed once.
+//
+static const sobol_tables& get_sobol_tables() {
+    static const auto tables = []() {
+        auto tables = sobol_tables();
+        for (auto b = 0; b < 4; b++) {
+            for (auto v = 0; v < 256; v++) {
+                auto x = (uint32_t)0;
+                for (auto bit = 0; bit < 8; bit++)
+                    if (v & (1 << bit))
+                        x ^= sobol_directions[1][b * 8 + bit];
+                tables.bytes[b][v] = x;
+            }
+        }
+        return tables;
+    }();
+    return tables;
+}
+
+//
+// Reverses the bits of x.
+//
+static inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+//
+// Owen scrambling of x with a seed, with the hash-based nested uniform
+// scrambling of Burley, "Practical Hash-based Owen Scrambling", JCGT 2020.
+// Each bit is flipped based on a hash of the bits above it.
+//
+static inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+//
+// Generates a 2-dimensional Owen-scrambled Sobol sample for the pair of
+// dimensions starting at the current one, or a 1-dimensional one if y is
+// null. Each pair is padded with its own scrambling and shuffling of the
+// sample index, so that all pairs are stratified and not correlated.
+// Shuffling by Owen scrambling keeps the stratification of aligned blocks of
+// power of two samples, so any prefix is well distributed.
+//
+static inline float sample_sobol(const sampler* smp, float* y) {
+    auto seed = ym::hash_uint64_32(((uint64_t)(smp->i + 1)) << 0 |
+                                   ((uint64_t)(smp->j + 1)) << 15 |
+                                   ((uint64_t)(smp->d + 1)) << 30);
+    auto index = owen_scramble((uint32_t)smp->s, seed);
+    if (y) {
+        auto& tables = get_sobol_tables();
+        auto v = tables.bytes[0][index & 0xff] ^
+                 tables.bytes[1][(index >> 8) & 0xff] ^
+                 tables.bytes[2][(index >> 16) & 0xff] ^
+                 tables.bytes[3][index >> 24];
+        *y = (owen_scramble(v, seed * 0x63d83595u + 2) >> 8) / 16777216.0f;
+    }
+    auto x = owen_scramble(reverse_bits(index), seed * 0xa511e9b3u + 1);
+    return (x >> 8) / 16777216.0f;
+}
+
 //
 // Initialize a smp ot type rtype for pixel i, j with ns total samples.
+// The sampler type is a template parameter, as in the functions below, so
+// that render kernels are compiled for each type without branching on it.
 //
 // Implementation Notes: we use hash functions to scramble the pixel ids
 // to avoid introducing unwanted correlation between pixels. These should not
 // around according to the RNG documentaion, but we still found bad cases.
-// Scrambling avoids it.
+// Scrambling avoids it. Samples past ns start a new stratified set, except
+// for Sobol samples that are valid for any number of samples. The set index
+// is mixed into the permutations, so that sets do not repeat each other.
 //
-static inline sampler make_sampler(
-    int i, int j, int s, int ns, rng_type rtype) {
+template <rng_type rtype>
+static inline sampler make_sampler(int i, int j, int s, int ns) {
     // we use various hashes to scramble the pixel values
-    sampler smp = {
-        {0, 0}, i, j, s, 0, ns, (int)std::round(std::sqrt((float)ns)), rtype};
+    auto sobol = rtype == rng_type::sobol;
+    sampler smp = {{0, 0}, i, j, (sobol) ? s : s % ns, 0, ns,
+        (int)std::round(std::sqrt((float)ns)), (sobol) ? 0 : s / ns};
     uint64_t sample_id = ((uint64_t)(i + 1)) << 0 | ((uint64_t)(j + 1)) << 15 |
                          ((uint64_t)(s + 1)) << 30;
     uint64_t initseq = ym::hash_uint64(sample_id);
@@ -788,6 +1910,18 @@ static inline sampler make_sampler(
     return smp;
 }
 
+//
+// Permutation key for the current dimension of a sampler. The first set
+// keeps the plain pixel and dimension hash.
+//
+static inline uint32_t eval_sampler_key(const sampler* smp) {
+    uint32_t p = ym::hash_uint64_32(((uint64_t)(smp->i + 1)) << 0 |
+                                    ((uint64_t)(smp->j + 1)) << 15 |
+                                    ((uint64_t)(smp->d + 1)) << 30);
+    if (smp->set) p = ym::hash_uint64_32(((uint64_t)smp->set) << 32 | p);
+    return p;
+}
+
 //
 // Generates a 1-dimensional sample.
 //
@@ -795,26 +1929,26 @@ static inline sampler make_sampler(
 // compute a 64bit sample and use hashing to avoid correlation. Then permutation
 // are computed with CMJS procedures.
 //
+template <rng_type rtype>
 static inline float sample_next1f(sampler* smp) {
     float rn = 0;
-    switch (smp->rtype) {
+    switch (rtype) {
         case rng_type::uniform: {
             rn = next1f(&smp->rng);
         } break;
         case rng_type::stratified: {
-            uint32_t p = ym::hash_uint64_32(((uint64_t)(smp->i + 1)) << 0 |
-                                            ((uint64_t)(smp->j + 1)) << 15 |
-                                            ((uint64_t)(smp->d + 1)) << 30);
+            uint32_t p = eval_sampler_key(smp);
             int s = ym::hash_permute(smp->s, smp->ns, p);
             rn = (s + next1f(&smp->rng)) / smp->ns;
         } break;
         case rng_type::cmjs: {
-            uint32_t p = ym::hash_uint64_32(((uint64_t)(smp->i + 1)) << 0 |
-                                            ((uint64_t)(smp->j + 1)) << 15 |
-                                            ((uint64_t)(smp->d + 1)) << 30);
+            uint32_t p = eval_sampler_key(smp);
             int s = ym::hash_permute(smp->s, smp->ns, p);
             rn = (s + ym::hash_randfloat(s, p * 0xa399d265)) / smp->ns;
         } break;
+        case rng_type::sobol: {
+            rn = sample_sobol(smp, nullptr);
+        } break;
         default: assert(false);
     }
 
@@ -832,25 +1966,22 @@ static inline float sample_next1f(sampler* smp) {
 // Implementation notes: see above. Note that using deterministic keyed
 // permutaton we can use stratified sampling without preallocating samples.
 //
+template <rng_type rtype>
 static inline ym::vec2f sample_next2f(sampler* smp) {
     ym::vec2f rn = {0, 0};
-    switch (smp->rtype) {
+    switch (rtype) {
         case rng_type::uniform: {
             rn.x = next1f(&smp->rng);
             rn.y = next1f(&smp->rng);
         } break;
         case rng_type::stratified: {
-            uint32_t p = ym::hash_uint64_32(((uint64_t)(smp->i + 1)) << 0 |
-                                            ((uint64_t)(smp->j + 1)) << 15 |
-                                            ((uint64_t)(smp->d + 1)) << 30);
+            uint32_t p = eval_sampler_key(smp);
             int s = ym::hash_permute(smp->s, smp->ns, p);
             rn.x = (s % smp->ns2 + next1f(&smp->rng)) / smp->ns2;
             rn.y = (s / smp->ns2 + next1f(&smp->rng)) / smp->ns2;
         } break;
         case rng_type::cmjs: {
-            uint32_t p = ym::hash_uint64_32(((uint64_t)(smp->i + 1)) << 0 |
-                                            ((uint64_t)(smp->j + 1)) << 15 |
-                                            ((uint64_t)(smp->d + 1)) << 30);
+            uint32_t p = eval_sampler_key(smp);
             int s = ym::hash_permute(smp->s, smp->ns, p);
             int sx = ym::hash_permute(s % smp->ns2, smp->ns2, p * 0xa511e9b3);
             int sy = ym::hash_permute(s / smp->ns2, smp->ns2, p * 0x63d83595);
@@ -859,6 +1990,9 @@ static inline ym::vec2f sample_next2f(sampler* smp) {
             rn.x = (s % smp->ns2 + (sy + jx) / smp->ns2) / smp->ns2;
             rn.y = (s / smp->ns2 + (sx + jy) / smp->ns2) / smp->ns2;
         } break;
+        case rng_type::sobol: {
+            rn.x = sample_sobol(smp, &rn.y);
+        } break;
         default: assert(false);
     }
 
@@ -874,8 +2008,9 @@ static inline ym::vec2f sample_next2f(sampler* smp) {
 //
 // Creates a 1-dimensional sample in [0,num-1]
 //
+template <rng_type rtype>
 static inline int sample_next1i(sampler* smp, int num) {
-    return ym::clamp(int(sample_next1f(smp) * num), 0, num - 1);
+    return ym::clamp(int(sample_next1f<rtype>(smp) * num), 0, num - 1);
 }
 
 //
@@ -920,9 +2055,32 @@ struct emission {
     ym::vec3f ke = ym::zero3f;
 };
 
+//
+// Ray cone used to estimate the footprint of a ray for texture filtering.
+// This is an isotropic simplification of ray differentials, following
+// Akenine-Moller et al., "Texture Level of Detail Strategies for Real-Time
+// Ray Tracing".
+//
+struct ray_cone {
+    float width = 0;   // cone width at the ray origin
+    float spread = 0;  // cone spread angle
+
+    ray_cone() {}
+    ray_cone(float width, float spread) : width(width), spread(spread) {}
+};
+
+//
+// Maximum number of lobes in a point, sized to what the materials above
+// produce: up to three brdf lobes plus one for opacity, and one emission.
+//
+const int max_brdfs = 4;
+const int max_emissions = 1;
+
 //
 // Surface point with geometry and material data. Supports point on envmap too.
-// This is the key data manipulated in the path tracer.
+// This is the key data manipulated in the path tracer, copied and stored
+// per path in the wavefront renderer, so lobe arrays are kept to the sizes
+// above and derived values are not stored.
 //
 struct point {
     // light id -----------------------------
@@ -935,13 +2093,15 @@ struct point {
     // resolved geometry (shape) ------------
     ym::frame3f frame = ym::identity_frame3f;  // local frame
 
+    // ray footprint ------------------------
+    ray_cone cone;  // cone of the ray that reached the point
+
     // shading ------------------------------
-    float op = 0;                // material opacity
-    int nemissions = 0;          // numner of emission lobes
-    emission emissions[8] = {};  // emission lobes
-    int nbrdfs = 0;              // numner of brdf lobes
-    brdf brdfs[8] = {};          // brdf lobes
-    ym::vec3f rho = ym::zero3f;  // material brdf weight
+    int nemissions = 0;                      // number of emission lobes
+    emission emissions[max_emissions] = {};  // emission lobes
+    int nbrdfs = 0;                          // number of brdf lobes
+    brdf brdfs[max_brdfs] = {};              // brdf lobes
+    ym::vec3f rho = ym::zero3f;              // material brdf weight
 
     // helpers ------------------------------
     bool no_reflectance() const { return nbrdfs == 0; }
@@ -964,15 +2124,152 @@ static ym::ray3f eval_camera(
 }
 
 //
-// Grab a texture value
+// Ray cone for camera rays, spreading by half the angle subtended by a pixel
+// at the image center, since pixel samples already average over the pixel
+// and a wider cone overblurs converged images. Lens blur is not accounted for.
+//
+static inline ray_cone eval_camera_cone(const camera* cam, int height) {
+    return {0, std::tan(cam->yfov / 2) / height};
+}
+
+//
+// Seeks a file to a 64 bit offset. Returns false on errors.
+//
+static inline bool seek_file(FILE* f, uint64_t offset) {
+#ifdef _WIN32
+    return !_fseeki64(f, (int64_t)offset, SEEK_SET);
+#else
+    return !fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+//
+// Reads a page of a paged texture through the scene cache. The page is read
+// outside the cache lock, so two threads may read the same page, and the
+// least recently used pages are evicted to stay within budget.
+//
+static std::shared_ptr<const texture_page> fetch_texture_page(
+    texture_file* tf, int level, int page, uint64_t key) {
+    auto cache = tf->cache;
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto it = cache->pages.find(key);
+        if (it != cache->pages.end()) {
+            cache->lru.splice(
+                cache->lru.begin(), cache->lru, it->second.second);
+            return it->second.first;
+        }
+    }
+
+    // read page, leaving it black on errors
+    auto ps = texture_page_size;
+    auto pg = std::make_shared<texture_page>();
+    auto data = (void*)nullptr;
+    auto size = (size_t)ps * ps;
+    if (tf->ldr) {
+        pg->ldr = tiled_image<ym::vec4b>(ps, ps);
+        data = pg->ldr.pixels.data();
+        size *= sizeof(ym::vec4b);
+    } else {
+        pg->hdr = tiled_image<ym::vec4f>(ps, ps);
+        data = pg->hdr.pixels.data();
+        size *= sizeof(ym::vec4f);
+    }
+    {
+        std::lock_guard<std::mutex> lock(tf->mutex);
+        auto offset = tf->offsets[level] + (uint64_t)page * size;
+        if (!seek_file(tf->file, offset) ||
+            fread(data, 1, size, tf->file) != size)
+            memset(data, 0, size);
+    }
+    pg->bytes = size;
+
+    // insert page and evict the oldest ones
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto it = cache->pages.find(key);
+    if (it != cache->pages.end()) return it->second.first;
+    cache->lru.push_front(key);
+    cache->pages[key] = {pg, cache->lru.begin()};
+    cache->bytes += pg->bytes;
+    while (cache->bytes > cache->budget && cache->lru.size() > 1) {
+        auto old = cache->pages.find(cache->lru.back());
+        cache->bytes -= old->second.first->bytes;
+        cache->pages.erase(old);
+        cache->lru.pop_back();
+    }
+    return pg;
+}
+
+//
+// Gets the page of a paged texture that holds a texel. Each thread keeps
+// the pages it used last in a small direct-mapped cache, so most lookups
+// take no lock. These references keep pages alive after their eviction, so
+// memory can exceed the budget by a few pages per thread.
+//
+static inline const texture_page* get_texture_page(
+    texture_file* tf, int level, const ym::vec2i& ij) {
+    struct page_slot {
+        uint64_t key = 0;
+        std::shared_ptr<const texture_page> page;
+    };
+    thread_local page_slot slots[16];
+    auto ps = texture_page_size;
+    auto page = (ij.y / ps) * tf->npages[level].x + ij.x / ps;
+    auto key = (tf->id << 40) | ((uint64_t)level << 32) | (uint64_t)page;
+    auto& slot = slots[(key * 0x9e3779b97f4a7c15ull) >> 60];
+    if (slot.key != key) {
+        slot.page = fetch_texture_page(tf, level, page, key);
+        slot.key = key;
+    }
+    return slot.page.get();
+}
+
+//
+// Grab a texel of an ldr texture stored as gray or compressed blocks
+//
+static inline ym::vec4b lookup_packed_texel(
+    const texture* txt, int level, const ym::vec2i& ij) {
+    if (txt->format == ldr_format::gray) {
+        auto l = txt->gray[level][ij];
+        return {l, l, l, 255};
+    }
+    auto blk = txt->blocks[level].block(ij);
+    auto i = (ij.y & 3) * 4 + (ij.x & 3);
+    switch (txt->format) {
+        case ldr_format::bc1: return decode_bc1(blk[0], i, 255);
+        case ldr_format::bc3:
+            return decode_bc1(blk[0], i, decode_bc4(blk[1], i));
+        case ldr_format::bc4: {
+            auto l = decode_bc4(blk[0], i);
+            return {l, l, l, 255};
+        }
+        default: assert(false); return {};
+    }
+}
+
+//
+// Grab a texture value from a mip level
 //
 static inline ym::vec4f lookup_texture(
-    const texture* txt, const ym::vec2i& ij, bool srgb = true) {
-    if (txt->ldr) {
-        auto v = txt->ldr[ij.y * txt->width + ij.x];
-        return (srgb) ? ym::srgb_to_linear(v) : ym::byte_to_float(v);
-    } else if (txt->hdr) {
-        return txt->hdr[ij.y * txt->width + ij.x];
+    const texture* txt, int level, const ym::vec2i& ij, bool srgb) {
+    if (txt->file) {
+        auto pg = get_texture_page(txt->file, level, ij);
+        auto ps = texture_page_size;
+        auto pij = ym::vec2i{ij.x % ps, ij.y % ps};
+        if (!txt->file->ldr) return pg->hdr[pij];
+        auto& tables = get_byte_tables();
+        return decode_texel(pg->ldr[pij], (srgb) ? tables.srgb : tables.linear,
+            tables.linear);
+    } else if (!txt->ldr.empty()) {
+        auto& tables = get_byte_tables();
+        return decode_texel(txt->ldr[level][ij],
+            (srgb) ? tables.srgb : tables.linear, tables.linear);
+    } else if (txt->format != ldr_format::rgba) {
+        auto& tables = get_byte_tables();
+        return decode_texel(lookup_packed_texel(txt, level, ij),
+            (srgb) ? tables.srgb : tables.linear, tables.linear);
+    } else if (!txt->hdr.empty()) {
+        return txt->hdr[level][ij];
     } else {
         assert(false);
         return {};
@@ -980,37 +2277,103 @@ static inline ym::vec4f lookup_texture(
 }
 
 //
-// Wrapper for above function
+// Grab a texture value
 //
-static ym::vec4f eval_texture(
-    const texture* txt, const ym::vec2f& texcoord, bool srgb = true) {
-    if (!txt) return {1, 1, 1, 1};
-    assert(txt->hdr || txt->ldr);
+static inline ym::vec4f lookup_texture(
+    const texture* txt, const ym::vec2i& ij, bool srgb) {
+    return lookup_texture(txt, 0, ij, srgb);
+}
+
+//
+// Size of a texture mip level
+//
+static inline ym::vec2i texture_size(const texture* txt, int level) {
+    if (txt->file) {
+        return txt->file->sizes[level];
+    } else if (!txt->ldr.empty()) {
+        return {txt->ldr[level].width, txt->ldr[level].height};
+    } else if (txt->format == ldr_format::gray) {
+        return {txt->gray[level].width, txt->gray[level].height};
+    } else if (txt->format != ldr_format::rgba) {
+        return {txt->blocks[level].width, txt->blocks[level].height};
+    } else {
+        return {txt->hdr[level].width, txt->hdr[level].height};
+    }
+}
 
+//
+// Bilinear lookup in a texture mip level. The four texels are fetched
+// together and blended as vectors, with a single branch on the format.
+//
+static ym::vec4f eval_texture(
+    const texture* txt, int level, const ym::vec2f& texcoord, bool srgb) {
     // get image width/height
-    auto wh = ym::vec2i{txt->width, txt->height};
+    auto wh = texture_size(txt, level);
 
     // get coordinates normalized for tiling
-    auto st = ym::vec2f{
-        std::fmod(texcoord.x, 1.0f) * wh.x, std::fmod(texcoord.y, 1.0f) * wh.y};
-    if (st.x < 0) st.x += wh.x;
-    if (st.y < 0) st.y += wh.y;
+    auto st = ym::vec2f{(texcoord.x - std::floor(texcoord.x)) * wh.x,
+        (texcoord.y - std::floor(texcoord.y)) * wh.y};
 
     // get image coordinates and residuals
-    auto ij = ym::clamp(ym::vec2i{(int)st.x, (int)st.y}, {0, 0}, wh);
+    auto ij = ym::vec2i{
+        std::min((int)st.x, wh.x - 1), std::min((int)st.y, wh.y - 1)};
     auto uv = st - ym::vec2f{(float)ij.x, (float)ij.y};
+    auto ij1 = ym::vec2i{
+        (ij.x + 1 < wh.x) ? ij.x + 1 : 0, (ij.y + 1 < wh.y) ? ij.y + 1 : 0};
 
-    // get interpolation weights and indices
-    ym::vec2i idx[4] = {ij, {ij.x, (ij.y + 1) % wh.y},
-        {(ij.x + 1) % wh.x, ij.y}, {(ij.x + 1) % wh.x, (ij.y + 1) % wh.y}};
+    // get interpolation weights
     auto w = ym::vec4f{(1 - uv.x) * (1 - uv.y), (1 - uv.x) * uv.y,
         uv.x * (1 - uv.y), uv.x * uv.y};
 
     // handle interpolation
-    return (lookup_texture(txt, idx[0], srgb) * w.x +
-            lookup_texture(txt, idx[1], srgb) * w.y +
-            lookup_texture(txt, idx[2], srgb) * w.z +
-            lookup_texture(txt, idx[3], srgb) * w.w);
+    if (txt->file || txt->format != ldr_format::rgba) {
+        return lookup_texture(txt, level, ij, srgb) * w.x +
+               lookup_texture(txt, level, {ij.x, ij1.y}, srgb) * w.y +
+               lookup_texture(txt, level, {ij1.x, ij.y}, srgb) * w.z +
+               lookup_texture(txt, level, ij1, srgb) * w.w;
+    } else if (!txt->ldr.empty()) {
+        auto& img = txt->ldr[level];
+        auto& tables = get_byte_tables();
+        auto lut = (srgb) ? tables.srgb : tables.linear;
+        return decode_texel(img[ij], lut, tables.linear) * w.x +
+               decode_texel(img[{ij.x, ij1.y}], lut, tables.linear) * w.y +
+               decode_texel(img[{ij1.x, ij.y}], lut, tables.linear) * w.z +
+               decode_texel(img[ij1], lut, tables.linear) * w.w;
+    } else {
+        auto& img = txt->hdr[level];
+        return img[ij] * w.x + img[{ij.x, ij1.y}] * w.y +
+               img[{ij1.x, ij.y}] * w.z + img[ij1] * w.w;
+    }
+}
+
+//
+// Wrapper for above function. The mip level is chosen from the footprint
+// of the ray, in texture coordinates, with trilinear filtering between
+// levels. A zero footprint uses the full resolution texture.
+//
+static ym::vec4f eval_texture(const texture* txt, const ym::vec2f& texcoord,
+    float footprint, bool srgb = true) {
+    if (!txt) return {1, 1, 1, 1};
+    assert(txt->file || txt->format != ldr_format::rgba ||
+           !txt->hdr.empty() || !txt->ldr.empty());
+
+    // pick mip level
+    auto nlevels = (txt->file) ?
+                       (int)txt->file->sizes.size() :
+                       (int)std::max({txt->hdr.size(), txt->ldr.size(),
+                           txt->gray.size(), txt->blocks.size()});
+    auto level = (footprint > 0) ?
+                     std::log2(footprint * std::max(txt->width, txt->height)) :
+                     0.0f;
+    if (level <= 0 || nlevels == 1) return eval_texture(txt, 0, texcoord, srgb);
+    if (level >= nlevels - 1)
+        return eval_texture(txt, nlevels - 1, texcoord, srgb);
+
+    // trilinear interpolation
+    auto l = (int)level;
+    auto t = level - l;
+    return eval_texture(txt, l, texcoord, srgb) * (1 - t) +
+           eval_texture(txt, l + 1, texcoord, srgb) * t;
 }
 
 //
@@ -1757,7 +3120,7 @@ static point eval_envpoint(const environment* env, const ym::vec3f& wo) {
         auto theta = (std::acos(ym::clamp(w.y, (float)-1, (float)1)) / ym::pif);
         auto phi = std::atan2(w.z, w.x) / (2 * ym::pif);
         auto texcoord = ym::vec2f{phi, theta};
-        ke *= eval_texture(env->ke_txt, texcoord).xyz();
+        ke *= eval_texture(env->ke_txt, texcoord, 0).xyz();
     }
 
     // create emission lobe
@@ -1808,8 +3171,8 @@ static inline T interpolate_triangle(
 //
 // Create a point for a shape. Resolves geometry and material with textures.
 //
-static point eval_shapepoint(
-    const instance* ist, int eid, const ym::vec3f& euv, const ym::vec3f& wo) {
+static point eval_shapepoint(const instance* ist, int eid,
+    const ym::vec3f& euv, const ym::vec3f& wo, const ray_cone& cone = {}) {
     // set shape data
     auto pt = point();
 
@@ -1819,6 +3182,9 @@ static point eval_shapepoint(
     // direction
     pt.wo = wo;
 
+    // ray footprint
+    pt.cone = cone;
+
     // shortcuts
     auto shp = ist->shp;
     auto mat = ist->mat;
@@ -1848,9 +3214,28 @@ static point eval_shapepoint(
         tangsp = interpolate_triangle(shp->tangsp, shp->triangles, eid, euv);
     }
 
+    // texture footprint, from the cone width and the texel density of the
+    // triangle, widened at grazing angles
+    auto duv = 0.0f;  // footprint size in texture coordinates
+    if (cone.width > 0 && shp->triangles && shp->texcoord) {
+        auto t = shp->triangles[eid];
+        auto p0 = shp->pos[t.x], p1 = shp->pos[t.y], p2 = shp->pos[t.z];
+        auto uv0 = shp->texcoord[t.x], uv1 = shp->texcoord[t.y],
+             uv2 = shp->texcoord[t.z];
+        auto uv_area = std::abs(ym::cross(uv1 - uv0, uv2 - uv0)) / 2;
+        auto pos_area = ym::triangle_area(p0, p1, p2);
+        auto gnorm = ym::transform_direction(
+            ist->frame, ym::normalize(ym::cross(p1 - p0, p2 - p0)));
+        auto cos_theta = std::abs(ym::dot(gnorm, wo));
+        if (pos_area > 0)
+            duv = cone.width / std::max(cos_theta, 0.1f) *
+                  std::sqrt(uv_area / pos_area);
+    }
+
     // handle normal map
     if (shp->texcoord && shp->tangsp && shp->triangles && mat->norm_txt) {
-        auto txt = eval_texture(mat->norm_txt, texcoord, false).xyz() * 2.0f -
+        auto txt = eval_texture(mat->norm_txt, texcoord, duv, false).xyz() *
+                       2.0f -
                    ym::vec3f{1, 1, 1};
         auto ntxt = ym::normalize(ym::vec3f{txt.x, -txt.y, txt.z});
         auto frame = ym::make_frame3_fromzx(
@@ -1880,7 +3265,7 @@ static point eval_shapepoint(
 
     // handle occlusion
     if (shp->texcoord && mat->occ_txt)
-        kx_scale.xyz() *= eval_texture(mat->occ_txt, texcoord).xyz();
+        kx_scale.xyz() *= eval_texture(mat->occ_txt, texcoord, duv).xyz();
 
     // sample emission
     auto ke = mat->ke * kx_scale.xyz();
@@ -1891,15 +3276,16 @@ static point eval_shapepoint(
     }
 
     // sample reflectance
+    auto op = 1.0f;
     switch (mat->rtype) {
-        case reflectance_type::none: pt.op = 1; break;
+        case reflectance_type::none: op = 1; break;
         case reflectance_type::matte: {
             auto kd = ym::vec4f{mat->matte.kd, mat->matte.op} * kx_scale;
             if (shp->texcoord && mat->matte.kd_txt)
-                kd *= eval_texture(mat->matte.kd_txt, texcoord);
+                kd *= eval_texture(mat->matte.kd_txt, texcoord, duv);
             if (shp->texcoord && mat->matte.op_txt)
-                kd.w *= eval_texture(mat->matte.op_txt, texcoord).x;
-            pt.op = kd.w;
+                kd.w *= eval_texture(mat->matte.op_txt, texcoord, duv).x;
+            op = kd.w;
             pt.brdfs[pt.nbrdfs].type = brdf_type::reflection_lambert;
             pt.brdfs[pt.nbrdfs].rho = kd.xyz();
             if (pt.brdfs[pt.nbrdfs].rho != ym::zero3f) pt.nbrdfs++;
@@ -1912,16 +3298,16 @@ static point eval_shapepoint(
             auto kt = ym::vec4f{mat->microfacet.kt, mat->microfacet.rs} *
                       ym::vec4f{kx_scale.xyz(), 1};
             if (shp->texcoord && mat->microfacet.kd_txt)
-                kd *= eval_texture(mat->microfacet.kd_txt, texcoord);
+                kd *= eval_texture(mat->microfacet.kd_txt, texcoord, duv);
             if (shp->texcoord && mat->microfacet.op_txt)
-                kd.w *= eval_texture(mat->microfacet.op_txt, texcoord).x;
+                kd.w *= eval_texture(mat->microfacet.op_txt, texcoord, duv).x;
             if (shp->texcoord && mat->microfacet.ks_txt)
                 ks.xyz() *=
-                    eval_texture(mat->microfacet.ks_txt, texcoord).xyz();
+                    eval_texture(mat->microfacet.ks_txt, texcoord, duv).xyz();
             if (shp->texcoord && mat->microfacet.kt_txt)
                 kt.xyz() *=
-                    eval_texture(mat->microfacet.kt_txt, texcoord).xyz();
-            pt.op = kd.w;
+                    eval_texture(mat->microfacet.kt_txt, texcoord, duv).xyz();
+            op = kd.w;
             pt.brdfs[pt.nbrdfs].type = brdf_type::refraction_ggx;
             pt.brdfs[pt.nbrdfs].rho = kt.xyz();
             pt.brdfs[pt.nbrdfs].roughness = kt.w;
@@ -1939,13 +3325,14 @@ static point eval_shapepoint(
                 ym::vec4f{mat->metalrough.kb, mat->metalrough.op} * kx_scale;
             auto km = ym::vec2f{mat->metalrough.km, mat->metalrough.rs};
             if (shp->texcoord && mat->metalrough.kb_txt)
-                kb *= eval_texture(mat->metalrough.kb_txt, texcoord);
+                kb *= eval_texture(mat->metalrough.kb_txt, texcoord, duv);
             if (shp->texcoord && mat->metalrough.km_txt) {
-                auto km_txt = eval_texture(mat->metalrough.km_txt, texcoord);
+                auto km_txt =
+                    eval_texture(mat->metalrough.km_txt, texcoord, duv);
                 km.x *= km_txt.y;
                 km.y *= km_txt.z;
             }
-            pt.op = kb.w;
+            op = kb.w;
             pt.brdfs[pt.nbrdfs].type = brdf_type::reflection_lambert;
             pt.brdfs[pt.nbrdfs].rho = kb.xyz() * (1 - km.x);
             if (pt.brdfs[pt.nbrdfs].rho != ym::zero3f) pt.nbrdfs++;
@@ -1961,10 +3348,10 @@ static point eval_shapepoint(
             auto ks = ym::vec4f{mat->specgloss.ks, mat->specgloss.rs} *
                       ym::vec4f{kx_scale.xyz(), 1};
             if (shp->texcoord && mat->specgloss.kd_txt)
-                kd *= eval_texture(mat->specgloss.kd_txt, texcoord);
+                kd *= eval_texture(mat->specgloss.kd_txt, texcoord, duv);
             if (shp->texcoord && mat->specgloss.ks_txt)
-                ks *= eval_texture(mat->specgloss.ks_txt, texcoord);
-            pt.op = kd.w;
+                ks *= eval_texture(mat->specgloss.ks_txt, texcoord, duv);
+            op = kd.w;
             pt.brdfs[pt.nbrdfs].type = brdf_type::reflection_lambert;
             pt.brdfs[pt.nbrdfs].rho = kd.xyz();
             if (pt.brdfs[pt.nbrdfs].rho != ym::zero3f) pt.nbrdfs++;
@@ -1980,11 +3367,11 @@ static point eval_shapepoint(
                       ym::vec4f{kx_scale.xyz(), 1};
             if (shp->texcoord && mat->thin_glass.ks_txt)
                 ks.xyz() *=
-                    eval_texture(mat->thin_glass.ks_txt, texcoord).xyz();
+                    eval_texture(mat->thin_glass.ks_txt, texcoord, duv).xyz();
             if (shp->texcoord && mat->thin_glass.kt_txt)
                 kt.xyz() *=
-                    eval_texture(mat->thin_glass.kt_txt, texcoord).xyz();
-            pt.op = 1;
+                    eval_texture(mat->thin_glass.kt_txt, texcoord, duv).xyz();
+            op = 1;
             pt.brdfs[pt.nbrdfs].type = brdf_type::transparent;
             pt.brdfs[pt.nbrdfs].rho = kt.xyz();
             pt.brdfs[pt.nbrdfs].roughness = 0;
@@ -2014,12 +3401,13 @@ static point eval_shapepoint(
     }
 
     // correct for opacity
-    if (pt.op < 1) {
+    if (op < 1) {
         for (auto lid = 0; lid < pt.nemissions; lid++)
-            pt.emissions[lid].ke *= pt.op;
-        for (auto lid = 0; lid < pt.nbrdfs; lid++) pt.brdfs[lid].rho *= pt.op;
+            pt.emissions[lid].ke *= op;
+        for (auto lid = 0; lid < pt.nbrdfs; lid++) pt.brdfs[lid].rho *= op;
+        assert(pt.nbrdfs < max_brdfs);
         pt.brdfs[pt.nbrdfs].type = brdf_type::transparent;
-        pt.brdfs[pt.nbrdfs].rho = {1 - pt.op, 1 - pt.op, 1 - pt.op};
+        pt.brdfs[pt.nbrdfs].rho = {1 - op, 1 - op, 1 - op};
         pt.nbrdfs += 1;
     }
 
@@ -2039,7 +3427,24 @@ static float weight_light(const point& lpt, const point& pt) {
     auto emission = lpt.emissions[0];
     switch (emission.type) {
         case emission_type::env: {
-            return 4 * ym::pif;
+            auto env = lpt.env;
+            if (env->pdf.empty()) return 4 * ym::pif;
+            // pdf of the texel containing the direction, converted from
+            // texture space to solid angle
+            auto w = ym::transform_direction(ym::inverse(env->frame), -lpt.wo);
+            auto theta = std::acos(ym::clamp(w.y, (float)-1, (float)1));
+            auto phi = std::atan2(w.z, w.x);
+            if (phi < 0) phi += 2 * ym::pif;
+            auto width = env->ke_txt->width, height = env->ke_txt->height;
+            auto i = ym::clamp(
+                (int)(phi * width / (2 * ym::pif)), 0, width - 1);
+            auto j =
+                ym::clamp((int)(theta * height / ym::pif), 0, height - 1);
+            auto idx = j * width + i;
+            auto prob = env->pdf[idx];
+            auto sin_theta = std::sin(theta);
+            if (prob <= 0 || sin_theta <= 0) return 0;
+            return 2 * ym::pif * ym::pif * sin_theta / (prob * width * height);
         } break;
         case emission_type::point: {
             auto d = ym::dist(lpt.frame.o, pt.frame.o);
@@ -2062,42 +3467,419 @@ static float weight_light(const point& lpt, const point& pt) {
 }
 
 //
-// Picks a point on a light.
+// Coordinates of a point on a light: element and element coordinates for
+// shape lights, or the outgoing direction for environments.
 //
-static point sample_light(
-    const light* lgt, const point& pt, float rne, const ym::vec2f& rn) {
+struct light_coords {
+    int eid = 0;               // element id [shape lights]
+    ym::vec3f euv = {0, 0, 0};  // element coordinates or direction
+};
+
+//
+// Picks the coordinates of a point on a light.
+//
+static light_coords sample_light_coords(
+    const light* lgt, float rne, const ym::vec2f& rn) {
+    auto lc = light_coords();
     if (lgt->ist) {
         auto shp = lgt->ist->shp;
-        auto eid = 0;
-        auto euv = ym::zero3f;
         if (shp->triangles) {
-            std::tie(eid, euv) =
-                ym::sample_triangles(shp->nelems, shp->cdf.data(), rne, rn);
+            std::tie(lc.eid, lc.euv) =
+                ym::sample_triangles(shp->nelems, shp->prob.data(),
+                    shp->alias.data(), rne, rn);
         } else if (shp->lines) {
-            std::tie(eid, (ym::vec2f&)euv) =
-                ym::sample_lines(shp->nelems, shp->cdf.data(), rne, rn.x);
+            std::tie(lc.eid, (ym::vec2f&)lc.euv) =
+                ym::sample_lines(shp->nelems, shp->prob.data(),
+                    shp->alias.data(), rne, rn.x);
         } else if (shp->points) {
-            eid = ym::clamp(0, shp->nelems - 1, (int)(rne * shp->nelems));
-            euv = {1, 0, 0};
+            lc.eid = ym::clamp(0, shp->nelems - 1, (int)(rne * shp->nelems));
+            lc.euv = {1, 0, 0};
         } else {
             assert(false);
         }
-        auto lpt = eval_shapepoint(lgt->ist, eid, euv, ym::zero3f);
+    } else if (lgt->env) {
+        auto env = lgt->env;
+        if (!env->pdf.empty()) {
+            // pick a texel proportionally to its weight and a point in it
+            auto width = env->ke_txt->width, height = env->ke_txt->height;
+            auto idx = ym::sample_alias_table(env->prob, env->alias, rne);
+            auto theta = ((idx / width) + rn.y) * ym::pif / height;
+            auto phi = ((idx % width) + rn.x) * 2 * ym::pif / width;
+            auto w = ym::vec3f{std::cos(phi) * std::sin(theta),
+                std::cos(theta), std::sin(phi) * std::sin(theta)};
+            lc.euv = -ym::transform_direction(env->frame, w);
+        } else {
+            auto z = -1 + 2 * rn.y;
+            auto rr = std::sqrt(ym::clamp(1 - z * z, (float)0, (float)1));
+            auto phi = 2 * ym::pif * rn.x;
+            lc.euv = ym::vec3f{std::cos(phi) * rr, z, std::sin(phi) * rr};
+        }
+    } else {
+        assert(false);
+    }
+    return lc;
+}
+
+//
+// Evaluates the point on a light at the given coordinates, as seen from pt.
+//
+static point eval_light_point(
+    const light* lgt, const light_coords& lc, const point& pt) {
+    if (lgt->ist) {
+        auto lpt = eval_shapepoint(lgt->ist, lc.eid, lc.euv, ym::zero3f);
         lpt.wo = ym::normalize(pt.frame.o - lpt.frame.o);
         return lpt;
     } else if (lgt->env) {
-        auto z = -1 + 2 * rn.y;
-        auto rr = std::sqrt(ym::clamp(1 - z * z, (float)0, (float)1));
-        auto phi = 2 * ym::pif * rn.x;
-        auto wo = ym::vec3f{std::cos(phi) * rr, z, std::sin(phi) * rr};
-        auto lpt = eval_envpoint(lgt->env, wo);
-        return lpt;
+        return eval_envpoint(lgt->env, lc.euv);
     } else {
         assert(false);
         return {};
     }
 }
 
+//
+// Picks a point on a light.
+//
+static point sample_light(
+    const light* lgt, const point& pt, float rne, const ym::vec2f& rn) {
+    return eval_light_point(lgt, sample_light_coords(lgt, rne, rn), pt);
+}
+
+//
+// Estimated contribution of a set of lights to a point p with normal n,
+// following Conty and Kulla. The estimate is conservative: it is zero only
+// if no light in the bounds can illuminate the point. Pass a zero normal for
+// points without a preferred orientation.
+//
+static inline float eval_light_importance(
+    const light_bounds& lb, const ym::vec3f& p, const ym::vec3f& n) {
+    // cos(a - b) and sin(a - b) clamped to zero angle
+    auto cos_sub = [](float sin_a, float cos_a, float sin_b, float cos_b) {
+        return (cos_a > cos_b) ? 1 : cos_a * cos_b + sin_a * sin_b;
+    };
+    auto sin_sub = [](float sin_a, float cos_a, float sin_b, float cos_b) {
+        return (cos_a > cos_b) ? 0 : sin_a * cos_b - cos_a * sin_b;
+    };
+    auto safe_sqrt = [](float x) { return std::sqrt(std::max(0.0f, x)); };
+
+    // distance, clamped to avoid singularities close to the lights
+    auto pc = ym::center(lb.bbox);
+    auto radius = ym::length(ym::diagonal(lb.bbox)) / 2;
+    auto dist2 = ym::lengthsqr(p - pc);
+    auto d2 = std::max(dist2, radius);
+    if (d2 <= 0) return 0;
+
+    // angle subtended by the bounding sphere
+    auto cos_theta_b = -1.0f;
+    if (dist2 > radius * radius)
+        cos_theta_b = safe_sqrt(1 - radius * radius / dist2);
+    auto sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+
+    // angle between the normals cone and the direction to p
+    auto wi = (dist2 > 0) ? ym::normalize(p - pc) : ym::vec3f{0, 0, 1};
+    auto cos_theta_w = (lb.cos_theta_o > -1) ? ym::dot(lb.axis, wi) : 1.0f;
+    auto sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+    auto sin_theta_o = safe_sqrt(1 - lb.cos_theta_o * lb.cos_theta_o);
+    auto cos_theta_x =
+        cos_sub(sin_theta_w, cos_theta_w, sin_theta_o, lb.cos_theta_o);
+    auto sin_theta_x =
+        sin_sub(sin_theta_w, cos_theta_w, sin_theta_o, lb.cos_theta_o);
+    auto cos_theta =
+        cos_sub(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+
+    // diffuse emitters do not light past 90 degrees
+    if (cos_theta <= 0) return 0;
+    auto importance = lb.power * cos_theta / d2;
+
+    // cosine at the receiver
+    if (n != ym::zero3f) {
+        auto cos_theta_i = std::abs(ym::dot(wi, n));
+        auto sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+        importance *=
+            cos_sub(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    }
+
+    return std::max(importance, 0.0f);
+}
+
+//
+// Normal used for light selection. Points and lines have no orientation.
+//
+static inline ym::vec3f light_selection_normal(const point& pt) {
+    if (pt.ist && (pt.ist->shp->points || pt.ist->shp->lines))
+        return ym::zero3f;
+    return pt.frame.z;
+}
+
+//
+// Picks a light to sample for the point pt. Environments are chosen
+// uniformly, while shape lights are chosen by walking the light tree
+// proportionally to the estimated contribution of each subtree. Returns the
+// light and the selection weight (the inverse of the selection pdf), or a
+// null light if no light can illuminate the point.
+//
+static std::pair<const light*, float> sample_lights(
+    const scene* scn, const point& pt, float rl) {
+    auto nenvs = (int)scn->env_lights.size();
+    auto ntrees = (scn->light_tree.empty()) ? 0 : 1;
+    if (!nenvs && !ntrees) return {nullptr, 0.0f};
+
+    // environments
+    auto penv = (float)nenvs / (float)(nenvs + ntrees);
+    if (rl < penv) {
+        auto idx = ym::clamp((int)(rl * (nenvs + ntrees)), 0, nenvs - 1);
+        return {scn->env_lights[idx], (float)(nenvs + ntrees)};
+    }
+
+    // shape lights
+    const auto one_minus_eps = 1 - FLT_EPSILON;
+    rl = std::min((rl - penv) / (1 - penv), one_minus_eps);
+    auto weight = 1 / (1 - penv);
+    auto n = light_selection_normal(pt);
+    auto nid = 0;
+    while (scn->light_tree[nid].lid < 0) {
+        auto& node = scn->light_tree[nid];
+        auto il = eval_light_importance(
+            scn->light_tree[node.left].bounds, pt.frame.o, n);
+        auto ir = eval_light_importance(
+            scn->light_tree[node.right].bounds, pt.frame.o, n);
+        if (il <= 0 && ir <= 0) return {nullptr, 0.0f};
+        auto pl = il / (il + ir);
+        if (rl < pl) {
+            nid = node.left;
+            rl = std::min(rl / pl, one_minus_eps);
+            weight /= pl;
+        } else {
+            nid = node.right;
+            rl = std::min((rl - pl) / (1 - pl), one_minus_eps);
+            weight /= 1 - pl;
+        }
+    }
+    if (eval_light_importance(scn->light_tree[nid].bounds, pt.frame.o, n) <= 0)
+        return {nullptr, 0.0f};
+    return {scn->lights[scn->light_tree[nid].lid], weight};
+}
+
+//
+// Selection weight of the light containing lpt, as chosen by sample_lights()
+// for the point pt. Returns 0 if it cannot be selected.
+//
+static float weight_lights(
+    const scene* scn, const point& lpt, const point& pt) {
+    auto nenvs = (int)scn->env_lights.size();
+    auto ntrees = (scn->light_tree.empty()) ? 0 : 1;
+    if (lpt.env) return (nenvs) ? (float)(nenvs + ntrees) : 0;
+    if (!lpt.ist || lpt.ist->light_node < 0) return 0;
+
+    // walk up the tree from the leaf
+    auto weight = (float)(nenvs + ntrees) / (float)ntrees;
+    auto n = light_selection_normal(pt);
+    auto nid = lpt.ist->light_node;
+    if (eval_light_importance(scn->light_tree[nid].bounds, pt.frame.o, n) <= 0)
+        return 0;
+    while (scn->light_tree[nid].parent >= 0) {
+        auto& parent = scn->light_tree[scn->light_tree[nid].parent];
+        auto sid = (parent.left == nid) ? parent.right : parent.left;
+        auto in =
+            eval_light_importance(scn->light_tree[nid].bounds, pt.frame.o, n);
+        auto is =
+            eval_light_importance(scn->light_tree[sid].bounds, pt.frame.o, n);
+        if (in <= 0) return 0;
+        weight *= (in + is) / in;
+        nid = scn->light_tree[nid].parent;
+    }
+    return weight;
+}
+
+//
+// Light sample resampled from the candidates of a camera hit, kept for reuse
+// by the next sample of nearby pixels, with the point it was resampled for.
+//
+struct light_reservoir {
+    const light* lgt = nullptr;   // light, or null if empty
+    light_coords lc;              // point on the light
+    float weight = 0;             // resampling weight of the sample
+    float m = 0;                  // number of candidates resampled
+    ym::vec3f pos = ym::zero3f;   // receiver position
+    ym::vec3f norm = ym::zero3f;  // receiver normal
+};
+
+// Reservoirs of nearby pixels reused for the light sample of a camera hit.
+static const int max_light_reuse = 4;
+
+//
+// Reservoirs reused for the light sample of a camera hit, and the one where
+// the result is stored.
+//
+struct light_reuse {
+    const light_reservoir* reservoirs[max_light_reuse];  // reused reservoirs
+    int nreservoirs = 0;                                 // reused reservoirs
+    light_reservoir* out = nullptr;                      // stored reservoir
+    ym::vec3f cam_pos = ym::zero3f;                      // camera position
+};
+
+//
+// Light sample for a point, with the unshadowed contribution divided by the
+// sampling pdf and the weight of the light sampling technique for MIS.
+//
+struct light_sample {
+    point lpt;                  // light point
+    ym::vec3f ld = ym::zero3f;  // unshadowed contribution over pdf
+    float lw = 0;               // light sampling weight
+};
+
+//
+// Target function of light resampling: the luminance of the unshadowed
+// light contribution.
+//
+static inline float eval_light_target(const point& lpt, const point& pt) {
+    return luminance(eval_emission(lpt) * eval_brdfcos(pt, -lpt.wo));
+}
+
+//
+// Checks whether a reservoir was resampled for a point similar to pt, with
+// normals within 25 degrees and plane distance within 10% of the distance
+// from the camera, as in "Spatiotemporal reservoir resampling for real-time
+// ray tracing with dynamic direct lighting" by Bitterli et al.
+//
+static inline bool is_light_reusable(const light_reservoir& rsv,
+    const point& pt, const ym::vec3f& cam_pos) {
+    if (!rsv.m) return false;
+    if (ym::dot(rsv.norm, pt.frame.z) < 0.9f) return false;
+    return std::abs(ym::dot(pt.frame.z, rsv.pos - pt.frame.o)) <=
+           0.1f * ym::dist(cam_pos, pt.frame.o);
+}
+
+//
+// Checks whether a light point can contribute to the receiver of a reservoir,
+// ignoring occlusion, so that reservoirs that could not have picked it are
+// not counted in its resampling weight.
+//
+static inline bool is_light_reachable(
+    const point& lpt, const light_reservoir& rsv) {
+    auto rpt = lpt;
+    if (!rpt.env) rpt.wo = ym::normalize(rsv.pos - rpt.frame.o);
+    return ym::dot(rsv.norm, -rpt.wo) > 0 && eval_emission(rpt) != ym::zero3f;
+}
+
+//
+// Jacobian of reusing at pt a light point picked for the receiver of a
+// reservoir. Resampling weights are in solid angle at the receiver, so they
+// are converted by the ratio of the light sample weights at the two points,
+// i.e. of the cosine at the light over the squared distance. Environment
+// samples are directions, that are not changed.
+//
+static inline float eval_light_jacobian(
+    const point& lpt, const point& pt, const light_reservoir& rsv) {
+    if (lpt.env) return 1;
+    auto rpt = lpt, rcv = point();
+    rpt.wo = ym::normalize(rsv.pos - rpt.frame.o);
+    rcv.frame.o = rsv.pos;
+    auto w = weight_light(rpt, rcv);
+    return (w > 0) ? weight_light(lpt, pt) / w : 0;
+}
+
+//
+// Samples direct lighting for the point pt. With one light candidate, a light
+// and a point on it are picked as usual. Otherwise, the candidates are
+// resampled with a streaming reservoir proportionally to their unshadowed
+// contribution, so that only one shadow ray is traced. With reuse, the
+// reservoir of the candidates is stored and the reused reservoirs are merged
+// in. The first candidate uses the sampler dimensions, the others its random
+// state, while the choice uses one sampler dimension, rescaled at each step.
+//
+template <rng_type rtype>
+static light_sample sample_direct(const scene* scn, const point& pt,
+    sampler* smp, int ncandidates, light_reuse* reuse) {
+    auto ls = light_sample();
+    auto lgt = sample_lights(scn, pt, sample_next1f<rtype>(smp));
+    auto lrn2 = sample_next2f<rtype>(smp);
+    auto lrn = sample_next1f<rtype>(smp);
+    if (ncandidates <= 1 && !reuse) {
+        if (!lgt.first) return ls;
+        ls.lpt = sample_light(lgt.first, pt, lrn, lrn2);
+        ls.lw = weight_light(ls.lpt, pt) * lgt.second;
+        ls.ld = eval_emission(ls.lpt) * eval_brdfcos(pt, -ls.lpt.wo) * ls.lw;
+        return ls;
+    }
+
+    // resample candidates
+    auto rsv = light_reservoir();
+    auto wsum = 0.0f, target = 0.0f, rsel = sample_next1f<rtype>(smp);
+    auto update = [&rsv, &wsum, &target, &rsel](const light* lgt,
+                      const light_coords& lc, float ltarget, float w) {
+        if (!(w > 0) || !std::isfinite(w)) return;
+        wsum += w;
+        auto prob = w / wsum;
+        if (rsel < prob) {
+            rsv.lgt = lgt;
+            rsv.lc = lc;
+            target = ltarget;
+            rsel = rsel / prob;
+        } else {
+            rsel = (rsel - prob) / (1 - prob);
+        }
+    };
+    ncandidates = std::max(ncandidates, 1);
+    for (auto cid = 0; cid < ncandidates; cid++) {
+        if (cid) {
+            lgt = sample_lights(scn, pt, next1f(&smp->rng));
+            lrn2 = next2f(&smp->rng);
+            lrn = next1f(&smp->rng);
+        }
+        rsv.m += 1;
+        if (!lgt.first) continue;
+        auto lc = sample_light_coords(lgt.first, lrn, lrn2);
+        auto lpt = eval_light_point(lgt.first, lc, pt);
+        auto ltarget = eval_light_target(lpt, pt);
+        update(lgt.first, lc, ltarget,
+            ltarget * weight_light(lpt, pt) * lgt.second);
+    }
+
+    // store the reservoir of the candidates for reuse; merged reservoirs are
+    // not stored, since chaining them across samples correlates whole blocks
+    if (reuse && reuse->out) {
+        auto& out = *reuse->out;
+        out = rsv;
+        out.weight = (wsum > 0 && target > 0) ? wsum / (rsv.m * target) : 0;
+        if (!out.weight) out.lgt = nullptr;
+        out.pos = pt.frame.o;
+        out.norm = pt.frame.z;
+    }
+
+    // merge reused reservoirs, with their samples evaluated at pt and their
+    // weights converted to solid angle at pt
+    const light_reservoir* merged[max_light_reuse];
+    auto nmerged = 0;
+    if (reuse) {
+        for (auto rid = 0; rid < reuse->nreservoirs; rid++) {
+            auto& prev = *reuse->reservoirs[rid];
+            if (!is_light_reusable(prev, pt, reuse->cam_pos)) continue;
+            merged[nmerged++] = &prev;
+            if (!prev.lgt) continue;
+            auto lpt = eval_light_point(prev.lgt, prev.lc, pt);
+            auto ltarget = eval_light_target(lpt, pt);
+            update(prev.lgt, prev.lc, ltarget,
+                ltarget * prev.weight * prev.m *
+                    eval_light_jacobian(lpt, pt, prev));
+        }
+    }
+
+    // resampling weight of the chosen sample, normalized by the candidates
+    // of the reservoirs that could have picked it
+    if (wsum > 0 && target > 0) {
+        ls.lpt = eval_light_point(rsv.lgt, rsv.lc, pt);
+        auto m = (float)ncandidates;
+        for (auto rid = 0; rid < nmerged; rid++) {
+            if (is_light_reachable(ls.lpt, *merged[rid])) m += merged[rid]->m;
+        }
+        ls.lw = weight_light(ls.lpt, pt) * weight_lights(scn, ls.lpt, pt);
+        ls.ld = eval_emission(ls.lpt) * eval_brdfcos(pt, -ls.lpt.wo) * wsum /
+                (m * target);
+    }
+    return ls;
+}
+
 //
 // Offsets a ray origin to avoid self-intersection.
 //
@@ -2127,15 +3909,52 @@ static inline ym::ray3f offset_ray(
     }
 }
 
+//
+// Ray cone after scattering at a point. Mirror-like lobes keep the spread,
+// while rough lobes widen it by about their angular width. The sharpest lobe
+// is used, so that textures are not blurred more than what it would see.
+//
+static inline ray_cone eval_scattered_cone(const point& pt) {
+    auto roughness = 1.0f;
+    for (auto lid = 0; lid < pt.nbrdfs; lid++) {
+        switch (pt.brdfs[lid].type) {
+            case brdf_type::reflection_ggx:
+            case brdf_type::transmission_ggx:
+            case brdf_type::refraction_ggx:
+                roughness = std::min(roughness, pt.brdfs[lid].roughness);
+                break;
+            case brdf_type::transparent: roughness = 0; break;
+            default: break;
+        }
+    }
+    return {pt.cone.width, pt.cone.spread + roughness};
+}
+
 //
 // Intersects a ray with the scn and return the point (or env point).
+// The internal bvh is called directly, avoiding both the callback and the
+// copy of the intersection record; callbacks are used for custom engines.
+// The ray cone is carried to the hit point for texture filtering.
 //
-static point intersect_scene(const scene* scn, const ym::ray3f& ray) {
-    auto isec = scn->intersect_first(ray);
-    if (isec) {
-        return eval_shapepoint(
-            scn->instances[isec.iid], isec.eid, isec.euv, -ray.d);
-    } else if (!scn->environments.empty()) {
+static point intersect_scene(
+    const scene* scn, const ym::ray3f& ray, const ray_cone& cone = {}) {
+#ifndef YTRACE_NO_BVH
+    if (scn->intersect_bvh) {
+        auto isec = ybvh::intersect_scene(scn->intersect_bvh, ray, false);
+        if (isec)
+            return eval_shapepoint(scn->instances[isec.iid], isec.eid,
+                isec.euv.xyz(), -ray.d,
+                {cone.width + cone.spread * isec.dist, cone.spread});
+    } else
+#endif
+    {
+        auto isec = scn->intersect_first(ray);
+        if (isec)
+            return eval_shapepoint(scn->instances[isec.iid], isec.eid,
+                isec.euv, -ray.d,
+                {cone.width + cone.spread * isec.dist, cone.spread});
+    }
+    if (!scn->environments.empty()) {
         return eval_envpoint(scn->environments[0], -ray.d);
     } else {
         return {};
@@ -2143,39 +3962,170 @@ static point intersect_scene(const scene* scn, const ym::ray3f& ray) {
 }
 
 //
-// Transparecy
+// Intersects a ray with the scene, returning only the hit record, so that
+// hits can be reordered before their points are evaluated.
 //
-static ym::vec3f eval_transparency(const point& pt) {
-    auto kt = ym::zero3f;
-    for (auto lid = 0; lid < pt.nbrdfs; lid++) {
-        auto brdf = pt.brdfs[lid];
-        switch (brdf.type) {
-            case brdf_type::transparent:
-            case brdf_type::refraction_ggx: kt += brdf.rho; break;
-            default: break;
-        }
+static intersect_point intersect_scene_hit(
+    const scene* scn, const ym::ray3f& ray) {
+#ifndef YTRACE_NO_BVH
+    if (scn->intersect_bvh) {
+        auto isec = ybvh::intersect_scene(scn->intersect_bvh, ray, false);
+        auto hit = intersect_point();
+        if (!isec) return hit;
+        hit.dist = isec.dist;
+        hit.iid = isec.iid;
+        hit.sid = isec.sid;
+        hit.eid = isec.eid;
+        hit.euv = isec.euv.xyz();
+        return hit;
     }
-    return kt;
+#endif
+    return scn->intersect_first(ray);
 }
 
 //
-// Test occlusion
+// Evaluates the point of a hit record, or the environment if there is no
+// hit. The ray cone is carried to the hit point as in intersect_scene().
 //
-static ym::vec3f eval_transmission(const scene* scn, const point& pt,
-    const point& lpt, const trace_params& params) {
-    if (scn->shadow_transmission) {
-        auto cpt = pt;
-        auto weight = ym::vec3f{1, 1, 1};
-        for (auto bounce = 0; bounce < params.max_depth; bounce++) {
-            cpt = intersect_scene(scn, offset_ray(cpt, lpt, params));
-            if (!cpt.ist) break;
-            weight *= eval_transparency(cpt);
+static point eval_hitpoint(const scene* scn, const intersect_point& hit,
+    const ym::ray3f& ray, const ray_cone& cone) {
+    if (hit)
+        return eval_shapepoint(scn->instances[hit.iid], hit.eid, hit.euv,
+            -ray.d, {cone.width + cone.spread * hit.dist, cone.spread});
+    if (!scn->environments.empty()) {
+        return eval_envpoint(scn->environments[0], -ray.d);
+    } else {
+        return {};
+    }
+}
+
+//
+// Tests whether a ray hits anything in the scene. See above.
+//
+static inline bool intersect_scene_any(
+    const scene* scn, const ym::ray3f& ray) {
+#ifndef YTRACE_NO_BVH
+    if (scn->intersect_bvh)
+        return (bool)ybvh::intersect_scene(scn->intersect_bvh, ray, true);
+#endif
+    return scn->intersect_any(ray);
+}
+
+//
+// Transmission through a shape element, evaluating only opacity and
+// transmission textures instead of the whole point. Matches the transparency
+// of the point returned by eval_shapepoint() without texture filtering.
+//
+static ym::vec3f eval_element_transmission(
+    const instance* ist, int eid, const ym::vec3f& euv) {
+    auto shp = ist->shp;
+    auto mat = ist->mat;
+
+    // interpolate only what is needed
+    auto texcoord = ym::zero2f;
+    auto kx_scale = ym::vec4f{1, 1, 1, 1};
+    if (shp->points) {
+        texcoord = interpolate_point(shp->texcoord, shp->points, eid, euv);
+        if (shp->color)
+            kx_scale = interpolate_point(shp->color, shp->points, eid, euv);
+    } else if (shp->lines) {
+        texcoord = interpolate_line(shp->texcoord, shp->lines, eid, euv);
+        if (shp->color)
+            kx_scale = interpolate_line(shp->color, shp->lines, eid, euv);
+    } else if (shp->triangles) {
+        texcoord =
+            interpolate_triangle(shp->texcoord, shp->triangles, eid, euv);
+        if (shp->color)
+            kx_scale =
+                interpolate_triangle(shp->color, shp->triangles, eid, euv);
+    }
+    if (shp->texcoord && mat->occ_txt)
+        kx_scale.xyz() *= eval_texture(mat->occ_txt, texcoord, 0).xyz();
+
+    // opacity and transmission
+    auto op = kx_scale.w;
+    auto kt = ym::zero3f;
+    switch (mat->rtype) {
+        case reflectance_type::none: op = 1; break;
+        case reflectance_type::matte: {
+            op *= mat->matte.op;
+            if (shp->texcoord && mat->matte.kd_txt)
+                op *= eval_texture(mat->matte.kd_txt, texcoord, 0).w;
+            if (shp->texcoord && mat->matte.op_txt)
+                op *= eval_texture(mat->matte.op_txt, texcoord, 0).x;
+        } break;
+        case reflectance_type::microfacet: {
+            op *= mat->microfacet.op;
+            if (shp->texcoord && mat->microfacet.kd_txt)
+                op *= eval_texture(mat->microfacet.kd_txt, texcoord, 0).w;
+            if (shp->texcoord && mat->microfacet.op_txt)
+                op *= eval_texture(mat->microfacet.op_txt, texcoord, 0).x;
+            kt = mat->microfacet.kt * kx_scale.xyz();
+            if (shp->texcoord && mat->microfacet.kt_txt)
+                kt *= eval_texture(mat->microfacet.kt_txt, texcoord, 0).xyz();
+        } break;
+        case reflectance_type::gltf_metallic_roughness: {
+            op *= mat->metalrough.op;
+            if (shp->texcoord && mat->metalrough.kb_txt)
+                op *= eval_texture(mat->metalrough.kb_txt, texcoord, 0).w;
+        } break;
+        case reflectance_type::gltf_specular_glossiness: {
+            op *= mat->specgloss.op;
+            if (shp->texcoord && mat->specgloss.kd_txt)
+                op *= eval_texture(mat->specgloss.kd_txt, texcoord, 0).w;
+        } break;
+        case reflectance_type::thin_glass: {
+            op = 1;
+            kt = mat->thin_glass.kt * kx_scale.xyz();
+            if (shp->texcoord && mat->thin_glass.kt_txt)
+                kt *= eval_texture(mat->thin_glass.kt_txt, texcoord, 0).xyz();
+        } break;
+    }
+
+    if (op >= 1) return kt;
+    return kt * op + ym::vec3f{1 - op, 1 - op, 1 - op};
+}
+
+//
+// Test occlusion. With transparent surfaces, the internal bvh filters hits
+// during a single traversal, accumulating the transmission of non-opaque
+// instances and stopping at the first opaque one. Callbacks fall back to
+// tracing the same shadow ray again past each transparent hit, up to the
+// light.
+//
+static ym::vec3f eval_transmission(const scene* scn, const point& pt,
+    const point& lpt, const trace_params& params) {
+#ifndef YTRACE_NO_BVH
+    if (scn->shadow_transmission && scn->intersect_bvh) {
+        auto weight = ym::vec3f{1, 1, 1};
+        auto isec = ybvh::intersect_scene(scn->intersect_bvh,
+            offset_ray(pt, lpt, params), true,
+            [scn, &weight](const ybvh::intersection_point& isec) {
+                auto ist = scn->instances[isec.iid];
+                if (ist->mat->is_opaque()) return true;
+                weight *= eval_element_transmission(
+                    ist, isec.eid, isec.euv.xyz());
+                return weight == ym::zero3f;
+            });
+        return (isec) ? ym::zero3f : weight;
+    }
+#endif
+    if (scn->shadow_transmission) {
+        auto ray = offset_ray(pt, lpt, params);
+        auto weight = ym::vec3f{1, 1, 1};
+        for (auto bounce = 0; bounce < params.max_depth; bounce++) {
+            auto hit = intersect_scene_hit(scn, ray);
+            if (!hit) break;
+            auto ist = scn->instances[hit.iid];
+            if (ist->mat->is_opaque()) return ym::zero3f;
+            weight *= eval_element_transmission(ist, hit.eid, hit.euv);
             if (weight == ym::zero3f) break;
+            ray.tmin = hit.dist + params.ray_eps;
         }
         return weight;
     } else {
         auto shadow_ray = offset_ray(pt, lpt, params);
-        return (scn->intersect_any(shadow_ray)) ? ym::zero3f :
+        return (intersect_scene_any(scn, shadow_ray)) ? ym::zero3f :
                                                   ym::vec3f{1, 1, 1};
     }
 }
@@ -2189,10 +4139,563 @@ static inline float weight_mis(float w0, float w1) {
 }
 
 //
-// Recursive path tracing.
+// Float that many threads add to at once. Copies are plain values.
+//
+struct atomic_float {
+    std::atomic<float> val;
+
+    atomic_float(float v = 0) : val(v) {}
+    atomic_float(const atomic_float& v) : val(v.load()) {}
+    atomic_float& operator=(const atomic_float& v) {
+        val.store(v.load(), std::memory_order_relaxed);
+        return *this;
+    }
+    float load() const { return val.load(std::memory_order_relaxed); }
+    void add(float v) {
+        auto cur = load();
+        while (!val.compare_exchange_weak(
+            cur, cur + v, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+//
+// Node of a directional quadtree over the unit square, with directions
+// mapped by cylindrical coordinates that preserve areas. Quadrants are
+// indexed by x + 2 y.
+//
+struct guide_dnode {
+    atomic_float sum[4];          // radiance recorded in each quadrant
+    int child[4] = {0, 0, 0, 0};  // child of each quadrant, or 0 for leaves
+};
+
+//
+// Directional distribution of the radiance arriving in a spatial cell, as a
+// quadtree with the root first.
+//
+struct guide_dtree {
+    std::vector<guide_dnode> nodes = std::vector<guide_dnode>(1);  // nodes
+    atomic_float nrecords;  // number of path vertices recorded
+};
+
+//
+// Node of the spatial binary tree of a path guide. Children split the box of
+// their parent in half, along axes that cycle with depth.
+//
+struct guide_snode {
+    int child = 0;  // first of the two children, or 0 for leaves
+    int cell = 0;   // cell index [leaf nodes]
+};
+
+//
+// Path guide, a spatial binary tree over the scene with a directional
+// quadtree in each leaf cell, learned from path contributions following
+// "Practical Path Guiding for Efficient Light-Transport Simulation" by
+// Muller et al. Training runs in passes that double in samples. During a
+// pass, paths sample the distributions learned in the previous one and
+// record into the others with atomic adds, so that blocks are traced in
+// parallel. Trees are refined between passes, within a memory cap.
+//
+struct path_guide {
+    ym::bbox3f bbox = ym::invalid_bbox3f;  // cubic scene bounds
+    std::vector<guide_snode> snodes;       // spatial tree, root first
+    std::vector<guide_dtree> sampling;     // sampled distribution of cells
+    std::vector<guide_dtree> building;     // recorded distribution of cells
+    int pass = 0;                          // training pass
+    int pass_end = 1;                      // sample that ends the pass
+    size_t max_nodes = 0;                  // quadtree node cap of all cells
+};
+
+// Fraction of directions sampled from the brdf at guided points.
+static const float guide_brdf_fraction = 0.5f;
+// Records in a cell before it splits, scaled by the square root of the
+// samples in the pass. This is lower than in the paper, so that cells split
+// at preview resolutions too.
+static const float guide_spatial_threshold = 4000;
+// Fraction of the radiance of a quadtree over which a quadrant splits.
+static const float guide_directional_threshold = 0.01f;
+// Maximum quadtree depth.
+static const int guide_max_depth = 20;
+// Quadtree nodes that each cell can keep at the cell cap.
+static const int guide_min_cell_nodes = 64;
+// Path vertices recorded for each path.
+static const int guide_max_vertices = 16;
+
+//
+// Maps a direction to the unit square of the directional quadtrees.
+//
+static inline ym::vec2f guide_dir_to_square(const ym::vec3f& w) {
+    auto phi = std::atan2(w.y, w.x);
+    if (phi < 0) phi += 2 * ym::pif;
+    return {ym::clamp((w.z + 1) / 2, 0.0f, 1.0f),
+        ym::clamp(phi / (2 * ym::pif), 0.0f, 1.0f)};
+}
+
+//
+// Maps a point of the unit square to a direction. See above.
+//
+static inline ym::vec3f guide_square_to_dir(const ym::vec2f& uv) {
+    auto cos_theta = 2 * uv.x - 1;
+    auto sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+    auto phi = 2 * ym::pif * uv.y;
+    return {sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta};
+}
+
+//
+// Sum of the radiance recorded in a directional quadtree.
+//
+static inline float eval_guide_total(const guide_dtree& dt) {
+    auto& root = dt.nodes[0];
+    return root.sum[0].load() + root.sum[1].load() + root.sum[2].load() +
+           root.sum[3].load();
+}
+
+//
+// Evaluates the probability of sampling the direction w from a directional
+// quadtree, as solid angle density.
+//
+static float pdf_guide(const guide_dtree& dt, const ym::vec3f& w) {
+    auto uv = guide_dir_to_square(w);
+    auto pdf = 1 / (4 * ym::pif);
+    auto nid = 0;
+    while (true) {
+        auto& node = dt.nodes[nid];
+        auto total = node.sum[0].load() + node.sum[1].load() +
+                     node.sum[2].load() + node.sum[3].load();
+        if (total <= 0) return 0;
+        auto qx = (uv.x < 0.5f) ? 0 : 1, qy = (uv.y < 0.5f) ? 0 : 1;
+        auto q = qx + 2 * qy;
+        pdf *= 4 * node.sum[q].load() / total;
+        if (!node.child[q]) return pdf;
+        uv = {uv.x * 2 - qx, uv.y * 2 - qy};
+        nid = node.child[q];
+    }
+}
+
+//
+// Picks a direction from a directional quadtree, proportionally to the
+// recorded radiance. The random numbers are reused at each level.
+//
+static ym::vec3f sample_guide(const guide_dtree& dt, const ym::vec2f& rn_) {
+    auto rn = rn_;
+    auto origin = ym::zero2f;
+    auto size = 1.0f;
+    auto nid = 0;
+    // pick a half with probability p, rescaling r
+    auto pick = [](float p, float& r) {
+        if (r < p) {
+            r = std::min(r / p, 1.0f);
+            return 0;
+        }
+        r = std::min((r - p) / (1 - p), 1.0f);
+        return 1;
+    };
+    while (true) {
+        auto& node = dt.nodes[nid];
+        float s[4] = {node.sum[0].load(), node.sum[1].load(),
+            node.sum[2].load(), node.sum[3].load()};
+        auto qx = pick((s[0] + s[2]) / (s[0] + s[1] + s[2] + s[3]), rn.x);
+        auto qy = pick(s[qx] / (s[qx] + s[qx + 2]), rn.y);
+        auto q = qx + 2 * qy;
+        size /= 2;
+        origin += ym::vec2f{qx * size, qy * size};
+        if (!node.child[q]) break;
+        nid = node.child[q];
+    }
+    return guide_square_to_dir(origin + rn * size);
+}
+
+//
+// Records the radiance value arriving from w in a directional quadtree,
+// adding it to all quadrants that contain w.
+//
+static void record_guide(guide_dtree& dt, const ym::vec3f& w, float value) {
+    dt.nrecords.add(1);
+    if (!(value > 0) || !std::isfinite(value)) return;
+    auto uv = guide_dir_to_square(w);
+    auto nid = 0;
+    while (true) {
+        auto& node = dt.nodes[nid];
+        auto qx = (uv.x < 0.5f) ? 0 : 1, qy = (uv.y < 0.5f) ? 0 : 1;
+        auto q = qx + 2 * qy;
+        node.sum[q].add(value);
+        if (!node.child[q]) return;
+        uv = {uv.x * 2 - qx, uv.y * 2 - qy};
+        nid = node.child[q];
+    }
+}
+
+//
+// Finds the cell of the guide that contains the point p.
+//
+static int lookup_guide_cell(const path_guide* guide, const ym::vec3f& p) {
+    auto size = ym::diagonal(guide->bbox);
+    auto uvw = ym::vec3f{(p.x - guide->bbox.min.x) / size.x,
+        (p.y - guide->bbox.min.y) / size.y, (p.z - guide->bbox.min.z) / size.z};
+    uvw = {ym::clamp(uvw.x, 0.0f, 1.0f), ym::clamp(uvw.y, 0.0f, 1.0f),
+        ym::clamp(uvw.z, 0.0f, 1.0f)};
+    auto nid = 0, axis = 0;
+    while (guide->snodes[nid].child) {
+        auto half = (uvw[axis] < 0.5f) ? 0 : 1;
+        uvw[axis] = uvw[axis] * 2 - half;
+        nid = guide->snodes[nid].child + half;
+        axis = (axis + 1) % 3;
+    }
+    return guide->snodes[nid].cell;
+}
+
+//
+// Creates a path guide over the scene bounds. The bounds are made cubic, so
+// that cells keep their shape as they split.
+//
+static path_guide* make_guide(const scene* scn, int memory) {
+    auto guide = new path_guide();
+    auto bbox = ym::invalid_bbox3f;
+    for (auto ist : scn->instances) {
+        for (auto vid = 0; vid < ist->shp->nverts; vid++)
+            bbox += ym::transform_point(ist->frame, ist->shp->pos[vid]);
+    }
+    if (bbox.min.x > bbox.max.x) bbox = {{-1, -1, -1}, {1, 1, 1}};
+    auto center = ym::center(bbox);
+    auto radius = ym::max_element_val(ym::diagonal(bbox)) / 2 * 1.01f + 1e-4f;
+    guide->bbox = {center - ym::vec3f{radius, radius, radius},
+        center + ym::vec3f{radius, radius, radius}};
+    guide->snodes.push_back(guide_snode());
+    guide->sampling.push_back(guide_dtree());
+    guide->building.push_back(guide_dtree());
+    guide->max_nodes = std::max(
+        (size_t)memory * 1024 * 1024 / sizeof(guide_dnode), (size_t)2);
+    return guide;
+}
+
+//
+// Builds in dst a quadtree that splits the quadrants of src holding a large
+// fraction of its radiance, with no radiance recorded. Quadrants that are
+// leaves in src are split as if their radiance was uniform.
+//
+static void refine_guide_dtree(
+    const guide_dtree& src, guide_dtree& dst, size_t max_nodes) {
+    dst = guide_dtree();
+    auto total = eval_guide_total(src);
+    if (!(total > 0) || !std::isfinite(total)) return;
+    // src node, or -1 if uniform, dst node, depth and radiance fraction
+    struct item {
+        int src, dst, depth;
+        float fraction;
+    };
+    auto stack = std::vector<item>{{0, 0, 1, 1}};
+    while (!stack.empty()) {
+        auto it = stack.back();
+        stack.pop_back();
+        for (auto q = 0; q < 4; q++) {
+            auto fraction = (it.src >= 0) ?
+                                src.nodes[it.src].sum[q].load() / total :
+                                it.fraction / 4;
+            if (fraction <= guide_directional_threshold) continue;
+            if (it.depth >= guide_max_depth) continue;
+            if (dst.nodes.size() >= max_nodes) continue;
+            auto child = (int)dst.nodes.size();
+            dst.nodes.push_back(guide_dnode());
+            dst.nodes[it.dst].child[q] = child;
+            auto src_child = (it.src >= 0) ? src.nodes[it.src].child[q] : 0;
+            stack.push_back(
+                {(src_child) ? src_child : -1, child, it.depth + 1, fraction});
+        }
+    }
+}
+
 //
+// Refines the guide at the end of a training pass. Cells with many records
+// are split in half, copying their distribution, and the recorded
+// distributions become the sampled ones, while the recording restarts in
+// quadtrees refined where radiance was found. Recorded nodes, with the copies
+// of split cells, stay within half the node cap, and the previous sampled
+// distributions are freed before the new quadtrees are built, so that the
+// guide never holds more than the cap.
+//
+static void refine_guide(path_guide* guide) {
+    auto threshold =
+        guide_spatial_threshold * std::sqrt((float)(1 << guide->pass));
+    auto max_cells =
+        std::max(guide->max_nodes / (2 * guide_min_cell_nodes), (size_t)1);
+    auto nnodes = (size_t)0;
+    for (auto& dt : guide->building) nnodes += dt.nodes.size();
+    for (auto nid = 0; nid < (int)guide->snodes.size(); nid++) {
+        if (guide->snodes[nid].child) continue;
+        auto cell = guide->snodes[nid].cell;
+        if (guide->building[cell].nrecords.load() <= threshold) continue;
+        if (guide->building.size() >= max_cells) break;
+        auto cell_nodes = guide->building[cell].nodes.size();
+        if (nnodes + cell_nodes > guide->max_nodes / 2) continue;
+        nnodes += cell_nodes;
+        auto half = guide->building[cell].nrecords.load() / 2;
+        guide->building[cell].nrecords = half;
+        auto child = (int)guide->snodes.size();
+        guide->snodes[nid].child = child;
+        auto left = guide_snode(), right = guide_snode();
+        left.cell = cell;
+        right.cell = (int)guide->building.size();
+        guide->snodes.push_back(left);
+        guide->snodes.push_back(right);
+        auto copy = guide->building[cell];
+        guide->building.push_back(copy);
+    }
+    auto ncells = guide->building.size();
+    auto max_nodes = std::max(guide->max_nodes / (2 * ncells), (size_t)1);
+    guide->sampling = std::move(guide->building);
+    guide->building = std::vector<guide_dtree>(ncells);
+    for (auto cell = 0; cell < (int)ncells; cell++) {
+        refine_guide_dtree(
+            guide->sampling[cell], guide->building[cell], max_nodes);
+    }
+}
+
+//
+// Ends a training pass of the guide after the sample cur_sample, starting the
+// next one with twice the samples.
+//
+static void end_guide_pass(path_guide* guide, int cur_sample) {
+    refine_guide(guide);
+    guide->pass = std::min(guide->pass + 1, 24);
+    guide->pass_end = cur_sample + (1 << guide->pass);
+}
+
+//
+// Checks whether directions at the point can be guided. Transparent lobes
+// pass straight through and cannot be mixed with guided directions.
+//
+static inline bool is_guidable(const point& pt) {
+    for (auto lid = 0; lid < pt.nbrdfs; lid++)
+        if (pt.brdfs[lid].type == brdf_type::transparent) return false;
+    return true;
+}
+
+//
+// Computes the weight for sampling the mixture of the brdf and the guide
+// distribution dt, or the brdf alone if dt is null.
+//
+static inline float weight_guided(
+    const point& pt, const guide_dtree* dt, const ym::vec3f& wi) {
+    auto bw = weight_brdfcos(pt, wi);
+    if (!dt) return bw;
+    auto pdf = guide_brdf_fraction * ((bw) ? 1 / bw : 0) +
+               (1 - guide_brdf_fraction) * pdf_guide(*dt, wi);
+    return (pdf) ? 1 / pdf : 0;
+}
+
+//
+// Picks a direction from the mixture of the brdf and the guide distribution
+// dt, or from the brdf alone if dt is null. The lobe random number also
+// picks the mixture component.
+//
+static inline ym::vec3f sample_guided(const point& pt, const guide_dtree* dt,
+    float rnl, const ym::vec2f& rn) {
+    if (!dt) return sample_brdfcos(pt, rnl, rn);
+    if (rnl < guide_brdf_fraction)
+        return sample_brdfcos(pt, rnl / guide_brdf_fraction, rn);
+    return sample_guide(*dt, rn);
+}
+
+//
+// Path vertex recorded in the guide at the end of the path, with the
+// radiance arriving along the sampled direction.
+//
+struct guide_vertex {
+    int cell = 0;                   // guide cell
+    ym::vec3f wi = ym::zero3f;      // sampled direction
+    float bw = 0;                   // sampling weight of wi
+    ym::vec3f weight = ym::zero3f;  // path weight after the vertex
+    ym::vec3f li = ym::zero3f;      // radiance arriving from wi
+};
+
+//
+// Adds the path contribution l to the radiance arriving at the vertices,
+// dividing out their path weights.
+//
+static inline void accumulate_guide_vertices(
+    guide_vertex* gvs, int ngvs, const ym::vec3f& l) {
+    for (auto vid = 0; vid < ngvs; vid++) {
+        auto& w = gvs[vid].weight;
+        gvs[vid].li += ym::vec3f{(w.x) ? l.x / w.x : 0, (w.y) ? l.y / w.y : 0,
+            (w.z) ? l.z / w.z : 0};
+    }
+}
+
+//
+// Radiance cache cell, with the radiance reflected by the points recorded in
+// it. The key is 0 while the cell is unused.
+//
+struct radiance_cell {
+    std::atomic<uint64_t> key = {0};  // cell coordinates and normal axis
+    atomic_float sum[3];              // sum of the recorded radiance
+    atomic_float count;               // number of records
+};
+
+//
+// Radiance cache, a hash table of the cells of a uniform grid over the scene,
+// split by the dominant axis of the normal, that holds the radiance reflected
+// by diffuse points. The first samples fill the cache with atomic adds, so
+// that blocks are traced in parallel. Later paths end into it at diffuse
+// points after a diffuse bounce, or when their footprint covers a cell.
+//
+struct radiance_cache {
+    float cell_size = 1;               // grid cell size
+    std::vector<radiance_cell> cells;  // hash table, sized to a power of two
+    int fill_end = 0;                  // sample that ends the filling
+    bool filling = true;               // whether paths record or end into it
+};
+
+// Records in a cell before paths end into it.
+static const int radiance_cache_min_records = 8;
+// Cells probed for a key before giving up.
+static const int radiance_cache_max_probes = 8;
+// Lowest roughness of the glossy lobes of cached points.
+static const float radiance_cache_min_roughness = 0.3f;
+// Path vertices recorded for each path.
+static const int radiance_cache_max_vertices = 16;
+
+//
+// Creates a radiance cache with cells of size cell times the scene size,
+// within the memory cap, filled by the first nsamples samples.
+//
+static radiance_cache* make_radiance_cache(
+    const scene* scn, float cell, int memory, int nsamples) {
+    auto cache = new radiance_cache();
+    auto bbox = ym::invalid_bbox3f;
+    for (auto ist : scn->instances) {
+        for (auto vid = 0; vid < ist->shp->nverts; vid++)
+            bbox += ym::transform_point(ist->frame, ist->shp->pos[vid]);
+    }
+    auto size = (bbox.min.x <= bbox.max.x) ? ym::length(ym::diagonal(bbox)) : 1;
+    cache->cell_size = std::max(size * cell, 1e-6f);
+    auto ncells = (size_t)1024;
+    while (ncells * 2 * sizeof(radiance_cell) <= (size_t)memory * 1024 * 1024)
+        ncells *= 2;
+    cache->cells = std::vector<radiance_cell>(ncells);
+    cache->fill_end = nsamples;
+    cache->filling = nsamples > 0;
+    return cache;
+}
+
+//
+// Checks whether the light reflected at the point can be cached, as it
+// changes slowly with the view direction.
+//
+static inline bool is_radiance_cacheable(const point& pt) {
+    if (pt.no_reflectance()) return false;
+    for (auto lid = 0; lid < pt.nbrdfs; lid++) {
+        auto& brdf = pt.brdfs[lid];
+        if (brdf.type == brdf_type::reflection_lambert) continue;
+        if (brdf.type == brdf_type::reflection_ggx &&
+            brdf.roughness >= radiance_cache_min_roughness)
+            continue;
+        return false;
+    }
+    return true;
+}
+
+//
+// Computes the key of the cell containing the point, from 20 bits for each
+// grid coordinate and 3 for the normal axis and sign, with the top bit set
+// so that keys are not 0.
+//
+static inline uint64_t eval_radiance_key(
+    const radiance_cache* cache, const point& pt) {
+    auto key = (uint64_t)1 << 63;
+    for (auto axis = 0; axis < 3; axis++) {
+        auto coord = (int64_t)std::floor(pt.frame.o[axis] / cache->cell_size);
+        key |= (uint64_t)(coord & 0xfffff) << (20 * axis);
+    }
+    auto n = pt.frame.z;
+    auto axis = (std::abs(n.x) > std::abs(n.y)) ?
+                    ((std::abs(n.x) > std::abs(n.z)) ? 0 : 2) :
+                    ((std::abs(n.y) > std::abs(n.z)) ? 1 : 2);
+    return key | (uint64_t)(axis * 2 + ((n[axis] < 0) ? 1 : 0)) << 60;
+}
+
+//
+// Finds the cell with the given key with linear probing, adding it if
+// requested. Returns null if not found or if the table is too full.
+//
+static radiance_cell* find_radiance_cell(
+    radiance_cache* cache, uint64_t key, bool add) {
+    auto mask = cache->cells.size() - 1;
+    auto idx = (size_t)ym::hash_uint64(key);
+    for (auto probe = 0; probe < radiance_cache_max_probes; probe++) {
+        auto& cell = cache->cells[(idx + probe) & mask];
+        auto cur = cell.key.load(std::memory_order_relaxed);
+        if (cur == key) return &cell;
+        if (cur) continue;
+        if (!add) return nullptr;
+        if (cell.key.compare_exchange_strong(cur, key)) return &cell;
+        if (cur == key) return &cell;
+    }
+    return nullptr;
+}
+
+//
+// Records the radiance reflected by a point in the cell with the given key.
+//
+static void record_radiance(
+    radiance_cache* cache, uint64_t key, const ym::vec3f& l) {
+    if (!ym::isfinite(l)) return;
+    auto cell = find_radiance_cell(cache, key, true);
+    if (!cell) return;
+    for (auto c = 0; c < 3; c++) cell->sum[c].add(l[c]);
+    cell->count.add(1);
+}
+
+//
+// Looks up the radiance reflected by the points of the cell with the given
+// key. Returns false if the cell has too few records.
+//
+static bool lookup_radiance(
+    radiance_cache* cache, uint64_t key, ym::vec3f& l) {
+    auto cell = find_radiance_cell(cache, key, false);
+    if (!cell) return false;
+    auto count = cell->count.load();
+    if (count < radiance_cache_min_records) return false;
+    l = ym::vec3f{cell->sum[0].load(), cell->sum[1].load(),
+            cell->sum[2].load()} /
+        count;
+    return true;
+}
+
+//
+// Path vertex recorded in the radiance cache at the end of the path, with
+// the radiance reflected toward the previous vertex.
+//
+struct radiance_vertex {
+    uint64_t key = 0;               // radiance cache cell
+    ym::vec3f weight = ym::zero3f;  // path weight before the vertex
+    ym::vec3f lr = ym::zero3f;      // reflected radiance
+};
+
+//
+// Adds the path contribution l to the radiance reflected at the vertices,
+// dividing out their path weights.
+//
+static inline void accumulate_radiance_vertices(
+    radiance_vertex* rvs, int nrvs, const ym::vec3f& l) {
+    for (auto vid = 0; vid < nrvs; vid++) {
+        auto& w = rvs[vid].weight;
+        rvs[vid].lr += ym::vec3f{(w.x) ? l.x / w.x : 0, (w.y) ? l.y / w.y : 0,
+            (w.z) ? l.z / w.z : 0};
+    }
+}
+
+//
+// Recursive path tracing. With a guide, directions are sampled from the
+// mixture of the brdf and the guide distribution of the point cell, and path
+// vertices are recorded in the guide when the path ends. The light sample of
+// the first point is resampled from the light candidates and reused
+// reservoirs. With a radiance cache, diffuse vertices are recorded while it
+// fills, and paths end into it afterwards.
+//
+template <rng_type rtype>
 static ym::vec3f shade_pathtrace(const scene* scn, const point& pt_,
-    sampler* smp, const trace_params& params) {
+    sampler* smp, const trace_params& params, path_guide* guide,
+    light_reuse* reuse, radiance_cache* cache) {
     // make a copy
     auto pt = pt_;
 
@@ -2200,37 +4703,92 @@ static ym::vec3f shade_pathtrace(const scene* scn, const point& pt_,
     auto l = eval_emission(pt);
     if (pt.no_reflectance() || scn->lights.empty()) return l;
 
+    // path vertices to record in the guide and in the radiance cache
+    guide_vertex gvs[guide_max_vertices];
+    auto ngvs = 0;
+    radiance_vertex rvs[radiance_cache_max_vertices];
+    auto nrvs = 0;
+
     // trace path
     auto weight = ym::vec3f{1, 1, 1};
     auto emission = false;
+    auto diffuse = false;
     for (auto bounce = 0; bounce < params.max_depth; bounce++) {
         // emission
         if (emission) l += weight * eval_emission(pt);
 
+        // end into the radiance cache after a diffuse bounce, or when the
+        // path footprint covers a cell; while filling, record the first two
+        // vertices instead, as later ones miss the bounces cut by max_depth
+        auto cacheable = cache && is_radiance_cacheable(pt);
+        auto rkey = (cacheable) ? eval_radiance_key(cache, pt) : 0;
+        if (cacheable && !cache->filling && bounce &&
+            (diffuse || pt.cone.width >= cache->cell_size)) {
+            auto lr = ym::zero3f;
+            if (lookup_radiance(cache, rkey, lr)) {
+                l += weight * lr;
+                accumulate_guide_vertices(gvs, ngvs, weight * lr);
+                break;
+            }
+        }
+        if (cacheable && cache->filling && bounce <= 1 &&
+            nrvs < radiance_cache_max_vertices) {
+            auto& rv = rvs[nrvs++];
+            rv.key = rkey;
+            rv.weight = weight;
+            rv.lr = ym::zero3f;
+        }
+        diffuse = cacheable;
+
+        // guide distribution, if any radiance was learned in the cell
+        auto gcell = (guide && is_guidable(pt)) ?
+                         lookup_guide_cell(guide, pt.frame.o) :
+                         -1;
+        auto gdt = (gcell >= 0) ? &guide->sampling[gcell] : nullptr;
+        if (gdt && !(eval_guide_total(*gdt) > 0)) gdt = nullptr;
+
         // direct – light
-        auto lgt = scn->lights[sample_next1i(smp, (int)scn->lights.size())];
-        auto lpt =
-            sample_light(lgt, pt, sample_next1f(smp), sample_next2f(smp));
-        auto lw = weight_light(lpt, pt) * (float)scn->lights.size();
-        auto lke = eval_emission(lpt);
-        auto lbc = eval_brdfcos(pt, -lpt.wo);
-        auto lld = lke * lbc * lw;
-        if (lld != ym::zero3f) {
-            l += weight * lld * eval_transmission(scn, pt, lpt, params) *
-                 weight_mis(lw, weight_brdfcos(pt, -lpt.wo));
+        auto ls = sample_direct<rtype>(scn, pt, smp,
+            (bounce) ? 1 : params.light_candidates, (bounce) ? nullptr : reuse);
+        if (ls.ld != ym::zero3f) {
+            auto ld = weight * ls.ld *
+                      eval_transmission(scn, pt, ls.lpt, params) *
+                      weight_mis(ls.lw, weight_guided(pt, gdt, -ls.lpt.wo));
+            l += ld;
+            accumulate_guide_vertices(gvs, ngvs, ld);
+            accumulate_radiance_vertices(rvs, nrvs, ld);
         }
 
         // direct – brdf
-        auto bpt = intersect_scene(
-            scn, offset_ray(pt,
-                     sample_brdfcos(pt, sample_next1f(smp), sample_next2f(smp)),
-                     params));
-        auto bw = weight_brdfcos(pt, -bpt.wo);
+        auto bpt = intersect_scene(scn,
+            offset_ray(pt,
+                sample_guided(pt, gdt, sample_next1f<rtype>(smp),
+                    sample_next2f<rtype>(smp)),
+                params),
+            eval_scattered_cone(pt));
+        auto bw = weight_guided(pt, gdt, -bpt.wo);
         auto bke = eval_emission(bpt);
         auto bbc = eval_brdfcos(pt, -bpt.wo);
         auto bld = bke * bbc * bw;
+        auto bmis = 0.0f;
         if (bld != ym::zero3f) {
-            l += weight * bld * weight_mis(bw, weight_light(bpt, pt));
+            bmis = weight_mis(
+                bw, weight_light(bpt, pt) * weight_lights(scn, bpt, pt));
+            auto bd = weight * bld * bmis;
+            l += bd;
+            accumulate_guide_vertices(gvs, ngvs, bd);
+            accumulate_radiance_vertices(rvs, nrvs, bd);
+        }
+
+        // record the vertex, with the share of the emission arriving from wi
+        // that light sampling does not already capture
+        auto gv = (gcell >= 0 && ngvs < guide_max_vertices) ? &gvs[ngvs++] :
+                                                               nullptr;
+        if (gv) {
+            gv->cell = gcell;
+            gv->wi = -bpt.wo;
+            gv->bw = bw;
+            gv->li = bke * bmis;
         }
 
         // skip recursion if path ends
@@ -2238,7 +4796,7 @@ static ym::vec3f shade_pathtrace(const scene* scn, const point& pt_,
         if (bpt.no_reflectance()) break;
 
         // continue path
-        weight *= eval_brdfcos(pt, -bpt.wo) * weight_brdfcos(pt, -bpt.wo);
+        weight *= bbc * bw;
         if (weight == ym::zero3f) break;
 
         // roussian roulette
@@ -2246,21 +4804,33 @@ static ym::vec3f shade_pathtrace(const scene* scn, const point& pt_,
             auto rrprob = 1.0f - std::min(std::max(std::max(pt.rho.x, pt.rho.y),
                                               pt.rho.z),
                                      0.95f);
-            if (sample_next1f(smp) < rrprob) break;
+            if (sample_next1f<rtype>(smp) < rrprob) break;
             weight *= 1 / (1 - rrprob);
         }
+        if (gv) gv->weight = weight;
 
         // continue path
         pt = bpt;
         emission = false;
     }
 
+    // record the radiance arriving at the path vertices
+    for (auto vid = 0; vid < ngvs; vid++) {
+        auto& gv = gvs[vid];
+        record_guide(guide->building[gv.cell], gv.wi, luminance(gv.li) * gv.bw);
+    }
+
+    // record the radiance reflected at the path vertices
+    for (auto vid = 0; vid < nrvs; vid++)
+        record_radiance(cache, rvs[vid].key, rvs[vid].lr);
+
     return l;
 }
 
 //
 // Recursive path tracing.
 //
+template <rng_type rtype>
 static ym::vec3f shade_pathtrace_std(const scene* scn, const point& pt_,
     sampler* smp, const trace_params& params) {
     // amke a copy
@@ -2278,14 +4848,17 @@ static ym::vec3f shade_pathtrace_std(const scene* scn, const point& pt_,
         if (emission) l += weight * eval_emission(pt);
 
         // direct
-        auto lgt = scn->lights[sample_next1i(smp, (int)scn->lights.size())];
-        auto lpt =
-            sample_light(lgt, pt, sample_next1f(smp), sample_next2f(smp));
-        auto ld = eval_emission(lpt) * eval_brdfcos(pt, -lpt.wo) *
-                  weight_light(lpt, pt) * (float)scn->lights.size();
-        if (ld != ym::zero3f) {
-            auto shadow_ray = offset_ray(pt, lpt, params);
-            if (!scn->intersect_any(shadow_ray)) l += weight * ld;
+        auto lgt = sample_lights(scn, pt, sample_next1f<rtype>(smp));
+        auto lrn2 = sample_next2f<rtype>(smp);
+        auto lrn = sample_next1f<rtype>(smp);
+        if (lgt.first) {
+            auto lpt = sample_light(lgt.first, pt, lrn, lrn2);
+            auto ld = eval_emission(lpt) * eval_brdfcos(pt, -lpt.wo) *
+                      weight_light(lpt, pt) * lgt.second;
+            if (ld != ym::zero3f) {
+                auto shadow_ray = offset_ray(pt, lpt, params);
+                if (!intersect_scene_any(scn, shadow_ray)) l += weight * ld;
+            }
         }
 
         // skip recursion if path ends
@@ -2296,18 +4869,19 @@ static ym::vec3f shade_pathtrace_std(const scene* scn, const point& pt_,
             auto rrprob = 1.0f - std::min(std::max(std::max(pt.rho.x, pt.rho.y),
                                               pt.rho.z),
                                      0.95f);
-            if (sample_next1f(smp) < rrprob) break;
+            if (sample_next1f<rtype>(smp) < rrprob) break;
             weight *= 1 / (1 - rrprob);
         }
 
         // continue path
         {
-            auto wi =
-                sample_brdfcos(pt, sample_next1f(smp), sample_next2f(smp));
+            auto wi = sample_brdfcos(
+                pt, sample_next1f<rtype>(smp), sample_next2f<rtype>(smp));
             weight *= eval_brdfcos(pt, wi) * weight_brdfcos(pt, wi);
             if (weight == ym::zero3f) break;
 
-            pt = intersect_scene(scn, offset_ray(pt, wi, params));
+            pt = intersect_scene(
+                scn, offset_ray(pt, wi, params), eval_scattered_cone(pt));
             emission = false;
             if (pt.no_reflectance()) break;
         }
@@ -2319,6 +4893,7 @@ static ym::vec3f shade_pathtrace_std(const scene* scn, const point& pt_,
 //
 // Recursive path tracing.
 //
+template <rng_type rtype>
 static ym::vec3f shade_pathtrace_hack(const scene* scn, const point& pt_,
     sampler* smp, const trace_params& params) {
     // make a copy
@@ -2332,14 +4907,17 @@ static ym::vec3f shade_pathtrace_hack(const scene* scn, const point& pt_,
     auto weight = ym::vec3f{1, 1, 1};
     for (auto bounce = 0; bounce < params.max_depth; bounce++) {
         // direct
-        auto lgt = scn->lights[sample_next1i(smp, (int)scn->lights.size())];
-        auto lpt =
-            sample_light(lgt, pt, sample_next1f(smp), sample_next2f(smp));
-        auto ld = eval_emission(lpt) * eval_brdfcos(pt, -lpt.wo) *
-                  weight_light(lpt, pt) * (float)scn->lights.size();
-        if (ld != ym::zero3f) {
-            auto shadow_ray = offset_ray(pt, lpt, params);
-            if (!scn->intersect_any(shadow_ray)) l += weight * ld;
+        auto lgt = sample_lights(scn, pt, sample_next1f<rtype>(smp));
+        auto lrn2 = sample_next2f<rtype>(smp);
+        auto lrn = sample_next1f<rtype>(smp);
+        if (lgt.first) {
+            auto lpt = sample_light(lgt.first, pt, lrn, lrn2);
+            auto ld = eval_emission(lpt) * eval_brdfcos(pt, -lpt.wo) *
+                      weight_light(lpt, pt) * lgt.second;
+            if (ld != ym::zero3f) {
+                auto shadow_ray = offset_ray(pt, lpt, params);
+                if (!intersect_scene_any(scn, shadow_ray)) l += weight * ld;
+            }
         }
 
         // skip recursion if path ends
@@ -2350,18 +4928,19 @@ static ym::vec3f shade_pathtrace_hack(const scene* scn, const point& pt_,
             auto rrprob = 1.0f - std::min(std::max(std::max(pt.rho.x, pt.rho.y),
                                               pt.rho.z),
                                      0.95f);
-            if (sample_next1f(smp) < rrprob) break;
+            if (sample_next1f<rtype>(smp) < rrprob) break;
             weight *= 1 / (1 - rrprob);
         }
 
         // continue path
         {
-            auto wi =
-                sample_brdfcos(pt, sample_next1f(smp), sample_next2f(smp));
+            auto wi = sample_brdfcos(
+                pt, sample_next1f<rtype>(smp), sample_next2f<rtype>(smp));
             weight *= eval_brdfcos(pt, wi) * weight_brdfcos(pt, wi);
             if (weight == ym::zero3f) break;
 
-            pt = intersect_scene(scn, offset_ray(pt, wi, params));
+            pt = intersect_scene(
+                scn, offset_ray(pt, wi, params), eval_scattered_cone(pt));
             if (pt.no_reflectance()) break;
         }
     }
@@ -2372,6 +4951,7 @@ static ym::vec3f shade_pathtrace_hack(const scene* scn, const point& pt_,
 //
 // Direct illumination.
 //
+template <rng_type rtype>
 static ym::vec3f shade_direct(const scene* scn, const point& pt, int bounce,
     sampler* smp, const trace_params& params) {
     // emission
@@ -2383,8 +4963,8 @@ static ym::vec3f shade_direct(const scene* scn, const point& pt, int bounce,
 
     // direct
     for (auto& lgt : scn->lights) {
-        auto lpt =
-            sample_light(lgt, pt, sample_next1f(smp), sample_next2f(smp));
+        auto lpt = sample_light(
+            lgt, pt, sample_next1f<rtype>(smp), sample_next2f<rtype>(smp));
         auto ld = eval_emission(lpt) * eval_brdfcos(pt, -lpt.wo) *
                   weight_light(lpt, pt);
         if (ld == ym::zero3f) continue;
@@ -2399,8 +4979,9 @@ static ym::vec3f shade_direct(const scene* scn, const point& pt, int bounce,
         auto& brdf = pt.brdfs[lid];
         if (brdf.type == brdf_type::transparent) {
             auto ray = offset_ray(pt, -pt.wo, params);
-            l += brdf.rho * shade_direct(scn, intersect_scene(scn, ray),
-                                bounce + 1, smp, params);
+            l += brdf.rho * shade_direct<rtype>(scn,
+                                intersect_scene(scn, ray, pt.cone), bounce + 1,
+                                smp, params);
         }
     }
 
@@ -2411,14 +4992,16 @@ static ym::vec3f shade_direct(const scene* scn, const point& pt, int bounce,
 //
 // Direct illumination.
 //
+template <rng_type rtype>
 static ym::vec3f shade_direct(const scene* scn, const point& pt, sampler* smp,
     const trace_params& params) {
-    return shade_direct(scn, pt, 0, smp, params);
+    return shade_direct<rtype>(scn, pt, 0, smp, params);
 }
 
 //
 // Eyelight for quick previewing.
 //
+template <rng_type rtype>
 static ym::vec3f shade_eyelight(const scene* scn, const point& pt, int bounce,
     sampler* smp, const trace_params& params) {
     // emission
@@ -2433,8 +5016,9 @@ static ym::vec3f shade_eyelight(const scene* scn, const point& pt, int bounce,
         auto& brdf = pt.brdfs[lid];
         if (brdf.type == brdf_type::transparent) {
             auto ray = offset_ray(pt, -pt.wo, params);
-            l += brdf.rho * shade_eyelight(scn, intersect_scene(scn, ray),
-                                bounce + 1, smp, params);
+            l += brdf.rho * shade_eyelight<rtype>(scn,
+                                intersect_scene(scn, ray, pt.cone), bounce + 1,
+                                smp, params);
         }
     }
 
@@ -2445,43 +5029,106 @@ static ym::vec3f shade_eyelight(const scene* scn, const point& pt, int bounce,
 //
 // Eyelight for quick previewing.
 //
+template <rng_type rtype>
 static ym::vec3f shade_eyelight(const scene* scn, const point& pt, sampler* smp,
     const trace_params& params) {
-    return shade_eyelight(scn, pt, 0, smp, params);
+    return shade_eyelight<rtype>(scn, pt, 0, smp, params);
+}
+
+//
+// Shader chosen at compile time. The guide, light reuse and radiance cache,
+// if any, are only used by the path tracer.
+//
+template <shader_type stype, rng_type rtype>
+static inline ym::vec3f shade(const scene* scn, const point& pt, sampler* smp,
+    const trace_params& params, path_guide* guide, light_reuse* reuse,
+    radiance_cache* cache) {
+    switch (stype) {
+        case shader_type::eyelight:
+            return shade_eyelight<rtype>(scn, pt, smp, params);
+        case shader_type::direct:
+            return shade_direct<rtype>(scn, pt, smp, params);
+        case shader_type::pathtrace:
+            return shade_pathtrace<rtype>(
+                scn, pt, smp, params, guide, reuse, cache);
+    }
+    return ym::zero3f;
 }
 
 //
-// Shader function callback.
+// Shader and sampler types of a render kernel as compile-time constants.
 //
-using shade_fn = ym::vec3f (*)(const scene* scn, const point& pt, sampler* smp,
-    const trace_params& params);
+template <shader_type stype_, rng_type rtype_>
+struct kernel_types {
+    static const shader_type stype = stype_;
+    static const rng_type rtype = rtype_;
+};
 
 //
-// Renders a block of pixels. Public API, see above.
+// Calls func with the kernel_types for stype and rtype. Render kernels are
+// instantiated once per combination in func, so that the choice is made once
+// per call instead of for every sample and random number.
 //
-void trace_block(const scene* scn, ym::vec4f* img, int block_x, int block_y,
-    int block_width, int block_height, int samples_min, int samples_max,
-    const trace_params& params) {
-    auto cam = scn->cameras[params.camera_id];
-    shade_fn shade;
-    switch (params.stype) {
-        case shader_type::eyelight: shade = shade_eyelight; break;
-        case shader_type::direct: shade = shade_direct; break;
-        case shader_type::pathtrace: shade = shade_pathtrace; break;
-        default: assert(false); return;
+template <shader_type stype, typename Func>
+static inline void dispatch_kernel(rng_type rtype, const Func& func) {
+    switch (rtype) {
+        case rng_type::uniform:
+            func(kernel_types<stype, rng_type::uniform>());
+            break;
+        case rng_type::stratified:
+            func(kernel_types<stype, rng_type::stratified>());
+            break;
+        case rng_type::cmjs: func(kernel_types<stype, rng_type::cmjs>()); break;
+        case rng_type::sobol:
+            func(kernel_types<stype, rng_type::sobol>());
+            break;
+        default: assert(false);
+    }
+}
+
+//
+// Calls func with the kernel_types for stype and rtype. See above.
+//
+template <typename Func>
+static inline void dispatch_kernel(
+    shader_type stype, rng_type rtype, const Func& func) {
+    switch (stype) {
+        case shader_type::eyelight:
+            dispatch_kernel<shader_type::eyelight>(rtype, func);
+            break;
+        case shader_type::direct:
+            dispatch_kernel<shader_type::direct>(rtype, func);
+            break;
+        case shader_type::pathtrace:
+            dispatch_kernel<shader_type::pathtrace>(rtype, func);
+            break;
+        default: assert(false);
     }
+}
+
+//
+// Renders a block of pixels with a kernel specialized for the shader and
+// sampler types.
+//
+template <shader_type stype, rng_type rtype>
+static void trace_block_image(const scene* scn, ym::vec4f* img, int block_x,
+    int block_y, int block_width, int block_height, int samples_min,
+    int samples_max, const trace_params& params) {
+    auto cam = scn->cameras[params.camera_id];
     for (auto j = block_y; j < block_y + block_height; j++) {
         for (auto i = block_x; i < block_x + block_width; i++) {
             auto lp = ym::zero4f;
             for (auto s = samples_min; s < samples_max; s++) {
-                auto smp = make_sampler(i, j, s, params.nsamples, params.rtype);
-                auto rn = sample_next2f(&smp);
+                auto smp = make_sampler<rtype>(i, j, s, params.nsamples);
+                auto rn = sample_next2f<rtype>(&smp);
                 auto uv = ym::vec2f{
                     (i + rn.x) / params.width, 1 - (j + rn.y) / params.height};
-                auto ray = eval_camera(cam, uv, sample_next2f(&smp));
-                auto pt = intersect_scene(scn, ray);
+                auto ray = eval_camera(cam, uv, sample_next2f<rtype>(&smp));
+                auto pt = intersect_scene(
+                    scn, ray, eval_camera_cone(cam, params.height));
                 if (!pt.ist || params.envmap_invisible) continue;
-                auto l = shade(scn, pt, &smp, params);
+                auto l = shade<stype, rtype>(
+                    scn, pt, &smp, params, nullptr, nullptr, nullptr);
                 if (!ym::isfinite(l)) {
                     if (scn->log_error) scn->log_error("NaN detected");
                     continue;
@@ -2495,6 +5142,35 @@ void trace_block(const scene* scn, ym::vec4f* img, int block_x, int block_y,
     }
 }
 
+//
+// Calls trace_block_image() for the kernel_types it is dispatched with.
+//
+struct trace_block_image_func {
+    const scene* scn;
+    ym::vec4f* img;
+    int block_x, block_y, block_width, block_height;
+    int samples_min, samples_max;
+    const trace_params* params;
+
+    template <typename types>
+    void operator()(types) const {
+        trace_block_image<types::stype, types::rtype>(scn, img, block_x,
+            block_y, block_width, block_height, samples_min, samples_max,
+            *params);
+    }
+};
+
+//
+// Renders a block of pixels. Public API, see above.
+//
+void trace_block(const scene* scn, ym::vec4f* img, int block_x, int block_y,
+    int block_width, int block_height, int samples_min, int samples_max,
+    const trace_params& params) {
+    dispatch_kernel(params.stype, params.rtype,
+        trace_block_image_func{scn, img, block_x, block_y, block_width,
+            block_height, samples_min, samples_max, &params});
+}
+
 // triangle filter (public domain from stb_image_resize)
 inline float filter_triangle(float x) {
     x = (float)fabs(x);
@@ -2538,67 +5214,322 @@ inline float filter_mitchell(float x) {
         return 0.0f;
 }
 
-// filter function
-using filter_fn = float (*)(float);
+//
+// Filter chosen at compile time, with its radius in pixels.
+//
+template <filter_type ftype>
+static inline float eval_filter(float x) {
+    switch (ftype) {
+        case filter_type::box: return 1;
+        case filter_type::triangle: return filter_triangle(x);
+        case filter_type::cubic: return filter_cubic(x);
+        case filter_type::catmull_rom: return filter_catmullrom(x);
+        case filter_type::mitchell: return filter_mitchell(x);
+    }
+    return 0;
+}
+
+//
+// Filter radius in pixels.
+//
+template <filter_type ftype>
+static constexpr int filter_size() {
+    return (ftype == filter_type::box) ?
+               0 :
+               (ftype == filter_type::triangle) ? 1 : 2;
+}
+
+//
+// Converts a float to half precision, rounding to nearest.
+//
+static inline uint16_t float_to_half(float f) {
+    auto x = (uint32_t)0;
+    memcpy(&x, &f, sizeof(x));
+    auto sign = (uint16_t)((x >> 16) & 0x8000);
+    auto e = (int)((x >> 23) & 0xff) - 127 + 15;
+    auto m = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (m ? 0x200 : 0);
+    if (e >= 31) return sign | 0x7c00;
+    if (e <= 0) {
+        if (e < -10) return sign;
+        m |= 0x800000;
+        auto shift = 14 - e;
+        return sign | (uint16_t)((m >> shift) + ((m >> (shift - 1)) & 1));
+    }
+    return sign | (uint16_t)(((e << 10) | (m >> 13)) + ((m >> 12) & 1));
+}
+
+//
+// Converts a half to float.
+//
+static inline float half_to_float(uint16_t h) {
+    auto sign = (uint32_t)(h & 0x8000) << 16;
+    auto e = (uint32_t)((h >> 10) & 0x1f);
+    auto m = (uint32_t)(h & 0x3ff);
+    if (!e) return (sign ? -1.0f : 1.0f) * m / 16777216.0f;
+    auto x = sign | ((e == 31) ? 0x7f800000 : ((e - 15 + 127) << 23)) |
+             (m << 13);
+    auto f = 0.0f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// number of values per pixel in the auxiliary buffers
+static constexpr const int aux_channels = 7;
+
+//
+// Camera ray hit cached for reuse in later renders. The first barycentric
+// coordinate is recovered from the others, since they sum to one.
+//
+struct cached_hit {
+    int iid = -1;            // instance id, or -1 if missed
+    int eid = -2;            // element id, or -1 if missed, -2 if not traced
+    float dist = 0;          // ray distance
+    ym::vec2f euv = {0, 0};  // last two barycentric coordinates
+};
+
+//
+// Pixel sums in fixed point, with the weight sum in w. Integer sums do not
+// depend on the order of the additions, so images are the same however
+// blocks, samples and partial renders split the work. Each value added is
+// rounded to 2^-30 and saturated at 2^22.
+//
+using fixed4 = ym::vec<int64_t, 4>;
+static const double fixed_scale = 1073741824.0;
+static const double fixed_max = 4503599627370496.0;
+
+//
+// Converts a value to fixed point, dropping nans.
+//
+static inline int64_t to_fixed(float v) {
+    auto x = (double)v * fixed_scale;
+    if (x >= fixed_max) return (int64_t)fixed_max;
+    if (x <= -fixed_max) return -(int64_t)fixed_max;
+    if (x != x) return 0;
+    return (int64_t)std::llrint(x);
+}
+
+//
+// Converts a pixel value to fixed point.
+//
+static inline fixed4 to_fixed(const ym::vec4f& v) {
+    return {to_fixed(v.x), to_fixed(v.y), to_fixed(v.z), to_fixed(v.w)};
+}
+
+//
+// Divides a pixel sum by its weight.
+//
+static inline ym::vec4f resolve_fixed(const fixed4& acc) {
+    auto w = (double)acc.w;
+    return {(float)(acc.x / w), (float)(acc.y / w), (float)(acc.z / w), 1};
+}
 
 //
 // state for progressive rendering and denoising
 //
 struct trace_state {
-    // rendered image
+    // rendered image, resolved from the accumulation buffer on request
     ym::image4f img;
 
-    // progressive rendering buffers
-    ym::image4f acc;
-    ym::imagef weight;
+    // progressive rendering buffer, in fixed point with the weight sum in w
+    ym::image<fixed4> acc;
 
-    // auxiliary buffers
-    ym::image4f norm, albedo, depth;
+    // auxiliary buffers, as running means of normal, albedo and depth with
+    // aux_channels values per pixel, stored as floats or halfs
+    std::vector<float> aux;
+    std::vector<uint16_t> aux_half;
 
     // progressive state
     int cur_sample = 0;
     std::vector<ym::bbox2i> blocks;
+    ym::bbox2i region;  // pixels rendered, in the crop window
+
+    // adaptive sampling state
+    ym::image2f lum;                  // sum and squared sum of luminance
+    std::vector<int> block_nsamples;  // samples traced in each block
+    std::vector<float> block_error;   // error estimate of each block
+    long long used_samples = 0;       // samples traced in all blocks
+
+    // block scheduling
+    std::vector<float> block_cost;  // seconds to trace each block last time
+    int nthreads = 1;               // number of threads in the pool
 
     // pool
     yu::concurrent::thread_pool* pool = nullptr;
-    /// lock for access to image
-    std::mutex image_mutex;
+    // locks for cells of 8x8 pixels, taken to splat at block borders
+    std::vector<std::mutex> splat_locks;
+    // checkpoint writer, running in the background
+    std::thread checkpoint_thread;
+    // hash of the scene saved in checkpoints, or 0 if not computed yet
+    uint64_t scene_hash = 0;
+    // asynchronous renderer: blocks left in the current sample, and whether
+    // it was stopped, guarded by the mutex so no sample is queued after
+    std::atomic<int> async_pending{0};
+    bool async_stopped = true;
+    std::mutex async_mutex;
+
+    // camera hits of the first samples of each pixel, kept across calls to
+    // init_state() while the scene, camera and params they were traced with
+    // produce the same camera rays and geometry is unchanged
+    std::vector<cached_hit> hit_cache;
+    const scene* hit_cache_scn = nullptr;
+    unsigned hit_cache_version = 0;
+    camera hit_cache_cam;
+    trace_params hit_cache_params;
 
     // render scene
     const scene* scn = nullptr;
     // render options
     trace_params params = {};
 
-    // render function
-    shade_fn shade = nullptr;
     // render camera
     const camera* cam = nullptr;
-    // filter function
-    filter_fn filter = nullptr;
-    // filter size
-    int filter_size = 0;
+    // path guide learned over the progressive passes, if any
+    path_guide* guide = nullptr;
+    // light reservoirs of the camera hits of the last sample of each pixel
+    std::vector<light_reservoir> reservoirs;
+    // radiance cache filled by the first samples, if any
+    radiance_cache* cache = nullptr;
+    // block render function, specialized for shader, sampler and filter
+    void (*trace_block)(trace_state* state, int block_idx, int samples_min,
+        int samples_max) = nullptr;
 
     // cleanup
     ~trace_state() {
+        if (checkpoint_thread.joinable()) checkpoint_thread.join();
         if (pool) {
-            yu::concurrent::clear_pool(pool);
+            {
+                std::lock_guard<std::mutex> lock(async_mutex);
+                async_stopped = true;
+                yu::concurrent::clear_pool(pool);
+            }
             yu::concurrent::free_pool(pool);
         }
+        if (guide) delete guide;
+        if (cache) delete cache;
     }
 };
 
 //
-// Make image blocks
+// Gets the auxiliary buffer values of the pixel idx.
+//
+static inline void get_aux(const trace_state* state, int idx, float* v) {
+    if (!state->aux_half.empty()) {
+        for (auto c = 0; c < aux_channels; c++)
+            v[c] = half_to_float(state->aux_half[idx * aux_channels + c]);
+    } else {
+        for (auto c = 0; c < aux_channels; c++)
+            v[c] = state->aux[idx * aux_channels + c];
+    }
+}
+
+//
+// Updates the running means of the auxiliary buffers of the pixel idx with
+// the values v of its n-th sample. Half precision means round away updates
+// smaller than half their step, so past about 2k samples they stop changing.
+//
+static inline void update_aux(
+    trace_state* state, int idx, const float* v, float n) {
+    float m[aux_channels];
+    get_aux(state, idx, m);
+    for (auto c = 0; c < aux_channels; c++) m[c] += (v[c] - m[c]) / n;
+    if (!state->aux_half.empty()) {
+        for (auto c = 0; c < aux_channels; c++)
+            state->aux_half[idx * aux_channels + c] = float_to_half(m[c]);
+    } else {
+        for (auto c = 0; c < aux_channels; c++)
+            state->aux[idx * aux_channels + c] = m[c];
+    }
+}
+
+//
+// Index of the cell x, y along a Hilbert curve covering an n x n grid, with
+// n a power of two.
+//
+static inline int hilbert_index(int n, int x, int y) {
+    auto d = 0;
+    for (auto s = n / 2; s > 0; s /= 2) {
+        auto rx = (x & s) > 0, ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (!ry) {
+            if (rx) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+//
+// Make image blocks, ordered along a Hilbert curve so that blocks traced
+// one after the other are close and reuse bvh nodes and texels in cache.
 //
 std::vector<ym::bbox2i> make_blocks(int w, int h, int bs) {
     std::vector<ym::bbox2i> blocks;
+    auto n = 1;
+    while (n * bs < w || n * bs < h) n *= 2;
+    auto keys = std::vector<std::pair<int, int>>();
     for (int j = 0; j < h; j += bs) {
         for (int i = 0; i < w; i += bs) {
+            keys.push_back({hilbert_index(n, i / bs, j / bs), blocks.size()});
             blocks.push_back(
                 {{i, j}, {ym::min(i + bs, w), ym::min(j + bs, h)}});
         }
     }
-    return blocks;
+    std::sort(keys.begin(), keys.end());
+    auto sorted = std::vector<ym::bbox2i>();
+    for (auto& key : keys) sorted.push_back(blocks[key.second]);
+    return sorted;
+}
+
+//
+// Splits blocks that took much longer than the others to trace into four
+// quadrants, so that expensive regions do not leave threads idle at the end
+// of a pass. The target cost gives each thread about eight blocks. Children
+// take the place of their parent, keeping the curve order, and inherit its
+// adaptive sampling state. Blocks are not split below 8 pixels.
+//
+static void split_blocks(trace_state* state) {
+    auto total = 0.0f;
+    for (auto cost : state->block_cost) total += cost;
+    auto target = total / (8 * state->nthreads);
+    if (target <= 0) return;
+    auto adaptive = !state->block_nsamples.empty();
+    auto blocks = std::vector<ym::bbox2i>();
+    auto cost = std::vector<float>();
+    auto nsamples = std::vector<int>();
+    auto error = std::vector<float>();
+    for (auto idx = 0; idx < (int)state->blocks.size(); idx++) {
+        auto& block = state->blocks[idx];
+        auto size = ym::diagonal(block);
+        auto nsplits = 1;
+        if (state->block_cost[idx] > 2 * target && size.x >= 16 &&
+            size.y >= 16) {
+            auto c = block.min + size / 2;
+            blocks.push_back({block.min, c});
+            blocks.push_back({{c.x, block.min.y}, {block.max.x, c.y}});
+            blocks.push_back({c, block.max});
+            blocks.push_back({{block.min.x, c.y}, {c.x, block.max.y}});
+            nsplits = 4;
+        } else {
+            blocks.push_back(block);
+        }
+        for (auto i = 0; i < nsplits; i++) {
+            cost.push_back(state->block_cost[idx] / nsplits);
+            if (!adaptive) continue;
+            nsamples.push_back(state->block_nsamples[idx]);
+            error.push_back(state->block_error[idx]);
+        }
+    }
+    if (blocks.size() == state->blocks.size()) return;
+    state->blocks = blocks;
+    state->block_cost = cost;
+    if (adaptive) {
+        state->block_nsamples = nsamples;
+        state->block_error = error;
+    }
 }
 
 //
@@ -2607,92 +5538,247 @@ std::vector<ym::bbox2i> make_blocks(int w, int h, int bs) {
 trace_state* make_state() { return new trace_state(); }
 
 //
-// Initialize state
+// Grabs the image from the state, resolving the accumulated samples. Pixels
+// without samples keep their previous values.
 //
-void init_state(
-    trace_state* state, const scene* scn, const trace_params& params) {
-    if (state->pool) {
-        if (params.parallel)
-            yu::concurrent::clear_pool(state->pool);
-        else
-            yu::concurrent::free_pool(state->pool);
-    } else {
-        if (params.parallel) state->pool = yu::concurrent::make_pool();
+ym::image4f& get_traced_image(trace_state* state) {
+    auto width = state->acc.width(), height = state->acc.height();
+    if (state->img.width() != width || state->img.height() != height)
+        state->img.assign(width, height, ym::zero4f);
+    for (auto j = 0; j < height; j++) {
+        for (auto i = 0; i < width; i++) {
+            auto& acc = state->acc[{i, j}];
+            if (acc.w) state->img[{i, j}] = resolve_fixed(acc);
+        }
     }
-    state->img = ym::image4f(params.width, params.height);
-    state->acc = ym::image4f(params.width, params.height);
-    state->weight = ym::imagef(params.width, params.height);
-    if (params.aux_buffers) {
-        state->norm = ym::image4f(params.width, params.height);
-        state->albedo = ym::image4f(params.width, params.height);
-        state->depth = ym::image4f(params.width, params.height);
-    } else {
-        state->norm = ym::image4f();
-        state->albedo = ym::image4f();
-        state->depth = ym::image4f();
+    return state->img;
+}
+
+//
+// Grabs the image from the state
+//
+void get_aux_buffers(const trace_state* state, ym::image4f& norm,
+    ym::image4f& albedo, ym::image4f& depth) {
+    if (!state->params.aux_buffers) return;
+    auto width = state->acc.width(), height = state->acc.height();
+    norm.resize(width, height);
+    albedo.resize(width, height);
+    depth.resize(width, height);
+    for (auto j = 0; j < height; j++) {
+        for (auto i = 0; i < width; i++) {
+            float v[aux_channels];
+            get_aux(state, j * width + i, v);
+            norm[{i, j}] = {ym::normalize(ym::vec3f{v[0], v[1], v[2]}) * 0.5f +
+                                ym::vec3f{0.5, 0.5, 0.5},
+                1};
+            albedo[{i, j}] = {v[3], v[4], v[5], 1};
+            depth[{i, j}] = {v[6] / 10, v[6] / 10, v[6] / 10, 1};
+        }
     }
-    state->cur_sample = 0;
-    state->blocks = make_blocks(params.width, params.height, 32);
-    state->scn = scn;
-    state->params = params;
+}
 
-    state->cam = scn->cameras[params.camera_id];
+//
+// Edge stopping weight for a distance x >= 0, the inverse of the Taylor
+// series of exp(x). It is close to exp(-x) for small x and falls off as
+// 24 / x^4. It has no branches or calls, so loops using it vectorize.
+//
+static inline float edge_weight(float x) {
+    return 1 / (1 + x * (1 + x * (0.5f + x * (1 / 6.0f + x * (1 / 24.0f)))));
+}
 
-    switch (params.stype) {
-        case shader_type::eyelight: state->shade = shade_eyelight; break;
-        case shader_type::direct: state->shade = shade_direct; break;
-        case shader_type::pathtrace: state->shade = shade_pathtrace; break;
-        default: assert(false); return;
-    }
+//
+// Denoiser buffers, with one plane per channel so that rows vectorize
+//
+struct denoise_buffers {
+    int width = 0, height = 0;
+    std::vector<float> r, g, b, var;  // irradiance and its variance
+    std::vector<float> nx, ny, nz;    // normals, zero for misses
+    std::vector<float> depth;         // depth, zero for misses
+    std::vector<float> depth_inv;     // inverse of the depth tolerance
 
-    switch (params.ftype) {
-        case filter_type::box:
-            state->filter = nullptr;
-            state->filter_size = 0;
-            break;
-        case filter_type::triangle:
-            state->filter = filter_triangle;
-            state->filter_size = 1;
-            break;
-        case filter_type::cubic:
-            state->filter = filter_cubic;
-            state->filter_size = 2;
-            break;
-        case filter_type::catmull_rom:
-            state->filter = filter_catmullrom;
-            state->filter_size = 2;
-            break;
-        case filter_type::mitchell:
-            state->filter = filter_mitchell;
-            state->filter_size = 2;
-            break;
-        default: assert(false); return;
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        for (auto plane : {&r, &g, &b, &var, &nx, &ny, &nz, &depth, &depth_inv})
+            plane->assign((size_t)w * h, 0);
     }
-}
+};
 
 //
-// Grabs the image from the state
+// Runs a task on chunks of rows on nthreads threads.
 //
-ym::image4f& get_traced_image(trace_state* state) { return state->img; }
+static void parallel_rows(
+    int nthreads, int height, const std::function<void(int j)>& task) {
+    if (nthreads <= 1) {
+        for (auto j = 0; j < height; j++) task(j);
+        return;
+    }
+    std::atomic<int> next{0};
+    auto run = [&next, &task, height]() {
+        while (true) {
+            auto start = next.fetch_add(8);
+            if (start >= height) break;
+            for (auto j = start; j < ym::min(start + 8, height); j++) task(j);
+        }
+    };
+    auto threads = std::vector<std::thread>();
+    for (auto t = 1; t < nthreads; t++) threads.push_back(std::thread(run));
+    run();
+    for (auto& thread : threads) thread.join();
+}
 
 //
-// Grabs the image from the state
+// Filters row j of src into dst with one a-trous iteration of step size,
+// using a 5x5 B3 spline kernel with taps stopped at edges in luminance,
+// normals and depth. The row is processed in chunks of pixels. For each tap,
+// the loop runs along the chunk, skipping taps outside the image, and
+// accumulates in local arrays, so that it vectorizes.
+//
+static void denoise_row(const denoise_buffers& src, denoise_buffers& dst,
+    int j, int step, const denoise_params& params) {
+    static constexpr const int chunk = 64;
+    static const float kernel[5] = {
+        1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f, 1 / 16.0f};
+    auto width = src.width;
+    auto r = src.r.data(), g = src.g.data(), b = src.b.data(),
+         var = src.var.data(), nx = src.nx.data(), ny = src.ny.data(),
+         nz = src.nz.data(), depth = src.depth.data(),
+         depth_inv = src.depth_inv.data();
+    auto normal_inv = 1 / (2 * params.normal_sigma);
+    for (auto start = 0; start < width; start += chunk) {
+        auto row = (size_t)j * width + start;
+        auto size = ym::min(chunk, width - start);
+        float sw[chunk], sr[chunk], sg[chunk], sb[chunk], sv[chunk];
+        float lp[chunk], lum_inv[chunk];
+        for (auto i = 0; i < size; i++) {
+            auto p = row + i;
+            sw[i] = sr[i] = sg[i] = sb[i] = sv[i] = 0;
+            lp[i] = 0.2126f * r[p] + 0.7152f * g[p] + 0.0722f * b[p];
+            lum_inv[i] =
+                1 / (params.color_sigma * std::sqrt(ym::max(var[p], 0.0f)) +
+                        1e-4f);
+        }
+        for (auto dj = -2; dj <= 2; dj++) {
+            auto qj = j + dj * step;
+            if (qj < 0 || qj >= src.height) continue;
+            for (auto di = -2; di <= 2; di++) {
+                auto off = di * step;
+                auto h = kernel[di + 2] * kernel[dj + 2];
+                auto dist_inv =
+                    (di || dj) ?
+                        1.0f / (step * ym::max(std::abs(di), std::abs(dj))) :
+                        0.0f;
+                auto i0 = ym::max(0, -off - start),
+                     i1 = ym::min(size, width - off - start);
+                auto qrow = row + (size_t)(qj - j) * width + off;
+                auto rq = r + qrow, gq = g + qrow, bq = b + qrow,
+                     vq = var + qrow, nxq = nx + qrow, nyq = ny + qrow,
+                     nzq = nz + qrow, dq = depth + qrow;
+                auto nxp = nx + row, nyp = ny + row, nzp = nz + row,
+                     dp = depth + row, dip = depth_inv + row;
+                for (auto i = i0; i < i1; i++) {
+                    auto lq =
+                        0.2126f * rq[i] + 0.7152f * gq[i] + 0.0722f * bq[i];
+                    auto dnx = nxp[i] - nxq[i], dny = nyp[i] - nyq[i],
+                         dnz = nzp[i] - nzq[i];
+                    auto e = std::abs(lp[i] - lq) * lum_inv[i] +
+                             (dnx * dnx + dny * dny + dnz * dnz) * normal_inv +
+                             std::abs(dp[i] - dq[i]) * dip[i] * dist_inv;
+                    auto w = h * edge_weight(e);
+                    sw[i] += w;
+                    sr[i] += w * rq[i];
+                    sg[i] += w * gq[i];
+                    sb[i] += w * bq[i];
+                    sv[i] += w * w * vq[i];
+                }
+            }
+        }
+        for (auto i = 0; i < size; i++) {
+            dst.r[row + i] = sr[i] / sw[i];
+            dst.g[row + i] = sg[i] / sw[i];
+            dst.b[row + i] = sb[i] / sw[i];
+            dst.var[row + i] = sv[i] / (sw[i] * sw[i]);
+        }
+    }
+}
+
 //
-void get_aux_buffers(const trace_state* state, ym::image4f& norm,
-    ym::image4f& albedo, ym::image4f& depth) {
-    if (!state->params.aux_buffers) return;
-    norm.resize(state->norm.width(), state->norm.height());
-    albedo.resize(state->albedo.width(), state->albedo.height());
-    depth.resize(state->depth.width(), state->depth.height());
-    for (auto j = 0; j < norm.height(); j++) {
-        for (auto i = 0; i < norm.width(); i++) {
-            norm[{i, j}] = state->norm[{i, j}] / state->weight[{i, j}];
-            norm[{i, j}].xyz() =
-                normalize(norm[{i, j}].xyz()) * 0.5f + ym::vec3f{0.5, 0.5, 0.5};
-            albedo[{i, j}] = state->albedo[{i, j}] / state->weight[{i, j}];
-            depth[{i, j}] = state->depth[{i, j}] / (10 * state->weight[{i, j}]);
+// Denoises the traced image. Colors are divided by albedo, filtered and
+// multiplied back, so that textures stay sharp. The variance that drives
+// the luminance edge stopping is estimated from the 3x3 neighborhood of each
+// pixel and filtered along with the colors.
+//
+ym::image4f get_denoised_image(
+    trace_state* state, const denoise_params& params) {
+    auto width = state->acc.width(), height = state->acc.height();
+    auto nthreads = (state->params.parallel) ?
+                        std::max(1, (int)std::thread::hardware_concurrency()) :
+                        1;
+    auto has_aux = state->params.aux_buffers;
+    auto src = denoise_buffers(), dst = denoise_buffers();
+    src.resize(width, height);
+    auto albedo = std::vector<ym::vec3f>((size_t)width * height, ym::one3f);
+    auto lum = std::vector<float>((size_t)width * height, 0);
+    parallel_rows(nthreads, height, [&](int j) {
+        for (auto i = 0; i < width; i++) {
+            auto idx = j * width + i;
+            auto& acc = state->acc[{i, j}];
+            auto c = (acc.w) ? resolve_fixed(acc).xyz() : ym::zero3f;
+            if (has_aux) {
+                float v[aux_channels];
+                get_aux(state, idx, v);
+                auto n = ym::vec3f{v[0], v[1], v[2]};
+                if (n != ym::zero3f) n = ym::normalize(n);
+                src.nx[idx] = n.x;
+                src.ny[idx] = n.y;
+                src.nz[idx] = n.z;
+                for (auto k = 0; k < 3; k++)
+                    albedo[idx][k] = (v[3 + k] > 1e-3f) ? v[3 + k] : 1;
+                src.depth[idx] = v[6];
+                src.depth_inv[idx] = 1 / (params.depth_sigma * v[6] + 1e-4f);
+            }
+            src.r[idx] = c.x / albedo[idx].x;
+            src.g[idx] = c.y / albedo[idx].y;
+            src.b[idx] = c.z / albedo[idx].z;
+            lum[idx] = 0.2126f * src.r[idx] + 0.7152f * src.g[idx] +
+                       0.0722f * src.b[idx];
+        }
+    });
+    parallel_rows(nthreads, height, [&](int j) {
+        for (auto i = 0; i < width; i++) {
+            auto m = 0.0f, m2 = 0.0f;
+            auto n = 0;
+            for (auto qj = ym::max(j - 1, 0); qj <= ym::min(j + 1, height - 1);
+                 qj++) {
+                for (auto qi = ym::max(i - 1, 0);
+                     qi <= ym::min(i + 1, width - 1); qi++) {
+                    auto l = lum[qj * width + qi];
+                    m += l;
+                    m2 += l * l;
+                    n++;
+                }
+            }
+            m /= n;
+            src.var[j * width + i] = ym::max(m2 / n - m * m, 0.0f);
+        }
+    });
+    dst = src;
+    for (auto iter = 0; iter < params.niters; iter++) {
+        parallel_rows(nthreads, height, [&src, &dst, iter, &params](int j) {
+            denoise_row(src, dst, j, 1 << iter, params);
+        });
+        std::swap(src, dst);
+    }
+    auto img = ym::image4f(width, height);
+    for (auto j = 0; j < height; j++) {
+        for (auto i = 0; i < width; i++) {
+            auto idx = j * width + i;
+            img[{i, j}] = {src.r[idx] * albedo[idx].x,
+                src.g[idx] * albedo[idx].y, src.b[idx] * albedo[idx].z,
+                (state->acc[{i, j}].w) ? 1.0f : 0.0f};
         }
     }
+    return img;
 }
 
 //
@@ -2700,20 +5786,82 @@ void get_aux_buffers(const trace_state* state, ym::image4f& norm,
 //
 int get_cur_sample(const trace_state* state) { return state->cur_sample; }
 
+//
+// Whether params render with adaptive sampling. It is off for sample ranges,
+// since the blocks of each range would stop after different samples and
+// the ranges would not merge into the image rendered at once.
+//
+static inline bool is_adaptive(const trace_params& params) {
+    return params.adaptive_error > 0 && params.sample_start <= 0 &&
+           params.sample_end <= 0;
+}
+
+//
+// End of the samples to trace.
+//
+static inline int eval_sample_end(const trace_params& params) {
+    return (params.sample_end > 0) ?
+               ym::min(params.sample_end, params.nsamples) :
+               params.nsamples;
+}
+
+//
+// Number of samples in the stratified set of sample s. Adaptive sampling
+// stops pixels at different counts, so it stratifies sets that start with
+// its minimum sample count and then double, each as large as all before it.
+//
+static inline int eval_strata_nsamples(const trace_params& params, int s) {
+    if (!is_adaptive(params)) return params.nsamples;
+    auto ns = std::max(params.adaptive_min_samples, 1);
+    while (s >= ns * 2) ns *= 2;
+    return ns;
+}
+
+//
+// Intersects the camera ray of sample s of pixel i, j, reusing its cached
+// hit if any. Each pixel sample is only traced by one thread at a time.
+//
+static inline intersect_point intersect_camera_ray(
+    trace_state* state, int i, int j, int s, const ym::ray3f& ray) {
+    auto ns = state->params.hit_cache_samples;
+    if (s >= ns || state->hit_cache.empty())
+        return intersect_scene_hit(state->scn, ray);
+    auto& cached =
+        state->hit_cache[((size_t)j * state->params.width + i) * ns + s];
+    if (cached.eid == -2) {
+        auto hit = intersect_scene_hit(state->scn, ray);
+        cached.iid = hit.iid;
+        cached.eid = hit.eid;
+        cached.dist = hit.dist;
+        cached.euv = {hit.euv.y, hit.euv.z};
+        return hit;
+    }
+    auto hit = intersect_point();
+    if (cached.eid < 0) return hit;
+    hit.dist = cached.dist;
+    hit.iid = cached.iid;
+    hit.eid = cached.eid;
+    hit.euv = {1 - cached.euv.x - cached.euv.y, cached.euv.x, cached.euv.y};
+    return hit;
+}
+
 //
 // Trace a single sample
 //
-void trace_sample(ytrace::trace_state* state, int i, int j, int s, ym::vec3f& l,
-    ytrace::point& pt, ym::vec2f& rn) {
+template <shader_type stype, rng_type rtype>
+static inline void trace_sample(trace_state* state, int i, int j, int s,
+    ym::vec3f& l, point& pt, ym::vec2f& rn, light_reuse* reuse) {
     auto& params = state->params;
-    auto smp = make_sampler(i, j, s, params.nsamples, params.rtype);
-    rn = sample_next2f(&smp);
+    auto smp = make_sampler<rtype>(i, j, s, eval_strata_nsamples(params, s));
+    rn = sample_next2f<rtype>(&smp);
     auto uv =
         ym::vec2f{(i + rn.x) / params.width, 1 - (j + rn.y) / params.height};
-    auto ray = eval_camera(state->cam, uv, sample_next2f(&smp));
-    pt = intersect_scene(state->scn, ray);
+    auto ray = eval_camera(state->cam, uv, sample_next2f<rtype>(&smp));
+    pt = eval_hitpoint(state->scn, intersect_camera_ray(state, i, j, s, ray),
+        ray, eval_camera_cone(state->cam, params.height));
     if (!pt.ist || params.envmap_invisible) return;
-    l = state->shade(state->scn, pt, &smp, state->params);
+    l = shade<stype, rtype>(state->scn, pt, &smp, state->params, state->guide,
+        reuse, state->cache);
     if (!ym::isfinite(l)) {
         if (state->scn->log_error) state->scn->log_error("NaN detected");
         return;
@@ -2721,27 +5869,310 @@ void trace_sample(ytrace::trace_state* state, int i, int j, int s, ym::vec3f& l,
     if (params.pixel_clamp > 0) l = ym::clamplen(l, params.pixel_clamp);
 }
 
+//
+// Path state for wavefront tracing of one sample per pixel of a block. Each
+// field is stored in its own array, so that every stage streams only the
+// data it uses. Paths are indexed by pixel in scanline order.
+//
+struct wavefront_paths {
+    std::vector<sampler> smp;          // random number state
+    std::vector<ym::ray3f> ray;        // next ray to trace
+    std::vector<ray_cone> cone;        // cone of the next ray
+    std::vector<intersect_point> hit;  // hit of the next ray
+    std::vector<point> pt;             // current path vertex
+    std::vector<ym::vec3f> weight;     // path throughput
+    std::vector<int> queue;            // live paths
+
+    std::vector<point> shadow_lpt;   // light point of the shadow ray
+    std::vector<ym::vec3f> shadow_l;  // unoccluded light contribution
+    std::vector<int> shadow_queue;    // paths with a shadow ray
+};
+
+//
+// Samples of a block, one per pixel in scanline order.
+//
+struct block_samples {
+    std::vector<ym::vec3f> l;   // radiance
+    std::vector<point> pt;      // camera ray hit
+    std::vector<ym::vec2f> uv;  // offset in the pixel
+    wavefront_paths paths;      // path state for wavefront tracing
+    std::vector<light_reservoir> reservoirs;  // light reservoirs of the block
+};
+
+//
+// Traces one sample for each pixel of a block in wavefront order. All paths
+// advance one bounce at a time through separate stages: rays are intersected
+// together, hits are sorted by material, points are shaded and sample lights
+// and brdfs, and shadow rays are traced together. Random numbers are drawn
+// in the same order as shade_pathtrace(), which this matches.
+//
+template <rng_type rtype>
+static void trace_block_wavefront(trace_state* state, const ym::bbox2i& block,
+    int s, block_samples& samples) {
+    auto scn = state->scn;
+    auto& params = state->params;
+    auto& paths = samples.paths;
+    auto size = ym::diagonal(block);
+    auto npaths = size.x * size.y;
+    paths.smp.resize(npaths);
+    paths.ray.resize(npaths);
+    paths.cone.resize(npaths);
+    paths.hit.resize(npaths);
+    paths.pt.resize(npaths);
+    paths.weight.resize(npaths);
+    paths.shadow_lpt.resize(npaths);
+    paths.shadow_l.resize(npaths);
+
+    // generate camera rays
+    paths.queue.clear();
+    for (auto k = 0; k < npaths; k++) {
+        auto i = block.min.x + k % size.x, j = block.min.y + k / size.x;
+        auto smp = &paths.smp[k];
+        *smp = make_sampler<rtype>(i, j, s, eval_strata_nsamples(params, s));
+        samples.uv[k] = sample_next2f<rtype>(smp);
+        samples.l[k] = ym::zero3f;
+        auto uv = ym::vec2f{(i + samples.uv[k].x) / params.width,
+            1 - (j + samples.uv[k].y) / params.height};
+        paths.ray[k] = eval_camera(state->cam, uv, sample_next2f<rtype>(smp));
+        paths.cone[k] = eval_camera_cone(state->cam, params.height);
+        paths.weight[k] = {1, 1, 1};
+        paths.queue.push_back(k);
+    }
+
+    // material of a path hit, used as sorting key
+    auto hit_material = [scn, &paths](int k) -> const material* {
+        auto& hit = paths.hit[k];
+        return (hit) ? scn->instances[hit.iid]->mat : nullptr;
+    };
+
+    // advance all paths by one vertex
+    for (auto bounce = 0; !paths.queue.empty(); bounce++) {
+        // intersect rays, with camera rays possibly cached
+        for (auto k : paths.queue) {
+            if (!bounce)
+                paths.hit[k] = intersect_camera_ray(state,
+                    block.min.x + k % size.x, block.min.y + k / size.x, s,
+                    paths.ray[k]);
+            else
+                paths.hit[k] = intersect_scene_hit(scn, paths.ray[k]);
+        }
+
+        // sort hits by material, so that shading runs over coherent data
+        std::stable_sort(paths.queue.begin(), paths.queue.end(),
+            [&hit_material](int a, int b) {
+                return std::less<const material*>()(
+                    hit_material(a), hit_material(b));
+            });
+
+        // shade hits
+        auto nlive = 0;
+        paths.shadow_queue.clear();
+        for (auto qid = 0; qid < (int)paths.queue.size(); qid++) {
+            auto k = paths.queue[qid];
+            auto smp = &paths.smp[k];
+            auto& l = samples.l[k];
+            auto& weight = paths.weight[k];
+            auto bpt =
+                eval_hitpoint(scn, paths.hit[k], paths.ray[k], paths.cone[k]);
+
+            if (!bounce) {
+                // camera hit and emission
+                samples.pt[k] = bpt;
+                if (!bpt.ist || params.envmap_invisible) continue;
+                l = eval_emission(bpt);
+                if (bpt.no_reflectance() || scn->lights.empty()) continue;
+                if (params.max_depth <= 0) continue;
+            } else {
+                // direct – brdf, for the previous vertex
+                auto& pt = paths.pt[k];
+                auto bw = weight_brdfcos(pt, -bpt.wo);
+                auto bke = eval_emission(bpt);
+                auto bbc = eval_brdfcos(pt, -bpt.wo);
+                auto bld = bke * bbc * bw;
+                if (bld != ym::zero3f) {
+                    l += weight * bld *
+                         weight_mis(bw, weight_light(bpt, pt) *
+                                            weight_lights(scn, bpt, pt));
+                }
+
+                // skip recursion if path ends
+                if (bounce == params.max_depth) continue;
+                if (bpt.no_reflectance()) continue;
+
+                // continue path
+                weight *=
+                    eval_brdfcos(pt, -bpt.wo) * weight_brdfcos(pt, -bpt.wo);
+                if (weight == ym::zero3f) continue;
+
+                // roussian roulette
+                if (bounce > 3) {
+                    auto rrprob =
+                        1.0f - std::min(std::max(std::max(pt.rho.x, pt.rho.y),
+                                            pt.rho.z),
+                                   0.95f);
+                    if (sample_next1f<rtype>(smp) < rrprob) continue;
+                    weight *= 1 / (1 - rrprob);
+                }
+            }
+            paths.pt[k] = bpt;
+            auto& pt = paths.pt[k];
+
+            // direct – light, with the shadow ray traced below
+            auto ls = sample_direct<rtype>(
+                scn, pt, smp, (bounce) ? 1 : params.light_candidates, nullptr);
+            if (ls.ld != ym::zero3f) {
+                paths.shadow_l[k] =
+                    weight * ls.ld *
+                    weight_mis(ls.lw, weight_brdfcos(pt, -ls.lpt.wo));
+                paths.shadow_lpt[k] = ls.lpt;
+                paths.shadow_queue.push_back(k);
+            }
+
+            // next ray
+            paths.ray[k] = offset_ray(pt,
+                sample_brdfcos(pt, sample_next1f<rtype>(smp),
+                    sample_next2f<rtype>(smp)),
+                params);
+            paths.cone[k] = eval_scattered_cone(pt);
+            paths.queue[nlive++] = k;
+        }
+        paths.queue.resize(nlive);
+
+        // trace shadow rays
+        for (auto k : paths.shadow_queue) {
+            samples.l[k] += paths.shadow_l[k] *
+                            eval_transmission(scn, paths.pt[k],
+                                paths.shadow_lpt[k], params);
+        }
+    }
+
+    // check radiance as in trace_sample()
+    for (auto k = 0; k < npaths; k++) {
+        if (!samples.pt[k].ist || params.envmap_invisible) continue;
+        auto& l = samples.l[k];
+        if (!ym::isfinite(l)) {
+            if (scn->log_error) scn->log_error("NaN detected");
+            continue;
+        }
+        if (params.pixel_clamp > 0) l = ym::clamplen(l, params.pixel_clamp);
+    }
+}
+
+// Radius, in pixels, of the neighbors reused for light resampling.
+static const int light_reuse_radius = 8;
+
+//
+// Traces one sample for each pixel of a block reusing light reservoirs. Each
+// camera hit resamples its candidates together with the reservoirs of a few
+// random neighbors in the block from the previous sample. The pixel's own
+// reservoir is skipped, since reusing it would correlate the samples that are
+// averaged in the image. Reservoirs are copied before tracing, so that pixels
+// can be traced in any order. Since reservoirs are written without locking,
+// the samples of a block are never traced concurrently, also when rendering
+// asynchronously.
+//
+template <rng_type rtype>
+static void trace_block_reuse(trace_state* state, const ym::bbox2i& block,
+    int s, block_samples& samples) {
+    auto size = ym::diagonal(block);
+    auto width = state->params.width;
+    samples.reservoirs.resize(size.x * size.y);
+    for (auto k = 0; k < size.x * size.y; k++) {
+        auto i = block.min.x + k % size.x, j = block.min.y + k / size.x;
+        samples.reservoirs[k] = state->reservoirs[j * width + i];
+    }
+    for (auto k = 0; k < size.x * size.y; k++) {
+        auto i = block.min.x + k % size.x, j = block.min.y + k / size.x;
+        uint64_t sample_id = ((uint64_t)(i + 1)) << 0 |
+                             ((uint64_t)(j + 1)) << 15 |
+                             ((uint64_t)(s + 1)) << 30;
+        auto rng = ym::rng_pcg32();
+        ym::init(&rng, ym::hash_uint64(sample_id), 1);
+        auto reuse = light_reuse();
+        for (auto tries = 0; tries < 2 * max_light_reuse &&
+                             reuse.nreservoirs < max_light_reuse;
+             tries++) {
+            auto off = (ym::next2f(&rng) * 2.0f - ym::vec2f{1, 1}) *
+                       (light_reuse_radius + 0.5f);
+            auto ni = ym::clamp(i + (int)off.x, block.min.x, block.max.x - 1);
+            auto nj = ym::clamp(j + (int)off.y, block.min.y, block.max.y - 1);
+            if (ni == i && nj == j) continue;
+            reuse.reservoirs[reuse.nreservoirs++] =
+                &samples.reservoirs[(nj - block.min.y) * size.x +
+                                    (ni - block.min.x)];
+        }
+        reuse.out = &state->reservoirs[j * width + i];
+        *reuse.out = light_reservoir();
+        reuse.cam_pos = state->cam->frame.o;
+        samples.l[k] = ym::zero3f;
+        trace_sample<shader_type::pathtrace, rtype>(
+            state, i, j, s, samples.l[k], samples.pt[k], samples.uv[k], &reuse);
+    }
+}
+
+//
+// Traces one sample for each pixel of a block, one path at a time or in
+// wavefront order.
+//
+template <shader_type stype, rng_type rtype>
+static void trace_block_samples(trace_state* state, const ym::bbox2i& block,
+    int s, block_samples& samples) {
+    auto size = ym::diagonal(block);
+    samples.l.resize(size.x * size.y);
+    samples.pt.resize(size.x * size.y);
+    samples.uv.resize(size.x * size.y);
+    if (stype == shader_type::pathtrace && state->params.wavefront) {
+        trace_block_wavefront<rtype>(state, block, s, samples);
+        return;
+    }
+    if (stype == shader_type::pathtrace && !state->reservoirs.empty()) {
+        trace_block_reuse<rtype>(state, block, s, samples);
+        return;
+    }
+    for (auto k = 0; k < size.x * size.y; k++) {
+        samples.l[k] = ym::zero3f;
+        trace_sample<stype, rtype>(state, block.min.x + k % size.x,
+            block.min.y + k / size.x, s, samples.l[k], samples.pt[k],
+            samples.uv[k], nullptr);
+    }
+}
+
 //
 // Trace a block of samples
 //
-void trace_block_box(
+template <shader_type stype, rng_type rtype>
+static void trace_block_box(
     trace_state* state, int block_idx, int samples_min, int samples_max) {
     auto& block = state->blocks[block_idx];
-    for (auto j = block.min.y; j < block.max.y; j++) {
-        for (auto i = block.min.x; i < block.max.x; i++) {
-            for (auto s = samples_min; s < samples_max; s++) {
-                ytrace::point pt;
-                auto l = ym::zero3f;
-                auto uv = ym::zero2f;
-                trace_sample(state, i, j, s, l, pt, uv);
-                state->acc[{i, j}] += {l, 1};
-                state->weight[{i, j}] += 1;
-                state->img[{i, j}] = state->acc[{i, j}] / state->weight[{i, j}];
-                if (state->params.aux_buffers && pt.ist) {
-                    state->norm[{i, j}] += {pt.frame.z, 1};
-                    state->albedo[{i, j}] += {pt.rho, 1};
-                    auto d = length(pt.frame.o - state->cam->frame.o);
-                    state->depth[{i, j}] += {d, d, d, 1};
+    auto size = ym::diagonal(block);
+    static thread_local auto samples = block_samples();
+    for (auto s = samples_min; s < samples_max; s++) {
+        trace_block_samples<stype, rtype>(state, block, s, samples);
+        for (auto j = block.min.y; j < block.max.y; j++) {
+            for (auto i = block.min.x; i < block.max.x; i++) {
+                auto k = (j - block.min.y) * size.x + (i - block.min.x);
+                auto& pt = samples.pt[k];
+                auto& l = samples.l[k];
+                if (!state->lum.empty()) {
+                    auto y = luminance(l);
+                    state->lum[{i, j}] += {y, y * y};
+                }
+                auto& acc = state->acc[{i, j}];
+                acc += to_fixed({l, 1});
+                if (state->params.aux_buffers) {
+                    float v[aux_channels] = {0, 0, 0, 0, 0, 0, 0};
+                    if (pt.ist) {
+                        auto d = length(pt.frame.o - state->cam->frame.o);
+                        v[0] = pt.frame.z.x;
+                        v[1] = pt.frame.z.y;
+                        v[2] = pt.frame.z.z;
+                        v[3] = pt.rho.x;
+                        v[4] = pt.rho.y;
+                        v[5] = pt.rho.z;
+                        v[6] = d;
+                    }
+                    update_aux(state, j * state->acc.width() + i, v,
+                        (float)(acc.w / fixed_scale));
                 }
             }
         }
@@ -2749,65 +6180,84 @@ void trace_block_box(
 }
 
 //
-// Trace a block of samples
+// Trace a block of samples. Samples are splatted in buffers padded by the
+// filter size, kept by each thread across calls. The block interior is only
+// splatted by this block, whose samples are never traced concurrently, and is
+// added to the image without locking. Its
+// border, shared with the neighbors, is added under the locks of the 8x8
+// pixel cells it overlaps, that only adjacent blocks contend for.
 //
-void trace_block_filtered(
+template <shader_type stype, rng_type rtype, filter_type ftype>
+static void trace_block_filtered(
     trace_state* state, int block_idx, int samples_min, int samples_max) {
     static constexpr const int pad = 2;
+    static constexpr const int fs = filter_size<ftype>();
     auto& block = state->blocks[block_idx];
     auto block_size = ym::diagonal(block);
-    auto acc_buffer =
-        ym::image4f(block_size.x + pad * 2, block_size.y + pad * 2);
-    auto weight_buffer =
-        ym::imagef(block_size.x + pad * 2, block_size.y + pad * 2);
-    for (auto j = block.min.y; j < block.max.y; j++) {
-        for (auto i = block.min.x; i < block.max.x; i++) {
-            for (auto s = samples_min; s < samples_max; s++) {
-                ytrace::point pt;
-                auto l = ym::zero3f;
-                auto uv = ym::zero2f;
-                trace_sample(state, i, j, s, l, pt, uv);
-                if (state->filter) {
-                    auto bi = i - block.min.x, bj = j - block.min.y;
-                    for (auto fj = -state->filter_size;
-                         fj <= state->filter_size; fj++) {
-                        for (auto fi = -state->filter_size;
-                             fi <= state->filter_size; fi++) {
-                            auto w = filter_triangle(fi - uv.x + 0.5f) *
-                                     filter_triangle(fj - uv.y + 0.5f);
-                            acc_buffer[{bi + fi + pad, bj + fj + pad}] +=
-                                {l * w, w};
-                            weight_buffer[{bi + fi + pad, bj + fj + pad}] += w;
-                        }
+    static thread_local auto acc_buffer = ym::image<fixed4>();
+    static thread_local auto samples = block_samples();
+    acc_buffer.assign(
+        block_size.x + pad * 2, block_size.y + pad * 2, fixed4{0, 0, 0, 0});
+    for (auto s = samples_min; s < samples_max; s++) {
+        trace_block_samples<stype, rtype>(state, block, s, samples);
+        for (auto j = block.min.y; j < block.max.y; j++) {
+            for (auto i = block.min.x; i < block.max.x; i++) {
+                auto k = (j - block.min.y) * block_size.x + (i - block.min.x);
+                auto& l = samples.l[k];
+                auto& uv = samples.uv[k];
+                if (!state->lum.empty()) {
+                    auto y = luminance(l);
+                    state->lum[{i, j}] += {y, y * y};
+                }
+                auto bi = i - block.min.x, bj = j - block.min.y;
+                for (auto fj = -fs; fj <= fs; fj++) {
+                    for (auto fi = -fs; fi <= fs; fi++) {
+                        auto w = eval_filter<ftype>(fi - uv.x + 0.5f) *
+                                 eval_filter<ftype>(fj - uv.y + 0.5f);
+                        acc_buffer[{bi + fi + pad, bj + fj + pad}] +=
+                            to_fixed({l * w, w});
                     }
-                } else {
-                    auto bi = i - block.min.x, bj = j - block.min.y;
-                    acc_buffer[{bi + pad, bj + pad}] += {l, 1};
-                    weight_buffer[{bi + pad, bj + pad}] += 1;
                 }
             }
         }
     }
-    if (state->filter) {
-        std::unique_lock<std::mutex> lock_guard(state->image_mutex);
-        auto width = state->acc.width(), height = state->acc.height();
-        for (auto j = ym::max(block.min.y - state->filter_size, 0);
-             j < ym::min(block.max.y + state->filter_size, height); j++) {
-            for (auto i = ym::max(block.min.x - state->filter_size, 0);
-                 i < ym::min(block.max.x + state->filter_size, width); i++) {
-                auto bi = i - block.min.x, bj = j - block.min.y;
-                state->acc[{i, j}] += acc_buffer[{bi + pad, bj + pad}];
-                state->weight[{i, j}] += weight_buffer[{bi + pad, bj + pad}];
-                state->img[{i, j}] = state->acc[{i, j}] / state->weight[{i, j}];
-            }
+    auto width = state->acc.width(), height = state->acc.height();
+    auto commit = [state, &block](int i, int j) {
+        auto bi = i - block.min.x, bj = j - block.min.y;
+        state->acc[{i, j}] += acc_buffer[{bi + pad, bj + pad}];
+    };
+    auto inside = [&block](int i, int j) {
+        return i >= block.min.x + fs && i < block.max.x - fs &&
+               j >= block.min.y + fs && j < block.max.y - fs;
+    };
+
+    // interior
+    for (auto j = block.min.y + fs; j < block.max.y - fs; j++) {
+        for (auto i = block.min.x + fs; i < block.max.x - fs; i++) {
+            commit(i, j);
         }
-    } else {
-        for (auto j = block.min.y; j < block.max.y; j++) {
-            for (auto i = block.min.x; i < block.max.x; i++) {
-                auto bi = i - block.min.x, bj = j - block.min.y;
-                state->acc[{i, j}] += acc_buffer[{bi + pad, bj + pad}];
-                state->weight[{i, j}] += weight_buffer[{bi + pad, bj + pad}];
-                state->img[{i, j}] = state->acc[{i, j}] / state->weight[{i, j}];
+    }
+
+    // border, one cell at a time
+    auto rmin = ym::vec2i{
+        ym::max(block.min.x - fs, 0), ym::max(block.min.y - fs, 0)};
+    auto rmax = ym::vec2i{ym::min(block.max.x + fs, width),
+        ym::min(block.max.y + fs, height)};
+    auto ncells = (width + 7) / 8;
+    for (auto cj = rmin.y / 8; cj * 8 < rmax.y; cj++) {
+        for (auto ci = rmin.x / 8; ci * 8 < rmax.x; ci++) {
+            auto cmin = ym::vec2i{
+                ym::max(ci * 8, rmin.x), ym::max(cj * 8, rmin.y)};
+            auto cmax = ym::vec2i{ym::min(ci * 8 + 8, rmax.x),
+                ym::min(cj * 8 + 8, rmax.y)};
+            if (inside(cmin.x, cmin.y) && inside(cmax.x - 1, cmax.y - 1))
+                continue;
+            std::lock_guard<std::mutex> lock(
+                state->splat_locks[cj * ncells + ci]);
+            for (auto j = cmin.y; j < cmax.y; j++) {
+                for (auto i = cmin.x; i < cmax.x; i++) {
+                    if (!inside(i, j)) commit(i, j);
+                }
             }
         }
     }
@@ -2818,11 +6268,178 @@ void trace_block_filtered(
 //
 void trace_block(
     trace_state* state, int block_idx, int samples_min, int samples_max) {
-    if (state->filter)
-        return trace_block_filtered(state, block_idx, samples_min, samples_max);
+    state->trace_block(state, block_idx, samples_min, samples_max);
+}
+
+//
+// Checks whether the cached camera hits of a state are valid for rendering
+// scn with params, that is if camera rays and geometry are unchanged.
+//
+static bool is_hit_cache_valid(
+    const trace_state* state, const scene* scn, const trace_params& params) {
+    auto cam = scn->cameras[params.camera_id];
+    auto& ccam = state->hit_cache_cam;
+    auto& cparams = state->hit_cache_params;
+    return !state->hit_cache.empty() && state->hit_cache_scn == scn &&
+           state->hit_cache_version == scn->geometry_version &&
+           ccam.frame == cam->frame && ccam.yfov == cam->yfov &&
+           ccam.aspect == cam->aspect && ccam.aperture == cam->aperture &&
+           ccam.focus == cam->focus && cparams.width == params.width &&
+           cparams.height == params.height &&
+           cparams.nsamples == params.nsamples &&
+           cparams.rtype == params.rtype &&
+           is_adaptive(cparams) == is_adaptive(params) &&
+           cparams.adaptive_min_samples == params.adaptive_min_samples &&
+           cparams.hit_cache_samples == params.hit_cache_samples;
+}
+
+//
+// Pixels rendered with params, in the crop window clamped to the image or
+// in the whole image if the window is empty.
+//
+static ym::bbox2i eval_render_region(const trace_params& params) {
+    auto& crop = params.crop;
+    if (crop.max.x <= crop.min.x || crop.max.y <= crop.min.y)
+        return {{0, 0}, {params.width, params.height}};
+    auto size = ym::vec2i{params.width, params.height};
+    return {ym::clamp(crop.min, ym::zero2i, size),
+        ym::clamp(crop.max, ym::zero2i, size)};
+}
+
+//
+// Number of pixels in a region.
+//
+static inline long long eval_region_npixels(const ym::bbox2i& region) {
+    auto size = ym::diagonal(region);
+    return (long long)ym::max(size.x, 0) * ym::max(size.y, 0);
+}
+
+//
+// Sets the block render function of the state for the kernel_types it is
+// dispatched with and the filter of the state.
+//
+struct set_block_kernel_func {
+    trace_state* state;
+
+    template <typename types>
+    void operator()(types) const {
+        const auto stype = types::stype;
+        const auto rtype = types::rtype;
+        switch (state->params.ftype) {
+            case filter_type::box:
+                state->trace_block = trace_block_box<stype, rtype>;
+                break;
+            case filter_type::triangle:
+                state->trace_block = trace_block_filtered<stype, rtype,
+                    filter_type::triangle>;
+                break;
+            case filter_type::cubic:
+                state->trace_block =
+                    trace_block_filtered<stype, rtype, filter_type::cubic>;
+                break;
+            case filter_type::catmull_rom:
+                state->trace_block = trace_block_filtered<stype, rtype,
+                    filter_type::catmull_rom>;
+                break;
+            case filter_type::mitchell:
+                state->trace_block = trace_block_filtered<stype, rtype,
+                    filter_type::mitchell>;
+                break;
+            default:
+                assert(false);
+                state->trace_block = trace_block_box<stype, rtype>;
+        }
+    }
+};
+
+//
+// Initialize state
+//
+void init_state(
+    trace_state* state, const scene* scn, const trace_params& params) {
+    if (state->pool) {
+        if (params.parallel)
+            yu::concurrent::clear_pool(state->pool);
+        else
+            yu::concurrent::free_pool(state->pool);
+    } else {
+        if (params.parallel) state->pool = yu::concurrent::make_pool();
+    }
+    state->img = ym::image4f();
+    state->acc =
+        ym::image<fixed4>(params.width, params.height, fixed4{0, 0, 0, 0});
+    auto naux = (params.aux_buffers) ?
+                    (size_t)params.width * params.height * aux_channels :
+                    0;
+    state->aux.assign((params.aux_half) ? 0 : naux, 0);
+    state->aux_half.assign((params.aux_half) ? naux : 0, 0);
+    state->cur_sample = ym::max(params.sample_start, 0);
+    state->region = eval_render_region(params);
+    auto region_size = ym::diagonal(state->region);
+    state->blocks = make_blocks(
+        ym::max(region_size.x, 0), ym::max(region_size.y, 0), 32);
+    for (auto& block : state->blocks) {
+        block.min += state->region.min;
+        block.max += state->region.min;
+    }
+    state->block_cost.assign(state->blocks.size(), 0);
+    state->splat_locks = std::vector<std::mutex>(
+        ((params.width + 7) / 8) * ((params.height + 7) / 8));
+    state->nthreads =
+        (state->pool) ? yu::concurrent::get_pool_size(state->pool) : 1;
+    state->nthreads = std::max(state->nthreads, 1);
+    if (is_adaptive(params)) {
+        state->lum = ym::image2f(params.width, params.height);
+        state->block_nsamples.assign(state->blocks.size(), 0);
+        state->block_error.assign(state->blocks.size(), FLT_MAX);
+    } else {
+        state->lum = ym::image2f();
+        state->block_nsamples.clear();
+        state->block_error.clear();
+    }
+    state->used_samples = 0;
+    state->scn = scn;
+    state->params = params;
+    state->scene_hash = 0;
+
+    state->cam = scn->cameras[params.camera_id];
+
+    if (params.hit_cache_samples <= 0) {
+        state->hit_cache = {};
+    } else if (!is_hit_cache_valid(state, scn, params)) {
+        state->hit_cache.assign((size_t)params.width * params.height *
+                                    params.hit_cache_samples,
+            cached_hit());
+        state->hit_cache_scn = scn;
+        state->hit_cache_version = scn->geometry_version;
+        state->hit_cache_cam = *state->cam;
+        state->hit_cache_params = params;
+    }
+
+    if (params.light_reuse && params.stype == shader_type::pathtrace &&
+        !params.wavefront)
+        state->reservoirs.assign(
+            (size_t)params.width * params.height, light_reservoir());
     else
-        return trace_block_box(state, block_idx, samples_min, samples_max);
+        state->reservoirs = {};
+
+    if (state->guide) delete state->guide;
+    state->guide = nullptr;
+    if (params.guiding && params.stype == shader_type::pathtrace &&
+        !params.wavefront)
+        state->guide = make_guide(scn, params.guiding_memory);
+
+    if (state->cache) delete state->cache;
+    state->cache = nullptr;
+    if (params.radiance_cache && params.stype == shader_type::pathtrace &&
+        !params.wavefront)
+        state->cache = make_radiance_cache(scn, params.radiance_cache_cell,
+            params.radiance_cache_memory, params.radiance_cache_samples);
+
+    dispatch_kernel(
+        params.stype, params.rtype, set_block_kernel_func{state});
 }
+
 //
 // Clear state
 //
@@ -2831,54 +6448,808 @@ void free_state(trace_state*& state) {
     state = nullptr;
 }
 
+//
+// Runs a task on a list of blocks with work stealing. The list is cut in
+// contiguous runs, one per thread, so that each thread walks nearby blocks
+// along the curve. A thread takes blocks from the front of its run and, when
+// done, steals from the back of the other runs. The time taken by each block
+// is recorded for split_blocks().
+//
+static void parallel_for_blocks(trace_state* state,
+    const std::vector<int>& block_ids,
+    const std::function<void(int block_idx)>& task) {
+    auto run_task = [state, &task](int block_idx) {
+        auto start = std::chrono::steady_clock::now();
+        task(block_idx);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        state->block_cost[block_idx] =
+            std::chrono::duration<float>(elapsed).count();
+    };
+    if (!state->pool) {
+        for (auto block_idx : block_ids) run_task(block_idx);
+        return;
+    }
+
+    // range of blocks left to a thread
+    struct block_run {
+        std::mutex mutex;
+        int begin = 0, end = 0;
+    };
+    auto nruns = ym::max(1, ym::min(state->nthreads, (int)block_ids.size()));
+    auto runs = std::vector<block_run>(nruns);
+    for (auto rid = 0; rid < nruns; rid++) {
+        runs[rid].begin = (int)((size_t)block_ids.size() * rid / nruns);
+        runs[rid].end = (int)((size_t)block_ids.size() * (rid + 1) / nruns);
+    }
+    yu::concurrent::parallel_for(
+        state->pool, nruns, [&block_ids, &runs, &run_task, nruns](int rid) {
+            while (true) {
+                auto block_idx = -1;
+                {
+                    std::lock_guard<std::mutex> lock(runs[rid].mutex);
+                    if (runs[rid].begin < runs[rid].end)
+                        block_idx = block_ids[runs[rid].begin++];
+                }
+                for (auto offset = 1; offset < nruns && block_idx < 0;
+                     offset++) {
+                    auto& run = runs[(rid + offset) % nruns];
+                    std::lock_guard<std::mutex> lock(run.mutex);
+                    if (run.begin < run.end) block_idx = block_ids[--run.end];
+                }
+                if (block_idx < 0) return;
+                run_task(block_idx);
+            }
+        });
+}
+
+//
+// Estimates the error of a block after ns samples per pixel, as the average
+// over its pixels of the standard error of the luminance relative to its
+// mean. A small offset keeps dark pixels from dominating the estimate.
+//
+static float eval_block_error(const trace_state* state, int block_idx, int ns) {
+    if (ns < 2) return FLT_MAX;
+    auto& block = state->blocks[block_idx];
+    auto err = 0.0f;
+    for (auto j = block.min.y; j < block.max.y; j++) {
+        for (auto i = block.min.x; i < block.max.x; i++) {
+            auto& lum = state->lum[{i, j}];
+            auto mean = lum.x / ns;
+            auto var = std::max(0.0f, lum.y / ns - mean * mean) * ns / (ns - 1);
+            err += std::sqrt(var / ns) / (mean + 0.01f);
+        }
+    }
+    auto size = ym::diagonal(block);
+    return err / (size.x * size.y);
+}
+
+//
+// Trace a batch of samples in the blocks that are not converged. See
+// trace_next_samples().
+//
+static bool trace_next_samples_adaptive(trace_state* state, int nsamples) {
+    auto& params = state->params;
+
+    // pick the blocks still to render, with the noisiest first
+    auto active = std::vector<int>();
+    for (auto idx = 0; idx < (int)state->blocks.size(); idx++) {
+        auto ns = state->block_nsamples[idx];
+        if (ns >= params.nsamples) continue;
+        if (ns >= params.adaptive_min_samples &&
+            state->block_error[idx] < params.adaptive_error)
+            continue;
+        active.push_back(idx);
+    }
+    std::stable_sort(active.begin(), active.end(), [state](int a, int b) {
+        return state->block_error[a] > state->block_error[b];
+    });
+
+    // assign samples to blocks within the budget
+    auto spp = (params.adaptive_budget) ? params.adaptive_budget :
+                                          params.nsamples;
+    auto npixels = ym::max(eval_region_npixels(state->region), 1ll);
+    auto budget = (long long)spp * npixels - state->used_samples;
+    auto pass = std::vector<ym::vec2i>();
+    for (auto idx : active) {
+        // complete the current stratified set, or part of it
+        auto ns = state->block_nsamples[idx];
+        auto set_end = (ns < params.adaptive_min_samples) ?
+                           params.adaptive_min_samples :
+                           2 * eval_strata_nsamples(params, ns);
+        auto count = ym::min(nsamples, set_end - ns);
+        if (ns < params.adaptive_min_samples)
+            count = ym::max(count, params.adaptive_min_samples - ns);
+        count = ym::min(count, params.nsamples - ns);
+        auto size = ym::diagonal(state->blocks[idx]);
+        count = (int)std::min((long long)count, budget / (size.x * size.y));
+        if (count <= 0) continue;
+        budget -= (long long)count * size.x * size.y;
+        pass.push_back({idx, count});
+    }
+    if (pass.empty()) return false;
+
+    // trace blocks in curve order and update their error
+    std::sort(pass.begin(), pass.end(),
+        [](const ym::vec2i& a, const ym::vec2i& b) { return a.x < b.x; });
+    auto block_ids = std::vector<int>();
+    auto counts = std::vector<int>(state->blocks.size(), 0);
+    for (auto& item : pass) {
+        block_ids.push_back(item.x);
+        counts[item.x] = item.y;
+    }
+    parallel_for_blocks(state, block_ids, [state, &counts](int idx) {
+        auto ns = state->block_nsamples[idx];
+        ytrace::trace_block(state, idx, ns, ns + counts[idx]);
+        state->block_nsamples[idx] = ns + counts[idx];
+        state->block_error[idx] =
+            eval_block_error(state, idx, ns + counts[idx]);
+    });
+    for (auto& item : pass) {
+        auto size = ym::diagonal(state->blocks[item.x]);
+        state->used_samples += (long long)item.y * size.x * size.y;
+    }
+    state->cur_sample = (int)(state->used_samples / npixels);
+    if (state->guide && state->cur_sample >= state->guide->pass_end)
+        end_guide_pass(state->guide, state->cur_sample);
+    if (state->cache && state->cur_sample >= state->cache->fill_end)
+        state->cache->filling = false;
+    if (state->pool) split_blocks(state);
+    return true;
+}
+
 //
 // Trace a batch of samples.
 //
 bool trace_next_samples(trace_state* state, int nsamples) {
-    if (state->cur_sample >= state->params.nsamples) return false;
-    nsamples = ym::min(nsamples, state->params.nsamples - state->cur_sample);
-    if (state->pool) {
-        yu::concurrent::parallel_for(
-            state->pool, (int)state->blocks.size(), [state, nsamples](int idx) {
-                ytrace::trace_block(state, idx, state->cur_sample,
-                    state->cur_sample + nsamples);
-            });
-    } else {
-        for (auto idx = 0; idx < (int)state->blocks.size(); idx++) {
+    if (is_adaptive(state->params))
+        return trace_next_samples_adaptive(state, nsamples);
+    auto sample_end = eval_sample_end(state->params);
+    if (state->cur_sample >= sample_end) return false;
+    nsamples = ym::min(nsamples, sample_end - state->cur_sample);
+    auto block_ids = std::vector<int>(state->blocks.size());
+    for (auto idx = 0; idx < (int)block_ids.size(); idx++) block_ids[idx] = idx;
+    // samples are traced up to the end of each guide training pass, so that
+    // the guide is refined before the next one, and up to the end of the
+    // radiance cache filling, so that later samples read the full cache
+    while (nsamples > 0) {
+        auto count = nsamples;
+        if (state->guide)
+            count = ym::min(count, state->guide->pass_end - state->cur_sample);
+        if (state->cache && state->cache->filling)
+            count = ym::min(count, state->cache->fill_end - state->cur_sample);
+        parallel_for_blocks(state, block_ids, [state, count](int idx) {
             ytrace::trace_block(
-                state, idx, state->cur_sample, state->cur_sample + nsamples);
+                state, idx, state->cur_sample, state->cur_sample + count);
+        });
+        state->cur_sample += count;
+        nsamples -= count;
+        if (state->guide && state->cur_sample >= state->guide->pass_end)
+            end_guide_pass(state->guide, state->cur_sample);
+        if (state->cache && state->cur_sample >= state->cache->fill_end)
+            state->cache->filling = false;
+    }
+    if (state->pool) split_blocks(state);
+    return true;
+}
+
+//
+// Checkpoint signature and version
+//
+static const char checkpoint_magic[8] = {
+    'y', 't', 'r', 'a', 'c', 'e', 'c', 'k'};
+static const int checkpoint_version = 3;
+
+//
+// Hashes bytes with 64 bit FNV-1a.
+//
+static inline void hash_bytes(uint64_t& h, const void* data, size_t size) {
+    auto bytes = (const unsigned char*)data;
+    for (auto i = (size_t)0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+}
+
+//
+// Hashes a value with hash_bytes().
+//
+template <typename T>
+static inline void hash_value(uint64_t& h, const T& v) {
+    hash_bytes(h, &v, sizeof(v));
+}
+
+//
+// Index of an element in a scene array, or -1 if null.
+//
+template <typename T>
+static inline int get_index(const std::vector<T*>& elems, const T* elem) {
+    if (!elem) return -1;
+    return (int)(std::find(elems.begin(), elems.end(), elem) - elems.begin());
+}
+
+//
+// Hashes the full resolution pixels of a texture and the way they are
+// stored. Paged textures are hashed from their tiled file.
+//
+static void hash_texture(uint64_t& h, const texture* txt) {
+    hash_value(h, txt->width);
+    hash_value(h, txt->height);
+    hash_value(h, txt->format);
+    hash_value(h, txt->srgb);
+    if (txt->file) {
+        auto tf = txt->file;
+        hash_value(h, tf->ldr);
+        auto size = (uint64_t)tf->npages[0].x * tf->npages[0].y *
+                    texture_page_size * texture_page_size *
+                    ((tf->ldr) ? sizeof(ym::vec4b) : sizeof(ym::vec4f));
+        char chunk[65536];
+        std::lock_guard<std::mutex> lock(tf->mutex);
+        if (!seek_file(tf->file, tf->offsets[0])) return;
+        while (size > 0) {
+            auto n = fread(chunk, 1,
+                (size_t)std::min(size, (uint64_t)sizeof(chunk)), tf->file);
+            if (!n) break;
+            hash_bytes(h, chunk, n);
+            size -= n;
         }
+    } else if (!txt->hdr.empty()) {
+        hash_bytes(h, txt->hdr[0].pixels.data(),
+            txt->hdr[0].pixels.size() * sizeof(ym::vec4f));
+    } else if (!txt->ldr.empty()) {
+        hash_bytes(h, txt->ldr[0].pixels.data(),
+            txt->ldr[0].pixels.size() * sizeof(ym::vec4b));
+    } else if (!txt->gray.empty()) {
+        hash_bytes(h, txt->gray[0].pixels.data(), txt->gray[0].pixels.size());
+    } else if (!txt->blocks.empty()) {
+        hash_bytes(h, txt->blocks[0].blocks.data(),
+            txt->blocks[0].blocks.size() * sizeof(uint64_t));
+    }
+}
+
+//
+// Hashes the scene data that changes the rendered image, so that a checkpoint
+// is not resumed on a different scene. Textures are hashed by content, which
+// takes a pass over all texels, so the hash is computed once per state.
+//
+static uint64_t hash_scene(const scene* scn) {
+    auto h = (uint64_t)14695981039346656037ull;
+    for (auto cam : scn->cameras) hash_value(h, *cam);
+    for (auto txt : scn->textures) hash_texture(h, txt);
+    for (auto env : scn->environments) {
+        hash_value(h, env->frame);
+        hash_value(h, env->ke);
+        hash_value(h, get_index(scn->textures, env->ke_txt));
     }
-    state->cur_sample += nsamples;
+    for (auto shp : scn->shapes) {
+        hash_value(h, shp->nelems);
+        hash_value(h, shp->nverts);
+        if (shp->points) hash_bytes(h, shp->points, shp->nelems * sizeof(int));
+        if (shp->lines)
+            hash_bytes(h, shp->lines, shp->nelems * sizeof(ym::vec2i));
+        if (shp->triangles)
+            hash_bytes(h, shp->triangles, shp->nelems * sizeof(ym::vec3i));
+        hash_bytes(h, shp->pos, shp->nverts * sizeof(ym::vec3f));
+        if (shp->norm)
+            hash_bytes(h, shp->norm, shp->nverts * sizeof(ym::vec3f));
+        if (shp->texcoord)
+            hash_bytes(h, shp->texcoord, shp->nverts * sizeof(ym::vec2f));
+        if (shp->color)
+            hash_bytes(h, shp->color, shp->nverts * sizeof(ym::vec4f));
+        if (shp->radius)
+            hash_bytes(h, shp->radius, shp->nverts * sizeof(ym::vec1f));
+        if (shp->tangsp)
+            hash_bytes(h, shp->tangsp, shp->nverts * sizeof(ym::vec4f));
+    }
+    for (auto mat : scn->materials) {
+        auto& txts = scn->textures;
+        hash_value(h, mat->rtype);
+        hash_value(h, mat->ke);
+        hash_value(h, get_index(txts, mat->ke_txt));
+        hash_value(h, get_index(txts, mat->norm_txt));
+        hash_value(h, get_index(txts, mat->occ_txt));
+        hash_value(h, mat->double_sided);
+        switch (mat->rtype) {
+            case reflectance_type::none: break;
+            case reflectance_type::matte:
+                hash_value(h, mat->matte.kd);
+                hash_value(h, mat->matte.op);
+                hash_value(h, get_index(txts, mat->matte.kd_txt));
+                hash_value(h, get_index(txts, mat->matte.op_txt));
+                break;
+            case reflectance_type::microfacet:
+                hash_value(h, mat->microfacet.kd);
+                hash_value(h, mat->microfacet.ks);
+                hash_value(h, mat->microfacet.kt);
+                hash_value(h, mat->microfacet.rs);
+                hash_value(h, mat->microfacet.op);
+                hash_value(h, mat->microfacet.use_phong);
+                hash_value(h, get_index(txts, mat->microfacet.kd_txt));
+                hash_value(h, get_index(txts, mat->microfacet.ks_txt));
+                hash_value(h, get_index(txts, mat->microfacet.kt_txt));
+                hash_value(h, get_index(txts, mat->microfacet.rs_txt));
+                hash_value(h, get_index(txts, mat->microfacet.op_txt));
+                break;
+            case reflectance_type::gltf_metallic_roughness:
+                hash_value(h, mat->metalrough.kb);
+                hash_value(h, mat->metalrough.km);
+                hash_value(h, mat->metalrough.rs);
+                hash_value(h, mat->metalrough.op);
+                hash_value(h, get_index(txts, mat->metalrough.kb_txt));
+                hash_value(h, get_index(txts, mat->metalrough.km_txt));
+                break;
+            case reflectance_type::gltf_specular_glossiness:
+                hash_value(h, mat->specgloss.kd);
+                hash_value(h, mat->specgloss.ks);
+                hash_value(h, mat->specgloss.rs);
+                hash_value(h, mat->specgloss.op);
+                hash_value(h, get_index(txts, mat->specgloss.kd_txt));
+                hash_value(h, get_index(txts, mat->specgloss.ks_txt));
+                break;
+            case reflectance_type::thin_glass:
+                hash_value(h, mat->thin_glass.ks);
+                hash_value(h, mat->thin_glass.kt);
+                hash_value(h, get_index(txts, mat->thin_glass.ks_txt));
+                hash_value(h, get_index(txts, mat->thin_glass.kt_txt));
+                break;
+        }
+    }
+    for (auto ist : scn->instances) {
+        hash_value(h, ist->frame);
+        hash_value(h, get_index(scn->shapes, ist->shp));
+        hash_value(h, get_index(scn->materials, ist->mat));
+    }
+    return h;
+}
+
+//
+// Appends values to a checkpoint buffer.
+//
+template <typename T>
+static inline void write_values(
+    std::vector<char>& buf, const T* v, size_t n) {
+    auto bytes = (const char*)v;
+    buf.insert(buf.end(), bytes, bytes + n * sizeof(T));
+}
+
+//
+// Appends an array to a checkpoint buffer, preceded by its size.
+//
+template <typename T>
+static inline void write_array(
+    std::vector<char>& buf, const std::vector<T>& v) {
+    auto n = (uint64_t)v.size();
+    write_values(buf, &n, 1);
+    write_values(buf, v.data(), v.size());
+}
+
+//
+// Reads values from a checkpoint buffer at pos. Returns false if the buffer
+// is too short.
+//
+template <typename T>
+static inline bool read_values(
+    const std::vector<char>& buf, size_t& pos, T* v, size_t n) {
+    if (pos + n * sizeof(T) > buf.size()) return false;
+    memcpy((void*)v, buf.data() + pos, n * sizeof(T));
+    pos += n * sizeof(T);
     return true;
 }
 
 //
-// Starts an anyncrhounous renderer with a maximum of 256 samples.
+// Reads an array from a checkpoint buffer, checking its size.
 //
-void trace_async_start(trace_state* state) {
-    for (auto sample = 0; sample < state->params.nsamples; sample++) {
-        for (auto block_idx = 0; block_idx < state->blocks.size();
-             block_idx++) {
-            yu::concurrent::run_async(
-                state->pool, [state, sample, block_idx]() {
-                    ytrace::trace_block(state, block_idx, sample, sample + 1);
-                    if (block_idx == state->blocks.size() - 1) {
-                        state->cur_sample++;
-                    }
-                });
+template <typename T>
+static inline bool read_array(
+    const std::vector<char>& buf, size_t& pos, std::vector<T>& v) {
+    auto n = (uint64_t)0;
+    if (!read_values(buf, pos, &n, 1)) return false;
+    if (n > (buf.size() - pos) / sizeof(T)) return false;
+    v.resize(n);
+    return read_values(buf, pos, v.data(), v.size());
+}
+
+//
+// Writes the params that change the traced samples one by one, so that the
+// checkpoint format does not depend on the layout of trace_params. The
+// number of samples, sample_end and adaptive_budget are left out since a
+// resumed render may extend them, as is parallel.
+//
+static std::vector<char> write_checkpoint_params(const trace_params& params) {
+    auto buf = std::vector<char>();
+    write_values(buf, &params.camera_id, 1);
+    write_values(buf, &params.width, 1);
+    write_values(buf, &params.height, 1);
+    write_values(buf, &params.stype, 1);
+    write_values(buf, &params.wavefront, 1);
+    write_values(buf, &params.rtype, 1);
+    write_values(buf, &params.ftype, 1);
+    write_values(buf, &params.aux_buffers, 1);
+    write_values(buf, &params.aux_half, 1);
+    write_values(buf, &params.amb, 1);
+    write_values(buf, &params.envmap_invisible, 1);
+    write_values(buf, &params.min_depth, 1);
+    write_values(buf, &params.max_depth, 1);
+    write_values(buf, &params.pixel_clamp, 1);
+    write_values(buf, &params.ray_eps, 1);
+    write_values(buf, &params.adaptive_error, 1);
+    write_values(buf, &params.adaptive_min_samples, 1);
+    write_values(buf, &params.hit_cache_samples, 1);
+    write_values(buf, &params.guiding, 1);
+    write_values(buf, &params.guiding_memory, 1);
+    write_values(buf, &params.light_candidates, 1);
+    write_values(buf, &params.light_reuse, 1);
+    write_values(buf, &params.radiance_cache, 1);
+    write_values(buf, &params.radiance_cache_samples, 1);
+    write_values(buf, &params.radiance_cache_cell, 1);
+    write_values(buf, &params.radiance_cache_memory, 1);
+    write_values(buf, &params.crop, 1);
+    write_values(buf, &params.sample_start, 1);
+    return buf;
+}
+
+//
+// Scene hash of a state, computed on first use.
+//
+static uint64_t get_scene_hash(trace_state* state) {
+    if (!state->scene_hash) state->scene_hash = hash_scene(state->scn);
+    return state->scene_hash;
+}
+
+//
+// Saves a checkpoint of the progressive state.
+//
+void save_checkpoint(trace_state* state, const std::string& filename) {
+    if (state->checkpoint_thread.joinable()) state->checkpoint_thread.join();
+    auto buf = std::vector<char>();
+    auto npixels = (size_t)state->acc.width() * state->acc.height();
+    auto hash = get_scene_hash(state);
+    write_values(buf, checkpoint_magic, 8);
+    write_values(buf, &checkpoint_version, 1);
+    write_values(buf, &hash, 1);
+    write_array(buf, write_checkpoint_params(state->params));
+    write_values(buf, &state->cur_sample, 1);
+    write_values(buf, &state->used_samples, 1);
+    write_values(buf, state->acc.data(), npixels);
+    write_array(buf, state->aux);
+    write_array(buf, state->aux_half);
+    write_values(buf, state->lum.data(), state->lum.empty() ? 0 : npixels);
+    write_array(buf, state->blocks);
+    write_array(buf, state->block_cost);
+    write_array(buf, state->block_nsamples);
+    write_array(buf, state->block_error);
+    auto scn = state->scn;
+    state->checkpoint_thread =
+        std::thread([scn, filename, buf = std::move(buf)]() {
+            auto tmpname = filename + ".tmp";
+            auto f = fopen(tmpname.c_str(), "wb");
+            auto ok = f && fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+            if (f) ok = !fclose(f) && ok;
+#ifdef _WIN32
+            if (ok) remove(filename.c_str());
+#endif
+            if (ok) ok = !rename(tmpname.c_str(), filename.c_str());
+            if (!ok && scn->log_error)
+                scn->log_error(("cannot write checkpoint " + filename).c_str());
+        });
+}
+
+//
+// Loads a checkpoint in the progressive state.
+//
+bool load_checkpoint(trace_state* state, const scene* scn,
+    const trace_params& params, const std::string& filename) {
+    init_state(state, scn, params);
+    auto f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    auto buf = std::vector<char>();
+    char chunk[65536];
+    while (auto n = fread(chunk, 1, sizeof(chunk), f))
+        buf.insert(buf.end(), chunk, chunk + n);
+    fclose(f);
+
+    auto pos = (size_t)0;
+    char magic[8];
+    auto version = 0;
+    auto hash = (uint64_t)0;
+    auto saved = std::vector<char>();
+    if (!read_values(buf, pos, magic, 8) ||
+        memcmp(magic, checkpoint_magic, 8) ||
+        !read_values(buf, pos, &version, 1) || version != checkpoint_version ||
+        !read_values(buf, pos, &hash, 1) || hash != get_scene_hash(state) ||
+        !read_array(buf, pos, saved) ||
+        saved != write_checkpoint_params(params))
+        return false;
+
+    auto npixels = (size_t)state->acc.width() * state->acc.height();
+    auto aux_size = state->aux.size(), aux_half_size = state->aux_half.size();
+    if (!read_values(buf, pos, &state->cur_sample, 1) ||
+        !read_values(buf, pos, &state->used_samples, 1) ||
+        !read_values(buf, pos, state->acc.data(), npixels) ||
+        !read_array(buf, pos, state->aux) || state->aux.size() != aux_size ||
+        !read_array(buf, pos, state->aux_half) ||
+        state->aux_half.size() != aux_half_size ||
+        !read_values(
+            buf, pos, state->lum.data(), state->lum.empty() ? 0 : npixels) ||
+        !read_array(buf, pos, state->blocks) ||
+        !read_array(buf, pos, state->block_cost) ||
+        !read_array(buf, pos, state->block_nsamples) ||
+        !read_array(buf, pos, state->block_error) ||
+        state->block_cost.size() != state->blocks.size() ||
+        (state->lum.empty() ?
+                !state->block_nsamples.empty() :
+                state->block_nsamples.size() != state->blocks.size() ||
+                    state->block_error.size() != state->blocks.size())) {
+        init_state(state, scn, params);
+        return false;
+    }
+    // the guide and the radiance cache are not saved, so they restart
+    // training and filling from the samples read
+    if (state->guide) state->guide->pass_end = state->cur_sample + 1;
+    if (state->cache) {
+        state->cache->fill_end =
+            state->cur_sample + params.radiance_cache_samples;
+        state->cache->filling = params.radiance_cache_samples > 0;
+    }
+    return true;
+}
+
+//
+// Partial file signature and version
+//
+static const char partial_magic[8] = {'y', 't', 'r', 'a', 'c', 'e', 'p', 't'};
+static const int partial_version = 2;
+
+//
+// Saves the samples of the state to a partial file. The region saved is the
+// crop window grown by the largest filter radius, within the image.
+//
+bool save_partial(const trace_state* state, const std::string& filename) {
+    static constexpr const int pad = 2;
+    auto width = state->acc.width(), height = state->acc.height();
+    auto region = state->region;
+    auto size = ym::vec2i{width, height};
+    region.min = ym::clamp(region.min - ym::vec2i{pad, pad}, ym::zero2i, size);
+    region.max = ym::clamp(region.max + ym::vec2i{pad, pad}, ym::zero2i, size);
+    auto buf = std::vector<char>();
+    write_values(buf, partial_magic, 8);
+    write_values(buf, &partial_version, 1);
+    write_values(buf, &width, 1);
+    write_values(buf, &height, 1);
+    write_values(buf, &region, 1);
+    for (auto j = region.min.y; j < region.max.y; j++)
+        write_values(buf, &state->acc[{region.min.x, j}],
+            ym::max(region.max.x - region.min.x, 0));
+    auto f = fopen(filename.c_str(), "wb");
+    auto ok = f && fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    if (f) ok = !fclose(f) && ok;
+    return ok;
+}
+
+//
+// Merges partial files in an image.
+//
+bool merge_partials(
+    const std::vector<std::string>& filenames, ym::image4f& img) {
+    auto acc = ym::image<fixed4>();
+    for (auto& filename : filenames) {
+        auto f = fopen(filename.c_str(), "rb");
+        if (!f) return false;
+        auto buf = std::vector<char>();
+        char chunk[65536];
+        while (auto n = fread(chunk, 1, sizeof(chunk), f))
+            buf.insert(buf.end(), chunk, chunk + n);
+        fclose(f);
+
+        auto pos = (size_t)0;
+        char magic[8];
+        auto version = 0, width = 0, height = 0;
+        auto region = ym::bbox2i();
+        if (!read_values(buf, pos, magic, 8) ||
+            memcmp(magic, partial_magic, 8) ||
+            !read_values(buf, pos, &version, 1) ||
+            version != partial_version || !read_values(buf, pos, &width, 1) ||
+            !read_values(buf, pos, &height, 1) ||
+            !read_values(buf, pos, &region, 1) || region.min.x < 0 ||
+            region.min.y < 0 || region.max.x > width ||
+            region.max.y > height)
+            return false;
+        if (acc.empty())
+            acc = ym::image<fixed4>(width, height, fixed4{0, 0, 0, 0});
+        if (acc.width() != width || acc.height() != height) return false;
+        auto part = fixed4();
+        for (auto j = region.min.y; j < region.max.y; j++) {
+            for (auto i = region.min.x; i < region.max.x; i++) {
+                if (!read_values(buf, pos, &part, 1)) return false;
+                acc[{i, j}] += part;
+            }
+        }
+    }
+    img.assign(acc.width(), acc.height(), ym::zero4f);
+    for (auto j = 0; j < acc.height(); j++) {
+        for (auto i = 0; i < acc.width(); i++) {
+            if (acc[{i, j}].w) img[{i, j}] = resolve_fixed(acc[{i, j}]);
         }
     }
+    return true;
+}
+
+static void trace_async_sample(trace_state* state, int sample);
+
+//
+// Traces one sample of a block for the asynchronous renderer. The last block
+// to finish the sample ends the guide training pass and the radiance cache
+// filling, if due, and queues the next one.
+//
+static void trace_async_block(trace_state* state, int block_idx, int sample) {
+    ytrace::trace_block(state, block_idx, sample, sample + 1);
+    if (--state->async_pending) return;
+    state->cur_sample = sample + 1;
+    if (state->guide && state->cur_sample >= state->guide->pass_end)
+        end_guide_pass(state->guide, state->cur_sample);
+    if (state->cache && state->cur_sample >= state->cache->fill_end)
+        state->cache->filling = false;
+    trace_async_sample(state, sample + 1);
+}
+
+//
+// Queues one sample of all blocks for the asynchronous renderer. Samples are
+// queued one after the other, so that the samples of a block never run
+// concurrently, as the block buffers and light reservoirs require.
+//
+static void trace_async_sample(trace_state* state, int sample) {
+    if (sample >= eval_sample_end(state->params)) return;
+    std::lock_guard<std::mutex> lock(state->async_mutex);
+    if (state->async_stopped) return;
+    state->async_pending = (int)state->blocks.size();
+    for (auto block_idx = 0; block_idx < state->blocks.size(); block_idx++) {
+        yu::concurrent::run_async(state->pool, [state, block_idx, sample]() {
+            trace_async_block(state, block_idx, sample);
+        });
+    }
+}
+
+//
+// Starts an asynchronous renderer from the current sample.
+//
+void trace_async_start(trace_state* state) {
+    {
+        std::lock_guard<std::mutex> lock(state->async_mutex);
+        state->async_stopped = false;
+    }
+    trace_async_sample(state, state->cur_sample);
 }
 
 //
-// Stop the asynchronous renderer.
+// Stop the asynchronous renderer, waiting for the blocks being traced.
 //
 void trace_async_stop(trace_state* state) {
     if (!state->pool) return;
-    yu::concurrent::clear_pool(state->pool);
+    {
+        std::lock_guard<std::mutex> lock(state->async_mutex);
+        state->async_stopped = true;
+        yu::concurrent::clear_pool(state->pool);
+    }
+    yu::concurrent::wait_pool(state->pool);
+}
+
+#ifdef YTRACE_TEST
+
+//
+// Encodes 16 values in a BC4 block and returns the largest decoding error.
+//
+static int test_bc4_error(const ym::byte* values) {
+    auto blk = encode_bc4(values);
+    auto err = 0;
+    for (auto i = 0; i < 16; i++)
+        err = std::max(err, std::abs(decode_bc4(blk, i) - (int)values[i]));
+    return err;
+}
+
+//
+// Checks that the first 2D samples of a pixel in two stratified sets of ns
+// samples are all distinct.
+//
+template <rng_type rtype>
+static bool test_sampler_sets(int ns) {
+    for (auto s = 0; s < ns; s++) {
+        auto smp = make_sampler<rtype>(3, 5, s, ns);
+        auto rn = sample_next2f<rtype>(&smp);
+        for (auto t = ns; t < 2 * ns; t++) {
+            auto nsmp = make_sampler<rtype>(3, 5, t, ns);
+            auto nrn = sample_next2f<rtype>(&nsmp);
+            if (rn.x == nrn.x && rn.y == nrn.y) return false;
+        }
+    }
+    return true;
+}
+
+//
+// Mean luminance of a floor lit by a close light, traced with light
+// candidates, with or without reuse.
+//
+static float test_light_reuse_mean(bool reuse) {
+    static const ym::vec3i triangles[2] = {{0, 1, 2}, {0, 2, 3}};
+    static const ym::vec3f floor_pos[4] = {
+        {-2, 0, -2}, {-2, 0, 2}, {2, 0, 2}, {2, 0, -2}};
+    static const ym::vec3f floor_norm[4] = {
+        {0, 1, 0}, {0, 1, 0}, {0, 1, 0}, {0, 1, 0}};
+    static const ym::vec3f light_pos[4] = {{-0.5f, 0.5f, -0.5f},
+        {0.5f, 0.5f, -0.5f}, {0.5f, 0.5f, 0.5f}, {-0.5f, 0.5f, 0.5f}};
+    static const ym::vec3f light_norm[4] = {
+        {0, -1, 0}, {0, -1, 0}, {0, -1, 0}, {0, -1, 0}};
+
+    auto scn = make_scene();
+    auto floor_mat = add_material(scn);
+    set_material_microfacet(scn, floor_mat, {0.7f, 0.7f, 0.7f}, ym::zero3f,
+        ym::zero3f, 0.1f, 1, -1, -1, -1, -1, -1);
+    auto light_mat = add_material(scn);
+    set_material_emission(scn, light_mat, {4, 4, 4}, -1);
+    add_instance(scn, ym::identity_frame3f,
+        add_triangle_shape(
+            scn, 2, triangles, 4, floor_pos, floor_norm, nullptr),
+        floor_mat);
+    add_instance(scn, ym::identity_frame3f,
+        add_triangle_shape(
+            scn, 2, triangles, 4, light_pos, light_norm, nullptr),
+        light_mat);
+    add_camera(scn,
+        ym::lookat_frame3(
+            ym::vec3f{0, 3, 3}, ym::vec3f{0, 0, 0}, ym::vec3f{0, 1, 0}),
+        ym::pif / 3, 1);
+    init_intersection(scn);
+    init_lights(scn);
+
+    auto params = trace_params();
+    params.width = 32;
+    params.height = 32;
+    params.nsamples = 256;
+    params.light_candidates = 4;
+    params.light_reuse = reuse;
+    params.parallel = false;
+    auto state = make_state();
+    init_state(state, scn, params);
+    trace_next_samples(state, params.nsamples);
+    auto& img = get_traced_image(state);
+    auto mean = 0.0;
+    for (auto j = 0; j < img.height(); j++) {
+        for (auto i = 0; i < img.width(); i++) {
+            auto& c = img[{i, j}];
+            mean += luminance({c.x, c.y, c.z});
+        }
+    }
+    mean /= img.width() * img.height();
+    free_state(state);
+    free_scene(scn);
+    return (float)mean;
 }
 
+//
+// Test
+//
+void run_test() {
+    // bc4 blocks decode within half a palette step of the encoded values
+    ym::byte values[16];
+    for (auto i = 0; i < 16; i++) values[i] = (ym::byte)(i * 17);
+    assert(test_bc4_error(values) <= 19);
+    for (auto i = 0; i < 16; i++) values[i] = (ym::byte)(255 - i * 13);
+    assert(test_bc4_error(values) <= 15);
+    for (auto i = 0; i < 16; i++) values[i] = 77;
+    assert(test_bc4_error(values) == 0);
+    for (auto i = 0; i < 16; i++) values[i] = (i % 3) ? 20 : 220;
+    assert(test_bc4_error(values) == 0);
+
+    // samples from different stratified sets are distinct
+    assert(test_sampler_sets<rng_type::stratified>(16));
+    assert(test_sampler_sets<rng_type::cmjs>(16));
+
+    // light reuse converges to the image without reuse
+    auto mean = test_light_reuse_mean(false);
+    auto reuse_mean = test_light_reuse_mean(true);
+    assert(std::abs(reuse_mean - mean) < 0.02f * mean);
+}
+
+#endif
+
 }  // namespace ytrace
 
 #ifndef _WIN32
@@ -35,7 +35,8 @@
 ///
 /// The library can support raytracing either by building an internal
 /// acceleration structure with Yocto/Bvh or with user supplied intersection
-/// routines for custom intersection.
+/// routines for custom intersection. The internal BVH is called directly
+/// by the renderer, so it does not pay for the callback indirection.
 ///
 /// This library depends in yocto_math.h and yocto_utils.h/.cpp for concurrency.
 /// Eventually the concurrency calls will be move to std functions when
@@ -48,7 +49,9 @@
 ///
 /// 1. create a scene with `make_scene()`
 /// 2. add cameras with `add_camera()`, `set_camera()`
-/// 3. add add texture with `add_texture()`
+/// 3. add add texture with `add_texture()`; for textures larger than
+///    memory, convert them once with `save_tiled_texture()` and add them
+///    with `add_tiled_texture()` to page them in on demand
 /// 4. create material with `add_XXX_material()`
 /// 5. add shapes with `add_XXX_shape()`
 /// 6. add instances with `add_instance()`
@@ -76,10 +79,51 @@
 /// 6. either render sames successively with `trace_next_samples()`
 ///    or starts an asynchronousn renderer
 /// 7. get the rendered image with `get_traced_image()`
+/// 8. after editing the scene with `set_instance_frame()`,
+///    `update_shape_positions()` or `update_material()`, restart with
+///    `init_state()`; with `hit_cache_samples` set, camera hits are reused
+///    when only materials, lights or shading params change
+/// 9. for scenes lit through small openings, set `guiding` to learn where
+///    indirect light comes from; the guide is refined after passes that
+///    double in samples, so render with `trace_next_samples()`
+/// 10. for scenes with many lights, raise `light_candidates` to resample
+///    direct lighting from several light samples with one shadow ray, and
+///    set `light_reuse` to also reuse those of nearby pixels
+/// 11. for diffuse interiors, set `radiance_cache` to end paths into a cache
+///    of the light reflected by diffuse points, filled by the first
+///    `radiance_cache_samples`; leave it off for unbiased renders
+/// 12. to render on several machines, give each process a `crop` window or
+///    a `sample_start` and `sample_end` range, save its samples with
+///    `save_partial()` and combine the parts with `merge_partials()`
 ///
 ///
 /// ## History
 ///
+/// - v 0.51: distributed rendering by crop windows and sample ranges
+/// - v 0.50: gray and block compressed ldr textures
+/// - v 0.49: out-of-core textures paged from tiled files
+/// - v 0.48: radiance cache for diffuse interreflection
+/// - v 0.47: resampled direct lighting with reservoir reuse
+/// - v 0.46: path guiding
+/// - v 0.45: camera hit cache reused across renders
+/// - v 0.44: render kernels specialized by shader, sampler and filter
+/// - v 0.43: compact shading points
+/// - v 0.42: shadow transmission filtered during bvh traversal
+/// - v 0.41: incremental instance, shape and material edits
+/// - v 0.40: Owen-scrambled Sobol sampler
+/// - v 0.39: feature-guided a-trous denoiser
+/// - v 0.38: checkpoints of the progressive state
+/// - v 0.37: lean framebuffer resolved on request, half precision aux buffers
+/// - v 0.36: filtered splatting without a global image lock
+/// - v 0.35: work stealing block scheduler with automatic block splitting
+/// - v 0.34: adaptive sampling driven by per-block error estimates
+/// - v 0.33: wavefront path tracing mode
+/// - v 0.32: tiled texture layout with table-based srgb decoding
+/// - v 0.31: texture mipmaps filtered with ray cones
+/// - v 0.30: constant time sampling of emissive shapes with alias tables
+/// - v 0.29: light selection by estimated contribution with a light tree
+/// - v 0.28: importance sampling of environment maps
+/// - v 0.27: direct calls to the internal bvh instead of callbacks
 /// - v 0.26: thin glass material
 /// - v 0.25: added refraction (still buggy in some cases)
 /// - v 0.24: corrected transaprency bug
@@ -142,6 +186,7 @@ namespace ytrace {}
 #include <array>
 #include <cstdarg>
 #include <functional>
+#include <string>
 #include <vector>
 
 #include "yocto_math.h"
@@ -216,6 +261,8 @@ void set_camera(scene* scn, int cid, const ym::frame3f& frame, float yfov,
 /// - Returns:
 ///     - texture id
 ///
+/// Pixels are copied, with their mipmaps, so later changes are not seen.
+///
 int add_texture(scene* scn, int width, int height, const ym::vec4f* hdr);
 
 ///
@@ -226,11 +273,21 @@ int add_texture(scene* scn, int width, int height, const ym::vec4f* hdr);
 ///     - tid: texture id
 ///     - width: width
 ///     - height: height
-///     - ldr: ldr pixels (sRGB)
+///     - ldr: ldr pixels
+///     - compress: whether to block compress the texture
+///     - srgb: whether pixels are sRGB colors, or linear data like normals
 /// - Returns:
 ///     - texture id
 ///
-int add_texture(scene* scn, int width, int height, const ym::vec4b* ldr);
+/// Pixels are copied, with their mipmaps, so later changes are not seen.
+/// Mipmaps of sRGB textures are averaged after decoding, those of data
+/// textures as stored. Gray opaque textures are stored with one channel.
+/// With compress, the texture is compressed in 4x4 blocks, in BC1, BC3 or
+/// BC4 layout depending on its channels, taking 4 to 8 times less memory
+/// with some loss.
+///
+int add_texture(scene* scn, int width, int height, const ym::vec4b* ldr,
+    bool compress = false, bool srgb = true);
 
 ///
 /// Adds a texture in the scene.
@@ -250,14 +307,92 @@ inline int add_texture(scene* scn, const ym::image4f* img) {
 ///
 /// - Parameters:
 ///     - scn: scene
-///     - ldr: ldr image (sRGB)
+///     - ldr: ldr image
+///     - compress: whether to block compress the texture
+///     - srgb: whether pixels are sRGB colors, or linear data like normals
 /// - Returns:
 ///     - texture id
 ///
-inline int add_texture(scene* scn, const ym::image4b* img) {
-    return add_texture(scn, img->width(), img->height(), img->data());
+inline int add_texture(scene* scn, const ym::image4b* img,
+    bool compress = false, bool srgb = true) {
+    return add_texture(
+        scn, img->width(), img->height(), img->data(), compress, srgb);
 }
 
+///
+/// Saves a texture, with its mipmaps, to a tiled file that can be paged in
+/// with `add_tiled_texture()`. Levels are stored in square pages of 64x64
+/// texels. The file is written under a temporary name and then renamed.
+///
+/// - Parameters:
+///     - filename: tiled file name
+///     - width: width
+///     - height: height
+///     - hdr: hdr pixels
+/// - Returns:
+///     - whether the file was written
+///
+bool save_tiled_texture(const std::string& filename, int width, int height,
+    const ym::vec4f* hdr);
+
+///
+/// Saves a texture, with its mipmaps, to a tiled file. See above.
+///
+/// - Parameters:
+///     - filename: tiled file name
+///     - width: width
+///     - height: height
+///     - ldr: ldr pixels
+///     - srgb: whether pixels are sRGB colors, or linear data like normals
+/// - Returns:
+///     - whether the file was written
+///
+bool save_tiled_texture(const std::string& filename, int width, int height,
+    const ym::vec4b* ldr, bool srgb = true);
+
+///
+/// Saves a texture image to a tiled file. See above.
+///
+inline bool save_tiled_texture(
+    const std::string& filename, const ym::image4f* img) {
+    return save_tiled_texture(
+        filename, img->width(), img->height(), img->data());
+}
+
+///
+/// Saves a texture image to a tiled file. See above.
+///
+inline bool save_tiled_texture(
+    const std::string& filename, const ym::image4b* img, bool srgb = true) {
+    return save_tiled_texture(
+        filename, img->width(), img->height(), img->data(), srgb);
+}
+
+///
+/// Adds a paged texture to the scene from a tiled file saved with
+/// `save_tiled_texture()`. Only the header is read here; pages are read on
+/// demand during rendering and kept in a cache shared by the textures of
+/// the scene, bounded by `set_texture_cache_memory()`. The file must stay
+/// available while the scene is used.
+///
+/// - Parameters:
+///     - scn: scene
+///     - filename: tiled file name
+/// - Returns:
+///     - texture id or -1 if the file cannot be read
+///
+int add_tiled_texture(scene* scn, const std::string& filename);
+
+///
+/// Sets the memory budget of the cache of texture pages, 256 megabytes by
+/// default. Each rendering thread also keeps its last 16 pages.
+///
+/// - Parameters:
+///     - scn: scene
+///     - megabytes: memory budget in megabytes
+///
+void set_texture_cache_memory(scene* scn, int megabytes);
+
 ///
 /// Adds a black material to the scene. Use set_material_XXX() functions to
 /// customize it.
@@ -525,13 +660,15 @@ using intersect_first_cb = std::function<intersect_point(const ym::ray3f& ray)>;
 using intersect_any_cb = std::function<bool(const ym::ray3f& ray)>;
 
 ///
-/// Sets the intersection callbacks
+/// Sets the intersection callbacks. This replaces the internal BVH, if one
+/// was built with init_intersection().
 ///
 void set_intersection_callbacks(scene* scn, void* ctx,
     intersect_first_cb intersect_first, intersect_any_cb intersect_any);
 
 ///
-/// Initialize acceleration structure.
+/// Initialize acceleration structure. The internal BVH is used directly
+/// by the renderer and takes the place of the intersection callbacks.
 ///
 /// - Parameters:
 ///     - scn: trace scene
@@ -550,13 +687,52 @@ void set_logging_callbacks(
     scene* scn, logging_cb log_info, logging_cb log_error);
 
 ///
-/// Initialize lighting.
+/// Initialize lighting. This also builds the light tree used to pick
+/// shape lights by their estimated contribution, so it has to be called
+/// again after editing emissive instances.
 ///
 /// - Parameters:
 ///     - scn: trace scene
 ///
 void init_lights(scene* scn);
 
+///
+/// Moves an instance. The internal BVH is refit and, for emissive instances,
+/// the light tree bounds are updated, without calling init_intersection() or
+/// init_lights() again. After large motions, rebuild the BVH with
+/// init_intersection() for faster rendering.
+///
+/// - Parameters:
+///     - scn: trace scene
+///     - iid: instance id
+///     - frame: local-to-world frame
+///
+void set_instance_frame(scene* scn, int iid, const ym::frame3f& frame);
+
+///
+/// Updates a shape after its vertex positions or normals were edited in
+/// place, since vertex data is shared and not copied. The shape BVH is refit
+/// and, if the shape is emissive, its sampling tables and light tree bounds
+/// are recomputed.
+///
+/// - Parameters:
+///     - scn: trace scene
+///     - sid: shape id
+///
+void update_shape_positions(scene* scn, int sid);
+
+///
+/// Updates the lights after a material was edited with `set_material_XXX()`.
+/// Only the light tree bounds of the instances of the material are
+/// recomputed, unless they become or stop being emissive, in which case
+/// lights are initialized again.
+///
+/// - Parameters:
+///     - scn: trace scene
+///     - mid: material id
+///
+void update_material(scene* scn, int mid);
+
 ///
 /// Type of rendering algorithm (shader)
 ///
@@ -581,6 +757,8 @@ enum struct rng_type {
     stratified,
     /// correlated multi-jittered sampling
     cmjs,
+    /// Owen-scrambled Sobol sequence, valid for any number of samples
+    sobol,
 };
 
 ///
@@ -609,16 +787,21 @@ struct trace_params {
     int width = 0;
     /// height
     int height = 0;
-    /// number of samples
+    /// number of samples (maximum per pixel with adaptive sampling)
     int nsamples = 256;
     /// sampler type
     shader_type stype = shader_type::pathtrace;
+    /// trace paths in wavefront order (pathtrace shader only)
+    bool wavefront = false;
     /// random number generation type
     rng_type rtype = rng_type::stratified;
     /// filter type
     filter_type ftype = filter_type::box;
     /// compute auxiliary buffers
     bool aux_buffers = false;
+    /// store auxiliary buffers in half precision (for low sample counts,
+    /// since their means stop updating after about 2k samples)
+    bool aux_half = false;
     /// ambient lighting
     ym::vec3f amb = {0, 0, 0};
     /// view environment map
@@ -633,6 +816,47 @@ struct trace_params {
     float ray_eps = 1e-4f;
     /// parallel execution
     bool parallel = true;
+    /// adaptive sampling error threshold (0 to disable)
+    float adaptive_error = 0;
+    /// samples per pixel before blocks can stop in adaptive sampling
+    int adaptive_min_samples = 16;
+    /// average samples per pixel budget in adaptive sampling (0 for nsamples)
+    int adaptive_budget = 0;
+    /// samples per pixel whose camera hits are cached across init_state()
+    /// calls while camera and geometry are unchanged (0 to disable)
+    int hit_cache_samples = 0;
+    /// learn a path guide over the progressive passes and sample indirect
+    /// lighting with it (pathtrace shader without wavefront only); passes end
+    /// in trace_next_samples() and in the asynchronous renderer alike
+    bool guiding = false;
+    /// memory cap of the path guide in megabytes
+    int guiding_memory = 64;
+    /// light samples resampled for the shadow ray of camera hits in the
+    /// pathtrace shader
+    int light_candidates = 1;
+    /// reuse the light candidates of nearby pixels of a block from the
+    /// previous sample (biased; pathtrace shader without wavefront only)
+    bool light_reuse = false;
+    /// end paths into a cache of the radiance reflected by diffuse points
+    /// after a diffuse bounce (biased; pathtrace shader without wavefront
+    /// only; off for unbiased rendering)
+    bool radiance_cache = false;
+    /// samples per pixel that fill the radiance cache before paths end into
+    /// it, traced without it, also when rendering asynchronously
+    int radiance_cache_samples = 16;
+    /// radiance cache cell size as a fraction of the scene size
+    float radiance_cache_cell = 0.01f;
+    /// memory cap of the radiance cache in megabytes
+    int radiance_cache_memory = 64;
+    /// crop window of the pixels to render, from min included to max
+    /// excluded (empty for the whole image)
+    ym::bbox2i crop = {{0, 0}, {0, 0}};
+    /// first sample to trace, to split the samples of an image (turns
+    /// adaptive sampling off)
+    int sample_start = 0;
+    /// end of the samples to trace (0 for nsamples; turns adaptive sampling
+    /// off otherwise)
+    int sample_end = 0;
 };
 
 ///
@@ -679,23 +903,70 @@ void init_state(
 void free_state(trace_state*& state);
 
 ///
-/// Grabs a reference to the image from the state
+/// Grabs a reference to the image from the state. The state only keeps the
+/// sum of weighted samples and their weights, so the image is resolved at
+/// each call. Pixels without samples keep their previous values.
 ///
 ym::image4f& get_traced_image(trace_state* state);
 
 ///
-/// Grabs the image from the state
+/// Grabs the auxiliary buffers from the state. The state keeps the running
+/// means of normal, albedo and depth, in half precision if `aux_half` is set.
+/// A sample changes a half precision mean only if its difference from the
+/// mean over the sample count is at least half a precision step, about
+/// 1/2048 of the mean, so past about 2k samples the means stop following
+/// new samples. Use `aux_half` for previews and low sample counts only.
+/// Auxiliary buffers are only computed with the box filter.
 ///
 void get_aux_buffers(const trace_state* state, ym::image4f& norm,
     ym::image4f& albedo, ym::image4f& depth);
 
+///
+/// Denoising params
+///
+struct denoise_params {
+    /// number of a-trous iterations, each doubling the filter footprint
+    int niters = 5;
+    /// luminance edge stopping, in standard deviations
+    float color_sigma = 2;
+    /// normal edge stopping, as squared distance between normals
+    float normal_sigma = 0.02f;
+    /// depth edge stopping, as fraction of depth per pixel
+    float depth_sigma = 0.02f;
+};
+
+///
+/// Denoises the traced image with an edge-avoiding a-trous wavelet filter,
+/// guided by normals, albedo and depth from the auxiliary buffers if
+/// computed, or by color alone otherwise. Runs on its own threads if
+/// rendering is parallel, so it can be called on progressive frames also
+/// during asynchronous rendering.
+///
+ym::image4f get_denoised_image(
+    trace_state* state, const denoise_params& params);
+
 ///
 /// Gets the current sample number
 ///
 int get_cur_sample(const trace_state* state);
 
 ///
-/// Trace the next nsamples samples.
+/// Trace the next nsamples samples. Returns false when rendering is done.
+///
+/// Image blocks are traced along a Hilbert curve, with threads stealing
+/// blocks from each other. Blocks that take much longer than the others are
+/// split in four for the next batches.
+///
+/// With adaptive sampling, each call traces up to nsamples more samples in
+/// the blocks that are not converged. All blocks are first brought to
+/// `adaptive_min_samples`. A block stops when its error is below
+/// `adaptive_error`, or when it reaches nsamples. The sample budget goes to
+/// blocks with the largest error first.
+/// The error of a block is the average relative standard error of the
+/// luminance of its pixels. The current sample is the average number of
+/// samples per pixel. Samples are stratified in sets of
+/// `adaptive_min_samples`, so batches of that size work best. Asynchronous
+/// rendering does not use adaptive sampling.
 ///
 bool trace_next_samples(trace_state* state, int nsamples);
 
@@ -705,14 +976,59 @@ bool trace_next_samples(trace_state* state, int nsamples);
 inline ym::image4f trace_image(const scene* scn, const trace_params& params) {
     auto state = make_state();
     init_state(state, scn, params);
-    trace_next_samples(state, params.nsamples);
+    auto batch = (params.adaptive_error > 0) ? params.adaptive_min_samples :
+                                               params.nsamples;
+    while (trace_next_samples(state, batch)) {}
     auto img = get_traced_image(state);
     free_state(state);
     return img;
 }
 
 ///
-/// Starts an anyncrhounous renderer with a maximum of 256 samples.
+/// Saves a checkpoint of the progressive state to a binary file. The state is
+/// copied and the file is written in a background thread, after waiting for
+/// the previous write. The file is written under a temporary name and then
+/// renamed, so a crash leaves the previous checkpoint intact. Call between
+/// batches of samples, not during asynchronous rendering. Write errors are
+/// logged. The first save hashes the scene, reading all texture pixels,
+/// those of paged textures included.
+///
+void save_checkpoint(trace_state* state, const std::string& filename);
+
+///
+/// Loads a checkpoint in the progressive state, initializing it with params.
+/// Returns false if the file cannot be read, was saved for a different scene
+/// or with params that change the image. The number of samples can differ
+/// to continue a render further. On failure, the state is left initialized.
+///
+bool load_checkpoint(trace_state* state, const scene* scn,
+    const trace_params& params, const std::string& filename);
+
+///
+/// Saves the samples accumulated by the state to a partial file, for
+/// rendering an image in parts in separate processes. Each part renders a
+/// crop window or a range of samples, or both, with otherwise equal params.
+/// Only the crop window and the border reached by the pixel filter are
+/// saved. Returns false if the file cannot be written.
+///
+bool save_partial(const trace_state* state, const std::string& filename);
+
+///
+/// Merges partial files saved with save_partial() into the image, summing
+/// their samples and normalizing by the filter weights. Samples are summed
+/// in fixed point, so parts split by crop windows, samples or both give the
+/// same image as rendering in one process, with any filter. Adaptive
+/// sampling is off for sample ranges. Within crop windows, it adapts to the
+/// samples each process traces, as do guiding, light reuse and the radiance
+/// cache, so they do not split exactly. Returns false if a file cannot be
+/// read or is for an image of a different size.
+///
+bool merge_partials(
+    const std::vector<std::string>& filenames, ym::image4f& img);
+
+///
+/// Starts an asynchronous renderer, that traces samples from the current
+/// one to the end of the sample range, without adaptive sampling.
 ///
 void trace_async_start(trace_state* state);
 
@@ -721,6 +1037,13 @@ void trace_async_start(trace_state* state);
 ///
 void trace_async_stop(trace_state* state);
 
+#ifdef YTRACE_TEST
+///
+/// Runs the internal tests, checked with assert().
+///
+void run_test();
+#endif
+
 }  // namespace ytrace
 
 #endif
@@ -976,6 +976,11 @@ inline thread_pool* make_pool(int nthread = 0);
 ///
 inline void free_pool(thread_pool*& pool);
 
+///
+/// Number of threads in a thread pool
+///
+inline int get_pool_size(const thread_pool* pool);
+
 ///
 /// Wait for all jobs to finish
 ///
@@ -1665,6 +1670,9 @@ struct ThreadPool {
         return future.share();
     }
 
+    // number of threads
+    int size() const { return (int)threads.size(); }
+
     // wait for all tasks to finish
     void wait() {
         std::unique_lock<std::mutex> lock_guard(completion_lock);
@@ -1756,6 +1764,11 @@ inline std::shared_future<void> run_async(
     return pool->tp->async(task);
 }
 
+//
+// Number of threads
+//
+inline int get_pool_size(const thread_pool* pool) { return pool->tp->size(); }
+
 //
 // Wait for jobs to finish
 //